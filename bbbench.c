@@ -0,0 +1,516 @@
+#define _GNU_SOURCE //for ppoll
+#include <netdb.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bbbench.h"
+
+static const char * op_name[NOPS] = {"read", "write", "replace", "all"};
+
+static char * cfg_host = "localhost";
+static int cfg_port = 9000;
+static char * cfg_sock = NULL;  //Unix socket path, instead of host and port
+static char * cfg_board = NULL; //BOARD to use, the first one of server if NULL
+static int cfg_conns = 4;
+static int cfg_duration = 10;   //seconds
+static int cfg_mix[3] = {90, 5, 5}; //percent of read, write, replace
+static int cfg_rate = 0;        //total requests per second, 0 is closed loop
+static int cfg_pipeline = 1;    //requests in flight per connection
+static int cfg_keys = 1000;     //READ/REPLACE numbers are in 1..keys
+static int cfg_json = 0;
+
+static struct sockaddr_in srv_addr;
+static struct sockaddr_un srv_unaddr;
+static volatile int running = 1;
+
+//HELPER: time in nanoseconds
+static long long now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//HIST: bucket of value v. Values below 2*HIST_SUB have their own bucket,
+//above that each power of 2 is split in HIST_SUB buckets (HdrHistogram style)
+static int hist_index(const unsigned long long v){
+  if(v < 2*HIST_SUB){
+    return v;
+  }
+
+  const int msb = 63 - __builtin_clzll(v);
+  const int shift = msb - HIST_SUB_BITS;
+  const int idx = 2*HIST_SUB + (shift - 1)*HIST_SUB + (int)((v >> shift) - HIST_SUB);
+  return (idx < HIST_LEN) ? idx : (HIST_LEN - 1);
+}
+
+//HIST: highest value that falls in bucket idx
+static unsigned long long hist_value(const int idx){
+  if(idx < 2*HIST_SUB){
+    return idx;
+  }
+
+  const int shift = (idx - 2*HIST_SUB) / HIST_SUB + 1;
+  const unsigned long long m = (idx - 2*HIST_SUB) % HIST_SUB + HIST_SUB;
+  return ((m + 1) << shift) - 1;
+}
+
+static void hist_add(struct histogram * h, const unsigned long long v){
+  h->counts[hist_index(v)]++;
+  h->count++;
+  h->sum += v;
+  if(v > h->max){
+    h->max = v;
+  }
+}
+
+static void hist_merge(struct histogram * to, const struct histogram * from){
+  int i;
+  for(i=0; i < HIST_LEN; i++){
+    to->counts[i] += from->counts[i];
+  }
+  to->count += from->count;
+  to->sum += from->sum;
+  to->errors += from->errors;
+  if(from->max > to->max){
+    to->max = from->max;
+  }
+}
+
+//HIST: value at percentile p (0..100)
+static unsigned long long hist_percentile(const struct histogram * h, const double p){
+  unsigned long long seen = 0;
+  const unsigned long long want = (unsigned long long)((p / 100.0) * h->count + 0.5);
+  int i;
+
+  for(i=0; i < HIST_LEN; i++){
+    seen += h->counts[i];
+    if((seen >= want) && (seen > 0)){
+      const unsigned long long v = hist_value(i);
+      return (v < h->max) ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+//NET: connect to server, and read its welcome
+static int bench_connect(struct client * c){
+  c->fd = socket(cfg_sock ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if(c->fd < 0){
+    perror("socket");
+    return -1;
+  }
+
+  const int rv = cfg_sock ? connect(c->fd, (struct sockaddr *) &srv_unaddr, sizeof(struct sockaddr_un))
+                          : connect(c->fd, (struct sockaddr *) &srv_addr,   sizeof(struct sockaddr_in));
+  if(rv < 0){
+    perror("connect");
+    close(c->fd);
+    return -1;
+  }
+
+  if(cfg_sock == NULL){
+    const int opt = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+  }
+  return 0;
+}
+
+//HELPER: wait for fd to be readable, at most timeout us. With fd -1 just sleep
+static int wait_us(const int fd, const long long timeout){
+  struct pollfd pfd;
+  struct timespec ts;
+
+  ts.tv_sec  = timeout / 1000000;
+  ts.tv_nsec = (timeout % 1000000) * 1000;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  return ppoll(&pfd, (fd >= 0) ? 1 : 0, &ts, NULL);
+}
+
+//NET: get next line from reply buffer, waiting at most timeout us.
+//Returns line length, 0 on timeout and -1 on error
+static int bench_readln(struct client * c, char * line, const long long timeout){
+  while(1){
+    char * nl = memchr(&c->in[c->in_pos], '\n', c->in_len - c->in_pos);
+    if(nl){
+      const int len = nl - &c->in[c->in_pos];
+      const int copy = (len < MAX_REPLY_LEN) ? len : (MAX_REPLY_LEN - 1);
+      memcpy(line, &c->in[c->in_pos], copy);
+      line[copy] = '\0';
+      c->in_pos += len + 1;
+      return len + 1;
+    }
+
+    //move partial line to front
+    memmove(c->in, &c->in[c->in_pos], c->in_len - c->in_pos);
+    c->in_len -= c->in_pos;
+    c->in_pos = 0;
+
+    const int rv = wait_us(c->fd, timeout);
+    if(rv <= 0){
+      return (rv == 0) ? 0 : -1;
+    }
+
+    const ssize_t n = recv(c->fd, &c->in[c->in_len], sizeof(c->in) - c->in_len, 0);
+    if(n <= 0){
+      return -1;
+    }
+    c->in_len += n;
+  }
+}
+
+//pick next operation, by the mix
+static int bench_pick(struct client * c){
+  const int r = rand_r(&c->seed) % 100;
+  if(r < cfg_mix[OP_READ]){
+    return OP_READ;
+  }else if(r < (cfg_mix[OP_READ] + cfg_mix[OP_WRITE])){
+    return OP_WRITE;
+  }
+  return OP_REPLACE;
+}
+
+//queue one request in output buffer, and remember when it was meant to go
+static int bench_request(struct client * c, char * out, const long long when){
+  const int op = bench_pick(c);
+  const int num = 1 + rand_r(&c->seed) % cfg_keys;
+  int len = 0;
+
+  switch(op){
+    case OP_READ:
+      len = sprintf(out, "READ %d\n", num);
+      break;
+    case OP_WRITE:
+      len = sprintf(out, "WRITE bench %d message %d\n", c->id, c->sent);
+      break;
+    case OP_REPLACE:
+      len = sprintf(out, "REPLACE %d/bench %d replaced %d\n", num, c->id, c->sent);
+      break;
+  }
+
+  const int tail = (c->head + c->inflight) % MAX_INFLIGHT;
+  c->fifo[tail].op = op;
+  c->fifo[tail].when = when;
+  c->inflight++;
+  c->sent++;
+
+  return len;
+}
+
+//match a reply line with the oldest request in flight
+static void bench_reply(struct client * c, const char * line){
+  const struct request * r = &c->fifo[c->head];
+  const unsigned long long us = (now_ns() - r->when) / 1000;
+
+  c->head = (c->head + 1) % MAX_INFLIGHT;
+  c->inflight--;
+
+  //2.0 MESSAGE, 2.1 UNKNOWN, 3.0 WROTE and 3.1 UNKNOWN are all served
+  const int error = (strncmp(line, "2.2", 3) == 0) || (strncmp(line, "3.2", 3) == 0);
+  if(error){
+    c->hist[r->op].errors++;
+  }
+  hist_add(&c->hist[r->op], us);
+}
+
+static void * bench_thread(void * arg){
+  struct client * c = (struct client *) arg;
+  char line[MAX_REPLY_LEN];
+  char out[MAX_INFLIGHT * 64];
+
+  if(bench_connect(c) < 0){
+    c->failed = 1;
+    return NULL;
+  }
+
+  //welcome message, then login
+  snprintf(out, sizeof(out), "USER bench%d\n", c->id);
+  if( (bench_readln(c, line, 5000000) <= 0) ||
+      (send(c->fd, out, strlen(out), MSG_NOSIGNAL) <= 0) ||
+      (bench_readln(c, line, 5000000) <= 0) ){
+    c->failed = 1;
+    close(c->fd);
+    return NULL;
+  }
+
+  if(cfg_board){
+    snprintf(out, sizeof(out), "BOARD %s\n", cfg_board);
+    if( (send(c->fd, out, strlen(out), MSG_NOSIGNAL) <= 0) ||
+        (bench_readln(c, line, 5000000) <= 0) || (strncmp(line, "1.0", 3) != 0) ){
+      fprintf(stderr, "Error: BOARD %s failed\n", cfg_board);
+      c->failed = 1;
+      close(c->fd);
+      return NULL;
+    }
+  }
+
+  //open loop: each connection sends at its share of the rate
+  const long long interval = (cfg_rate > 0) ? (1000000000LL * cfg_conns) / cfg_rate : 0;
+  long long next = now_ns();
+
+  while(running || (c->inflight > 0)){
+    const long long now = now_ns();
+    int len = 0;
+
+    if(running){
+      if(interval == 0){  //closed loop, keep pipeline full
+        while(c->inflight < cfg_pipeline){
+          len += bench_request(c, &out[len], now);
+        }
+      }else{
+        //send what is due, timed from when it should have gone out, so a
+        //stalled server doesn't hide its latency
+        while((next <= now) && (c->inflight < MAX_INFLIGHT)){
+          len += bench_request(c, &out[len], next);
+          next += interval;
+        }
+      }
+    }
+
+    if((len > 0) && (send(c->fd, out, len, MSG_NOSIGNAL) != len)){
+      c->failed = 1;
+      break;
+    }
+
+    long long timeout = 1000000; //us
+    if(!running){
+      timeout = 2000000; //drain what is in flight
+    }else if(interval > 0){
+      timeout = (next - now_ns()) / 1000;
+      if(timeout < 0){
+        timeout = 0;
+      }
+    }
+
+    if(c->inflight == 0){
+      if(timeout > 0){
+        wait_us(-1, timeout);
+      }
+      continue;
+    }
+
+    const int rv = bench_readln(c, line, timeout);
+    if(rv < 0){
+      c->failed = 1;
+      break;
+    }else if(rv == 0){
+      if(!running){
+        break;  //gave up on the rest
+      }
+      continue;
+    }
+    bench_reply(c, line);
+
+    //take all other replies that are already here
+    while((c->inflight > 0) && (bench_readln(c, line, 0) > 0)){
+      bench_reply(c, line);
+    }
+  }
+
+  send(c->fd, "QUIT\n", 5, MSG_NOSIGNAL);
+  close(c->fd);
+  return NULL;
+}
+
+static void report_text(const struct histogram * total, const double secs, const int failed){
+  int i;
+
+  if(cfg_sock){
+    printf("bbbench: unix:%s", cfg_sock);
+  }else{
+    printf("bbbench: %s:%d", cfg_host, cfg_port);
+  }
+  printf(", %d connections (%d failed), %s loop",
+    cfg_conns, failed, (cfg_rate > 0) ? "open" : "closed");
+  if(cfg_rate > 0){
+    printf(" at %d req/s", cfg_rate);
+  }
+  printf(", pipeline %d, %.1f s, mix %d/%d/%d\n", cfg_pipeline, secs,
+    cfg_mix[OP_READ], cfg_mix[OP_WRITE], cfg_mix[OP_REPLACE]);
+
+  printf("%-8s %10s %8s %10s %9s %9s %9s %9s %9s\n",
+    "op", "count", "errors", "ops/s", "p50(us)", "p99(us)", "p999(us)", "max(us)", "mean(us)");
+
+  for(i=0; i < NOPS; i++){
+    const struct histogram * h = &total[i];
+    printf("%-8s %10llu %8llu %10.0f %9llu %9llu %9llu %9llu %9.1f\n",
+      op_name[i], h->count, h->errors, h->count / secs,
+      hist_percentile(h, 50.0), hist_percentile(h, 99.0), hist_percentile(h, 99.9),
+      h->max, h->count ? (double) h->sum / h->count : 0.0);
+  }
+}
+
+static void report_json(const struct histogram * total, const double secs, const int failed){
+  int i;
+
+  if(cfg_sock){
+    printf("{\"host\":\"unix:%s\",\"port\":0,", cfg_sock);
+  }else{
+    printf("{\"host\":\"%s\",\"port\":%d,", cfg_host, cfg_port);
+  }
+  printf("\"connections\":%d,\"failed\":%d,", cfg_conns, failed);
+  printf("\"mode\":\"%s\",\"rate\":%d,\"pipeline\":%d,\"duration_s\":%.3f,",
+    (cfg_rate > 0) ? "open" : "closed", cfg_rate, cfg_pipeline, secs);
+  printf("\"mix\":{\"read\":%d,\"write\":%d,\"replace\":%d},\"ops\":{",
+    cfg_mix[OP_READ], cfg_mix[OP_WRITE], cfg_mix[OP_REPLACE]);
+
+  for(i=0; i < NOPS; i++){
+    const struct histogram * h = &total[i];
+    printf("%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"ops_per_s\":%.1f,"
+      "\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,\"mean_us\":%.1f}",
+      (i > 0) ? "," : "", op_name[i], h->count, h->errors, h->count / secs,
+      hist_percentile(h, 50.0), hist_percentile(h, 99.0), hist_percentile(h, 99.9),
+      h->max, h->count ? (double) h->sum / h->count : 0.0);
+  }
+  printf("}}\n");
+}
+
+//CONFIG: parse "read:write:replace" percents
+static int config_mix(char * str){
+  char * save_ptr;
+  int i;
+
+  for(i=0; i < 3; i++){
+    char * tok = strtok_r((i == 0) ? str : NULL, ":", &save_ptr);
+    if(tok == NULL){
+      return -1;
+    }
+    cfg_mix[i] = atoi(tok);
+    if(cfg_mix[i] < 0){
+      return -1;
+    }
+  }
+  return ((cfg_mix[0] + cfg_mix[1] + cfg_mix[2]) == 100) ? 0 : -1;
+}
+
+static void usage(const char * name){
+  fprintf(stderr,
+    "Usage: %s [-h host] [-p port] [-u socket] [-b board] [-c connections] [-d seconds]\n"
+    "          [-m read:write:replace] [-r rate] [-P pipeline] [-n keys] [-j]\n"
+    "  -u  connect to the Unix socket path (BBSOCK), not to host and port\n"
+    "  -b  run on this BOARD of the server\n"
+    "  -r  total requests per second (open loop), 0 for closed loop (default)\n"
+    "  -P  requests in flight per connection, in closed loop\n"
+    "  -n  READ and REPLACE pick numbers in 1..keys\n"
+    "  -j  print results as JSON\n", name);
+}
+
+static int config_argv(const int argc, char * argv[]){
+  int opt;
+
+  while((opt = getopt(argc, argv, "h:p:u:b:c:d:m:r:P:n:j")) > 0){
+    switch(opt){
+      case 'h': cfg_host = optarg;              break;
+      case 'p': cfg_port = atoi(optarg);        break;
+      case 'u': cfg_sock = optarg;              break;
+      case 'b': cfg_board = optarg;             break;
+      case 'c': cfg_conns = atoi(optarg);       break;
+      case 'd': cfg_duration = atoi(optarg);    break;
+      case 'r': cfg_rate = atoi(optarg);        break;
+      case 'P': cfg_pipeline = atoi(optarg);    break;
+      case 'n': cfg_keys = atoi(optarg);        break;
+      case 'j': cfg_json = 1;                   break;
+      case 'm':
+        if(config_mix(optarg) < 0){
+          fprintf(stderr, "Error: mix must be 3 percents, that sum to 100\n");
+          return -1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  if( (cfg_port <= 0) || (cfg_port > 65535) || (cfg_conns <= 0) || (cfg_duration <= 0) ||
+      (cfg_rate < 0) || (cfg_pipeline <= 0) || (cfg_pipeline > MAX_INFLIGHT) || (cfg_keys <= 0)){
+    usage(argv[0]);
+    return -1;
+  }
+  return 0;
+}
+
+int main(const int argc, char * argv[]){
+  int i, j;
+
+  if(config_argv(argc, argv) < 0){
+    return EXIT_FAILURE;
+  }
+
+  if(cfg_sock){
+    if(strlen(cfg_sock) >= sizeof(srv_unaddr.sun_path)){
+      fprintf(stderr, "Error: socket path %s is too long\n", cfg_sock);
+      return EXIT_FAILURE;
+    }
+    memset(&srv_unaddr, 0, sizeof(struct sockaddr_un));
+    srv_unaddr.sun_family = AF_UNIX;
+    strcpy(srv_unaddr.sun_path, cfg_sock);
+  }else{
+    struct hostent * hinfo = gethostbyname(cfg_host);
+    if(hinfo == NULL){
+      fprintf(stderr, "Error: can't resolve %s\n", cfg_host);
+      return EXIT_FAILURE;
+    }
+    memset(&srv_addr, 0, sizeof(struct sockaddr_in));
+    srv_addr.sin_family = AF_INET;
+    memcpy(&srv_addr.sin_addr, hinfo->h_addr, hinfo->h_length);
+    srv_addr.sin_port = htons(cfg_port);
+  }
+
+  struct client * clients = (struct client *) calloc(cfg_conns, sizeof(struct client));
+  if(clients == NULL){
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+
+  const long long start = now_ns();
+  for(i=0; i < cfg_conns; i++){
+    clients[i].id = i;
+    clients[i].seed = (unsigned int)(start ^ (i * 2654435761u));
+    if(pthread_create(&clients[i].thread, NULL, bench_thread, &clients[i]) != 0){
+      perror("pthread_create");
+      return EXIT_FAILURE;
+    }
+  }
+
+  sleep(cfg_duration);
+  running = 0;
+
+  struct histogram * total = (struct histogram *) calloc(NOPS, sizeof(struct histogram));
+  if(total == NULL){
+    perror("calloc");
+    return EXIT_FAILURE;
+  }
+
+  int failed = 0;
+  for(i=0; i < cfg_conns; i++){
+    pthread_join(clients[i].thread, NULL);
+    failed += clients[i].failed;
+
+    for(j=0; j < OP_ALL; j++){
+      hist_merge(&total[j], &clients[i].hist[j]);
+      hist_merge(&total[OP_ALL], &clients[i].hist[j]);
+    }
+  }
+  const double secs = (now_ns() - start) / 1e9;
+
+  if(cfg_json){
+    report_json(total, secs, failed);
+  }else{
+    report_text(total, secs, failed);
+  }
+
+  free(total);
+  free(clients);
+  return (failed == cfg_conns) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
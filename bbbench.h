@@ -0,0 +1,45 @@
+#include <pthread.h>
+
+//operations we time
+#define OP_READ     0
+#define OP_WRITE    1
+#define OP_REPLACE  2
+#define OP_ALL      3
+#define NOPS        4
+
+//histogram has HIST_SUB buckets in each power of 2, of microseconds
+#define HIST_SUB_BITS 6
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_LEN      (2*HIST_SUB + 40*HIST_SUB)
+
+//max requests in flight on one connection
+#define MAX_INFLIGHT 1024
+#define MAX_REPLY_LEN 512
+
+struct histogram {
+  unsigned long long counts[HIST_LEN];
+  unsigned long long count, errors;
+  unsigned long long sum, max;
+};
+
+struct request {  //request in flight
+  int op;
+  long long when;   //when it was sent, or should have been
+};
+
+struct client {   //one connection, run by one thread
+  pthread_t thread;
+  int id;
+  int fd;
+  unsigned int seed;
+  int failed;
+  int sent;
+
+  struct request fifo[MAX_INFLIGHT];
+  int head, inflight;
+
+  char in[16*1024]; //reply buffer
+  int in_pos, in_len;
+
+  struct histogram hist[OP_ALL];
+};
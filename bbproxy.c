@@ -0,0 +1,295 @@
+#define _GNU_SOURCE //for ppoll
+#include <netdb.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+//TCP proxy, that delays or drops connections. Used by cluster.sh to put
+//latency and failures between bbserv peers.
+
+#define CHUNK_LEN 4096
+
+struct chunk {    //data waiting for its time
+  long long due;  //when it can be sent, in ns
+  int len, off;
+  char data[CHUNK_LEN];
+  struct chunk * next;
+};
+
+struct pipe_dir { //one direction of a connection
+  int from, to;
+  struct chunk * head, * tail;
+  int eof;
+};
+
+struct conn {
+  pthread_t thread;
+  int cfd, sfd;   //client and server side
+  int drop;       //black hole this connection
+};
+
+static int cfg_port = 0;
+static struct sockaddr_in cfg_target;
+static int cfg_delay = 0;   //one way delay, in ms
+static int cfg_drop = 0;    //percent of connections to black hole
+static int cfg_debug = 0;
+
+//HELPER: time in nanoseconds
+static long long now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//read what is there, and queue it for later
+static int dir_read(struct pipe_dir * d){
+  struct chunk * c = (struct chunk *) malloc(sizeof(struct chunk));
+  if(c == NULL){
+    return -1;
+  }
+
+  c->len = recv(d->from, c->data, CHUNK_LEN, 0);
+  if(c->len <= 0){
+    free(c);
+    d->eof = 1;
+    return 0;
+  }
+
+  c->off = 0;
+  c->due = now_ns() + (long long) cfg_delay * 1000000LL;
+  c->next = NULL;
+  if(d->tail){
+    d->tail->next = c;
+  }else{
+    d->head = c;
+  }
+  d->tail = c;
+  return 0;
+}
+
+//send chunks that are due
+static int dir_write(struct pipe_dir * d){
+  const long long now = now_ns();
+
+  while(d->head && (d->head->due <= now)){
+    struct chunk * c = d->head;
+    const ssize_t n = send(d->to, &c->data[c->off], c->len - c->off, MSG_NOSIGNAL);
+    if(n < 0){
+      return -1;
+    }
+
+    c->off += n;
+    if(c->off < c->len){
+      break;
+    }
+
+    d->head = c->next;
+    if(d->head == NULL){
+      d->tail = NULL;
+    }
+    free(c);
+  }
+  return 0;
+}
+
+static void dir_free(struct pipe_dir * d){
+  while(d->head){
+    struct chunk * c = d->head;
+    d->head = c->next;
+    free(c);
+  }
+}
+
+static void * conn_thread(void * arg){
+  struct conn * c = (struct conn *) arg;
+  struct pipe_dir dirs[2];
+  struct pollfd pfd[2];
+  char buf[CHUNK_LEN];
+  int i;
+
+  if(c->drop){
+    //accept what comes, but never answer
+    while(recv(c->cfd, buf, sizeof(buf), 0) > 0);
+    close(c->cfd);
+    free(c);
+    return NULL;
+  }
+
+  memset(dirs, 0, sizeof(dirs));
+  dirs[0].from = c->cfd;  dirs[0].to = c->sfd;
+  dirs[1].from = c->sfd;  dirs[1].to = c->cfd;
+
+  while(!(dirs[0].eof && (dirs[0].head == NULL)) &&
+        !(dirs[1].eof && (dirs[1].head == NULL))){
+
+    //wait for data, or for the next chunk to be due
+    long long next = -1;
+    for(i=0; i < 2; i++){
+      pfd[i].fd = dirs[i].eof ? -1 : dirs[i].from;
+      pfd[i].events = POLLIN;
+      if(dirs[i].head && ((next == -1) || (dirs[i].head->due < next))){
+        next = dirs[i].head->due;
+      }
+    }
+
+    struct timespec ts, * tsp = NULL;
+    if(next != -1){
+      long long wait = next - now_ns();
+      if(wait < 0){
+        wait = 0;
+      }
+      ts.tv_sec  = wait / 1000000000LL;
+      ts.tv_nsec = wait % 1000000000LL;
+      tsp = &ts;
+    }
+
+    if(ppoll(pfd, 2, tsp, NULL) < 0){
+      break;
+    }
+
+    int err = 0;
+    for(i=0; i < 2; i++){
+      if((pfd[i].fd >= 0) && (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))){
+        err |= dir_read(&dirs[i]);
+      }
+      err |= dir_write(&dirs[i]);
+
+      //pass on half close, after all data went out
+      if(dirs[i].eof && (dirs[i].head == NULL)){
+        shutdown(dirs[i].to, SHUT_WR);
+      }
+    }
+    if(err){
+      break;
+    }
+  }
+
+  dir_free(&dirs[0]);
+  dir_free(&dirs[1]);
+  close(c->cfd);
+  close(c->sfd);
+  free(c);
+  return NULL;
+}
+
+static int config_argv(const int argc, char * argv[]){
+  char * target = NULL;
+  int opt;
+
+  while((opt = getopt(argc, argv, "l:t:d:x:v")) > 0){
+    switch(opt){
+      case 'l': cfg_port  = atoi(optarg); break;
+      case 't': target    = optarg;       break;
+      case 'd': cfg_delay = atoi(optarg); break;
+      case 'x': cfg_drop  = atoi(optarg); break;
+      case 'v': cfg_debug = 1;            break;
+      default:
+        return -1;
+    }
+  }
+
+  if((target == NULL) || (cfg_port <= 0) || (cfg_delay < 0) || (cfg_drop < 0) || (cfg_drop > 100)){
+    return -1;
+  }
+
+  char * colon = strrchr(target, ':');
+  if(colon == NULL){
+    return -1;
+  }
+  *colon = '\0';
+
+  struct hostent * hinfo = gethostbyname(target);
+  if(hinfo == NULL){
+    fprintf(stderr, "Error: can't resolve %s\n", target);
+    return -1;
+  }
+  memset(&cfg_target, 0, sizeof(struct sockaddr_in));
+  cfg_target.sin_family = AF_INET;
+  memcpy(&cfg_target.sin_addr, hinfo->h_addr, hinfo->h_length);
+  cfg_target.sin_port = htons(atoi(&colon[1]));
+
+  return 0;
+}
+
+int main(const int argc, char * argv[]){
+  struct sockaddr_in sa;
+  unsigned int seed = getpid();
+
+  if(config_argv(argc, argv) < 0){
+    fprintf(stderr, "Usage: %s -l port -t host:port [-d delay_ms] [-x drop_percent] [-v]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  const int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  const int opt = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family      = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port        = htons(cfg_port);
+  if( (bind(lfd, (struct sockaddr *) &sa, sizeof(struct sockaddr_in)) < 0) ||
+      (listen(lfd, 64) < 0) ){
+    perror("bind");
+    return EXIT_FAILURE;
+  }
+
+  while(1){
+    const int cfd = accept(lfd, NULL, NULL);
+    if(cfd < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("accept");
+      break;
+    }
+
+    struct conn * c = (struct conn *) calloc(1, sizeof(struct conn));
+    if(c == NULL){
+      close(cfd);
+      continue;
+    }
+    c->cfd = cfd;
+    c->drop = (rand_r(&seed) % 100) < cfg_drop;
+
+    if(!c->drop){
+      c->sfd = socket(AF_INET, SOCK_STREAM, 0);
+      if(connect(c->sfd, (struct sockaddr *) &cfg_target, sizeof(struct sockaddr_in)) < 0){
+        perror("connect");
+        close(c->sfd);
+        close(cfd);
+        free(c);
+        continue;
+      }
+      setsockopt(c->sfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+      setsockopt(cfd,    IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+    }
+
+    if(cfg_debug){
+      printf("[PROXY] connection %s\n", c->drop ? "dropped" : "forwarded");
+    }
+
+    if(pthread_create(&c->thread, NULL, conn_thread, c) != 0){
+      close(cfd);
+      if(!c->drop){
+        close(c->sfd);
+      }
+      free(c);
+      continue;
+    }
+    pthread_detach(c->thread);
+  }
+
+  close(lfd);
+  return EXIT_SUCCESS;
+}
@@ -1,48 +1,142 @@
+#define _GNU_SOURCE //for mremap
 #include <netdb.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <ctype.h>
+#include <stdarg.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/syscall.h>  //for io_uring, we don't need liburing
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "bbserv.h"
 
+//functions only main() calls. bbstore.c builds us without main, and
+//without them the rest of the server would be unused too
+#ifdef BBSERV_NO_MAIN
+#define MAIN_ONLY __attribute__((unused))
+#else
+#define MAIN_ONLY
+#endif
+
 static const char* pid_fileame = "bbserv.pid";
 static const char* nousername = "noname";
 
 static int cfg_port[2] = {9000, 10000};
 static int cfg_max_threads = 20;
+static int cfg_min_threads = 0;       //0 is THMAX, a fixed pool
+static int cfg_queue_wait = 1000;     //us a request can wait, before we add a worker
+static int cfg_idle_time = 30;        //s a worker can idle, before it exits
+static int cfg_acceptors = 1;         //acceptor shards, 0 is one per CPU
+static int cfg_io = IO_CLASSIC;       //how we accept and read connections
+static int cfg_backlog = MAX_RBB_LEN; //client connections a shard queues, before it sheds
+static int cfg_queue_deadline = 0;    //ms a client connection can wait in queue, 0 is no limit
+static int cfg_read_timeout = 300;    //s a client can be silent, 0 is no limit
+static int cfg_write_timeout = 30;    //s a reply can wait on a client that doesn't read
+static int cfg_sync_read_timeout = 1000;  //ms between sync lines, and for peer replies
+static int cfg_sync_write_timeout = 1000; //ms a sync line can wait on a peer
+static int cfg_user_rate[2] = {0, 0};   //reads and writes/s a user can do, 0 is no limit
+static int cfg_ip_rate[2]   = {0, 0};   //same, for an IP
 static int cfg_daemon = 1;
 static int cfg_debug = 0;
-
-static char * cfg_bulletin_file = NULL;  //bulletin board file
+static int cfg_cache_mem = 1024*1024;  //memory for rendered replies
+static int cfg_metrics_port = 0;       //Prometheus text metrics, 0 is off
+static int cfg_trace = 0;              //record 2PC spans for TRACE
+static int cfg_log_level = LOG_WARN;
+static int cfg_log_rate = 1000;        //lines/s each thread can log
+static unsigned int cfg_inject_seed = 1;
+static struct inject cfg_inject[NINJECT]; //delays and failures, by site
+static int cfg_ninject = 0;               //sites with something to do
+
+static char * cfg_board_file[MAX_BOARDS]; //BBFILE entries, [name:]path
+static int cfg_nboards = 0;
+static char * cfg_group = NULL;          //our replica group, NULL if boards aren't partitioned
+static char * cfg_route[MAX_GROUPS];     //ROUTE entries, group host:port ...
+static int cfg_nroutes = 0;
+static int cfg_route_idle = 4;           //connections kept open to each group
+static char * cfg_sock[2] = {NULL, NULL}; //Unix socket paths, for clients and sync
+static char * cfg_trace_file = NULL;     //TRACE output, bbserv.trace.json if NULL
 
 static struct peer * cfg_peer = NULL;
 static unsigned int cfg_npeers = 0;
-
-static struct bulletin_board bboard;
-static struct bulletin_item commited;
-static int commited_index = -1;
-
-static struct bounded_buf rbb;  //request bounded buffer
-static struct context * tctx = NULL;  //thread contexts
-
-static void sig_handler(const int sig);
-
-static int sfd[2];  //sockets for our ports
+//a reload swaps cfg_peer with all boards write locked, and this too. Stats
+//take this one, so a slow 2PC on a board doesn't hold them up
+static pthread_mutex_t peers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct bulletin_board boards[MAX_BOARDS];  //boards[0] is where sessions start
+static int nboards = 0;
+
+static struct group groups[MAX_GROUPS];  //groups[0] is ours
+static int ngroups = 1;
+static struct ring_point ring[MAX_GROUPS * RING_POINTS];
+static int ring_len = 0;
+
+static struct watch_hub whub;   //WATCH connections
+static struct shard * shards = NULL;  //acceptors, each with a request bounded buffer
+static int nshards = 0;
+static struct context * tctx[MAX_SLOTS];  //thread contexts, by slot. NULL until first used
+
+static void __attribute__((format(printf, 2, 3))) log_msg(const int level, const char * fmt, ...);
+static int select_ports(struct shard * sh, int * port);
+static int bb_push(struct shard * sh, const int fd, const int prio);
+static int ring_owner(const char * name);
+
+
+static struct thread_stats other_stats; //threads without a context
+static __thread struct thread_stats * tstats = &other_stats;
+static __thread int tsend_failed = -1;  //fd of our last failed send, -1 if none
+static int stat_sessions = 0;   //connections in request_handler
+static unsigned long stat_throttled[2] = {0, 0};  //reads and writes we turned down
+
+static struct rate_shard rates[NRATE_SHARDS] =  //user and IP buckets
+  {[0 ... NRATE_SHARDS-1] = {.mutex = PTHREAD_MUTEX_INITIALIZER}};
+
+static __thread struct trace_ring * tring = NULL;  //NULL if not tracing
+static unsigned long trace_seq = 0;   //for correlation ids
+
+static __thread struct log_ring * lring = NULL;  //our log lines
+static struct log_ring * log_rings = NULL;  //rings of all threads
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_t log_thread;
+static int log_running = 0;
+static int log_tids = 0;
+
+static __thread unsigned int inj_seed = 0;  //0 until first use
+static unsigned int inj_threads = 0;
+
+static int mfd = -1;            //metrics socket
+static pthread_t mthread;       //metrics thread
+
+static int sigfd = -1;          //SIGHUP and SIGQUIT, read by sig_thread
+static pthread_t sthread;
+static unsigned long stat_reloads[2] = {0, 0};  //applied and failed reloads
+static unsigned long stat_routed[2] = {0, 0};   //requests we routed, and failed to
+static unsigned long stat_route_connects = 0;
 
 //HELPER: convert string to int
 static int stoi(const char * str){
   char * endptr;
+  errno = 0;  //strtol only sets it on errors
   const long num = strtol(str, &endptr, 10);
   if((errno == ERANGE && (num == LONG_MAX || num == LONG_MIN)) ||
       (errno != 0 && num == 0)  ){
@@ -145,812 +239,4532 @@ static int readln(const int fd, char *buf, const int buf_size){
   return len;
 }
 
-static int bulletin_map(){
-  struct stat st;
+//HELPER: monotonic time in ns
+static long long now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-  bboard.fd = open(cfg_bulletin_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-  if(bboard.fd == -1){
-    perror("open");
-  }
+//HELPER: set SO_RCVTIMEO or SO_SNDTIMEO of fd, in ms. 0 is no limit
+static void sock_timeout(const int fd, const int opt, const int ms){
+  struct timeval tv;
+  tv.tv_sec  = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(struct timeval));
+}
 
-  if(fstat(bboard.fd, &st) == -1){
-    perror("lstat");
+//URING: setup ring r, for one thread. Returns -1 if kernel can't
+static int uring_open(struct uring * r, const unsigned entries){
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(struct io_uring_params));
+  p.flags = IORING_SETUP_SINGLE_ISSUER; //only the thread that made it submits
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if((r->fd < 0) && (errno == EINVAL)){ //before 6.0
+    memset(&p, 0, sizeof(struct io_uring_params));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  }
+  if(r->fd < 0){
+    r->fd = -1;
     return -1;
   }
 
-  if(st.st_size == 0){  //if its a new file
-    //allocate space for the records
-    bboard.board_len = 0;
-    bboard.board_size = 10;
-    st.st_size = bboard.board_size * sizeof(struct bulletin_item);
-    if(ftruncate(bboard.fd, st.st_size) < 0){
-      perror("ftruncate");
-      return -1;
-    }
-  }else{
+  if((p.features & IORING_FEAT_SINGLE_MMAP) == 0){  //before 5.4
+    close(r->fd);
+    r->fd = -1;
+    errno = ENOSYS;
+    return -1;
+  }
 
-    //find how much items we have in bulletin board
-    int i;
-    for(i=0; i < bboard.board_size; i++){
-      if(bboard.items[i].num == 0){ //item with 0 is free
-        break;
-      }
-      bboard.board_len++;
-    }
-    bboard.board_size = st.st_size / sizeof(struct bulletin_item);
+  r->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  const size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(cq_len > r->ring_len){
+    r->ring_len = cq_len;
   }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
 
-  bboard.items =  mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, bboard.fd, 0);
-  if(bboard.items == MAP_FAILED){
-    perror("mmap");
+  r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if((r->ring == MAP_FAILED) || (r->sqes == MAP_FAILED)){
+    if(r->ring != MAP_FAILED){
+      munmap(r->ring, r->ring_len);
+    }
+    if(r->sqes != MAP_FAILED){
+      munmap(r->sqes, r->sqes_len);
+    }
+    close(r->fd);
+    r->fd = -1;
     return -1;
   }
 
+  char * base = (char *) r->ring;
+  r->sq_head    = (unsigned *) (base + p.sq_off.head);
+  r->sq_tail    = (unsigned *) (base + p.sq_off.tail);
+  r->sq_array   = (unsigned *) (base + p.sq_off.array);
+  r->sq_mask    = *(unsigned *) (base + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->cq_head    = (unsigned *) (base + p.cq_off.head);
+  r->cq_tail    = (unsigned *) (base + p.cq_off.tail);
+  r->cq_mask    = *(unsigned *) (base + p.cq_off.ring_mask);
+  r->cqes       = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+
+  unsigned i;
+  for(i=0; i < r->sq_entries; i++){ //SQ slot i is always SQE i
+    r->sq_array[i] = i;
+  }
   return 0;
 }
 
-//NET: connect a peer
-static int peer_connect(struct peer * p) {
-
-  p->fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(p->fd < 0){
-    perror("socket");
-    return -1;
+//URING: close ring. Kernel cancels what is still in it
+static void uring_close(struct uring * r){
+  if(r->fd < 0){
+    return;
   }
+  munmap(r->sqes, r->sqes_len);
+  munmap(r->ring, r->ring_len);
+  close(r->fd);
+  r->fd = -1;
+}
 
-  if(connect(p->fd, (struct sockaddr *)&p->inaddr, sizeof(struct sockaddr_in)) < 0) {
-    perror("connect");
-    close(p->fd);
-    return -1;
+//URING: a zeroed SQE to fill, or NULL if SQ is full
+static struct io_uring_sqe * uring_sqe(struct uring * r){
+  const unsigned tail = *r->sq_tail;  //only we move it
+  if((tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) >= r->sq_entries){
+    return NULL;
   }
-  return 0;
+  struct io_uring_sqe * sqe = &r->sqes[tail & r->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
 }
 
-//SYNC: connect to all peers
-static int psync_connect(){
-  int i;
-  for(i=0; i < cfg_npeers; i++){
-    if(peer_connect(&cfg_peer[i]) == -1)
-      return -1;
-  }
-  return 0;
+//URING: pass the SQE we filled to kernel. It goes out on next uring_wait
+static void uring_push(struct uring * r){
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+  r->pending++;
 }
 
-//SYNC: disconnect all peers
-static void psync_disconnect(){
-  int i;
-  for(i=0; i < cfg_npeers; i++){
-    if(cfg_peer[i].fd > 0){
-      shutdown(cfg_peer[i].fd, SHUT_RDWR);
-      close(cfg_peer[i].fd);
-      cfg_peer[i].fd = -1;
+//URING: submit pending SQEs, and wait for a CQE. Call uring_seen after
+static int uring_wait(struct uring * r, struct io_uring_cqe ** cqe){
+  while(1){
+    const unsigned head = *r->cq_head;
+    if((r->pending == 0) && (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))){
+      *cqe = &r->cqes[head & r->cq_mask];
+      return 0;
+    }
+
+    const int rv = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(rv < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return -1;
     }
+    r->pending -= rv;
   }
 }
 
-static int psync_rdall(char * buf, const int buf_size){
+//URING: we are done with the CQE from uring_wait
+static void uring_seen(struct uring * r){
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
 
-  int ack = 0, nack = 0;
-  struct timespec timeout;
+//URING: recv on fd, through ring r. With ms > 0, a linked timeout
+//cancels the recv, like SO_RCVTIMEO does for recv()
+static ssize_t uring_recv(struct uring * r, const int fd, void * buf, const size_t len, const int ms){
+  struct io_uring_cqe * cqe;
+  struct __kernel_timespec ts;
+  int res = 0, ncqes = (ms > 0) ? 2 : 1;
 
-  int i, nfds = 0;
-  for(i=0; i < cfg_npeers; i++){
-    if(nfds < cfg_peer[i].fd)
-      nfds = cfg_peer[i].fd;
+  struct io_uring_sqe * sqe = uring_sqe(r);
+  if(sqe == NULL){
+    errno = EBUSY;
+    return -1;
   }
-  nfds++;
-
-  timeout.tv_sec = 1;
-  timeout.tv_nsec = 0;
-  if(cfg_debug){
-    timeout.tv_sec += 2*DEBUG_TIME_WR; //in debug, we sleep between writes
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd     = fd;
+  sqe->addr   = (unsigned long) buf;
+  sqe->len    = len;
+  sqe->user_data = 1;
+  if(ms > 0){
+    sqe->flags = IOSQE_IO_LINK;
   }
+  uring_push(r);
 
-  while((ack + nack) < cfg_npeers){
+  if(ms > 0){
+    sqe = uring_sqe(r);
+    if(sqe == NULL){  //can't be, we use 2 of 4 SQEs
+      errno = EBUSY;
+      return -1;
+    }
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr   = (unsigned long) &ts;
+    sqe->len    = 1;
+    sqe->user_data = 0;
+    uring_push(r);
+  }
 
-    fd_set rdfds;
-    FD_ZERO(&rdfds);
-    for(i=0; i < cfg_npeers; i++){
-      FD_SET(cfg_peer[i].fd, &rdfds);
+  while(ncqes-- > 0){ //timeout has its own CQE, even when recv wins
+    if(uring_wait(r, &cqe) < 0){
+      return -1;
+    }
+    if(cqe->user_data == 1){
+      res = cqe->res;
     }
+    uring_seen(r);
+  }
 
-    switch(pselect(nfds + 1, &rdfds, NULL, NULL, &timeout, NULL)){
-      case -1:
-        perror("pselect");
-      case 0:
-        return -1;  //on timeout
+  if(res < 0){
+    errno = (res == -ECANCELED) ? EAGAIN : -res;
+    return -1;
+  }
+  return res;
+}
 
-      default:
+//HELPER: readln on a client connection. We read in blocks, into ctx->in,
+//not a byte for each syscall. Lines longer than buf_size are cut.
+static int conn_readln(struct context * ctx, char *buf, const int buf_size){
+  int len = 0;
 
-        for(i=0; i < cfg_npeers; i++){
-          if(FD_ISSET(cfg_peer[i].fd, &rdfds)){
+  while(1){
+    if(ctx->in_pos == ctx->in_len){
+      const ssize_t n = (ctx->ring.fd >= 0) ? uring_recv(&ctx->ring, ctx->fd, ctx->in, CONN_BUF_LEN, ctx->rd_timeout)
+                                           : recv(ctx->fd, ctx->in, CONN_BUF_LEN, 0);
+      if(n < 0){
+        if(errno == EINTR){
+          continue;
+        }else if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+          log_msg(LOG_INFO, "[THREAD] sock %d silent for %d ms, closing\n", ctx->fd, ctx->rd_timeout);
+        }else{
+          perror("recv");
+        }
+        return -1;
+      }else if(n == 0){
+        return 0;
+      }
+      ctx->in_pos = 0;
+      ctx->in_len = n;
+    }
 
+    const char c = ctx->in[ctx->in_pos++];
+    if(c == '\r'){
+      continue;
+    }else if(c == '\n'){
+      break;
+    }else if(len < buf_size){
+      buf[len++] = c;
+    }
+  }
 
-            if(readln(cfg_peer[i].fd, buf, buf_size) <= 0){
-              return -1;
-            }
+  buf[len] = '\0';
+  return len;
+}
 
-            if(cfg_debug){
-              printf("[PSYNC:%d] %s\n", i, buf);
-            }
+//STAT: add a sample to histogram. Counters are relaxed atomics, so
+//they can be read by STATS while we write them
+static void stat_hist_add(struct stat_hist * h, const long long ns){
+  int b = 0;
+  if(ns >= 1024){
+    b = 64 - __builtin_clzll(ns >> 10);
+    if(b >= STAT_HIST_LEN){
+      b = STAT_HIST_LEN - 1;
+    }
+  }
 
-            if(strcmp(buf, "NACK") == 0){  //if peer failed
-              nack++;
-            }else if(strcmp(buf, "ACK") == 0){
-              ack++;
-            }
-          }
-        }
-        break;
-    } //end select
-  } //end while
+  __atomic_fetch_add(&h->counts[b], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+  if((unsigned long) ns > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)){
+    __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+  }
+}
 
-  return (nack > 0) ? -1 : 0; //if even one nack, then return error
+//STAT: add src histogram to dst
+static void stat_hist_merge(struct stat_hist * dst, struct stat_hist * src){
+  int i;
+  for(i=0; i < STAT_HIST_LEN; i++){
+    dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+  }
+  dst->count  += __atomic_load_n(&src->count,  __ATOMIC_RELAXED);
+  dst->sum_ns += __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED);
+
+  const unsigned long max = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+  if(dst->max_ns < max){
+    dst->max_ns = max;
+  }
 }
 
-static int psync_wrall(const char * buf){
+//STAT: upper bound of quantile q, in ns. Not more than the max we saw
+static unsigned long stat_hist_quantile(const struct stat_hist * h, const double q){
+  unsigned long sum = 0;
   int i;
-  char buf2[MAX_LINE_LEN+1];
-  const int len = strlen(buf);
 
-  for(i=0; i < cfg_npeers; i++){
-    if(cfg_debug){
-      printf("[PSYNC:%d out] %s", i, buf);
-    }
+  if(h->count == 0){
+    return 0;
+  }
 
-    if(send(cfg_peer[i].fd, buf, len, 0) != len){
-      return -1;
+  const unsigned long rank = (unsigned long)(q * h->count);
+  for(i=0; i < STAT_HIST_LEN - 1; i++){
+    sum += h->counts[i];
+    if(sum > rank){
+      const unsigned long bound = 1UL << (i + 10);
+      return (bound < h->max_ns) ? bound : h->max_ns;
     }
   }
+  return h->max_ns;
+}
 
-  return psync_rdall(buf2, MAX_LINE_LEN);
+//STAT: time command sc, that started at start
+static void stat_cmd(const int sc, const long long start, const int rv){
+  stat_hist_add(&tstats->cmds[sc], now_ns() - start);
+  if(rv < 0){
+    __atomic_fetch_add(&tstats->errors[sc], 1, __ATOMIC_RELAXED);
+  }
 }
 
-static int psync_commit(const int id, const char * username, const char *message){
-  char buf[MAX_LINE_LEN+1];
-  
-  if(id == -1){
-    snprintf(buf, MAX_LINE_LEN, "SYNC_WRITE %s/%s\n", username, message);
-  }else{
-    snprintf(buf, MAX_LINE_LEN, "SYNC_REPLACE %d/%s/%s\n", id, username, message);;
+//TRACE: new correlation id. Our port in the high bits, so ids from
+//different coordinators don't collide
+static unsigned long trace_id(){
+  return ((unsigned long) cfg_port[0] << 40) |
+         (__atomic_add_fetch(&trace_seq, 1, __ATOMIC_RELAXED) & 0xFFFFFFFFFFUL);
+}
+
+//TRACE: record span name of request id, from start to now.
+//Slot seq is odd while we write it, so TRACE can skip torn spans
+static void trace_span(const int name, const unsigned long id, const long long start){
+  struct trace_ring * r = tring;
+  if(r == NULL){
+    return;
   }
 
-  return psync_wrall(buf);
+  struct span * sp = &r->spans[r->head & (TRACE_RING_LEN - 1)];
+  const unsigned int seq = sp->seq;
+
+  __atomic_store_n(&sp->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  sp->name  = name;
+  sp->id    = id;
+  sp->start = start;
+  sp->dur   = now_ns() - start;
+  __atomic_store_n(&sp->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
 }
 
-static int bulletin_open(){
+//LOG: thread exited, its ring goes when writer has drained it
+static void log_ring_exit(void * arg){
+  struct log_ring * r = (struct log_ring *) arg;
+  __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
 
-  if(cfg_bulletin_file == NULL){
-    return -1;
+static void log_key_create(){
+  pthread_key_create(&log_key, log_ring_exit);
+}
+
+//LOG: ring of this thread, made on its first line
+static struct log_ring * log_ring_get(){
+  if(lring){
+    return lring;
   }
 
-  if(bulletin_map() == -1){
-    return -1;
+  struct log_ring * r = (struct log_ring *) calloc(1, sizeof(struct log_ring));
+  if(r == NULL){
+    return NULL;
   }
+  r->tokens = cfg_log_rate;
+  r->refill = now_ns();
 
-  pthread_rwlock_init(&bboard.rwlock, NULL);
+  pthread_once(&log_once, log_key_create);
+  pthread_setspecific(log_key, r);
 
-  //initialize the last commit
-  bzero(&commited, sizeof(struct bulletin_item));
-  commited.num = -1;
+  pthread_mutex_lock(&log_mutex);
+  r->tid = log_tids++;
+  r->next = log_rings;
+  log_rings = r;
+  pthread_mutex_unlock(&log_mutex);
 
-  return 0;
+  lring = r;
+  return r;
 }
 
-static int bulletin_close(){
-  munmap(bboard.items, bboard.board_size*sizeof(struct bulletin_item));
-  close(bboard.fd);
-  pthread_rwlock_destroy(&bboard.rwlock);
-  return 0;
-}
+//LOG: queue a line for the log writer. Never blocks, lines that don't
+//fit in our ring or go over LOGRATE are dropped and counted
+static void __attribute__((format(printf, 2, 3))) log_msg(const int level, const char * fmt, ...){
+  struct timespec ts;
+  va_list ap;
 
-static int bulletin_remap(){
-  //increase size of bulleting board with 10 items
-  const int new_size = (bboard.board_size + 10)*sizeof(struct bulletin_item);
-  if(ftruncate(bboard.fd, new_size) < 0){
-    perror("ftruncate");
-    return -1;
+  if(level > cfg_log_level){
+    return;
   }
-  //reopen the board
-  bulletin_close();
-  bulletin_open();
-  return 0;
-}
 
-//Find a record by id
-static int bulletin_search(const int num){
-  int i;
-  for(i=0; i < bboard.board_size; i++){
-    if(bboard.items[i].num == num)
-      return i;
+  struct log_ring * r = log_ring_get();
+  if(r == NULL){
+    return;
   }
-  return -1;
-}
 
-static int bulletin_read(const int num, struct bulletin_item *rec){
+  //errors are never rate limited
+  if((level > LOG_ERROR) && (cfg_log_rate > 0)){
+    const long long now = now_ns();
+    r->tokens += (now - r->refill) * cfg_log_rate / 1e9;
+    r->refill = now;
+    if(r->tokens > cfg_log_rate){
+      r->tokens = cfg_log_rate;
+    }
+    if(r->tokens < 1.0){
+      __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    r->tokens -= 1.0;
+  }
+
+  const unsigned long head = r->head;
+  if((head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) >= LOG_RING_LEN){
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct log_entry * e = &r->lines[head & (LOG_RING_LEN - 1)];
+  clock_gettime(CLOCK_REALTIME, &ts);
+  e->ts = (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  e->level = level;
 
-  pthread_rwlock_rdlock(&bboard.rwlock);
+  va_start(ap, fmt);
+  vsnprintf(e->line, LOG_LINE_LEN, fmt, ap);
+  va_end(ap);
+
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
 
-  if(cfg_debug){
-    printf("[READING] item.num=%i\n", num);
-    sleep(DEBUG_TIME_RD);
+//LOG: write buf to stdout, which is bbserv.log in daemon mode
+static void log_flush(char * buf, int * len){
+  int off = 0;
+  while(off < *len){
+    const ssize_t n = write(STDOUT_FILENO, &buf[off], *len - off);
+    if(n <= 0){
+      break;
+    }
+    off += n;
   }
+  *len = 0;
+}
 
-  const int index = bulletin_search(num);
+//LOG: format a line of ring r into buf
+static int log_format(char * buf, const struct log_ring * r, const struct log_entry * e){
+  static const char * names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+  struct tm tm;
+  char date[32];
 
-  int rv = 0;
-  if(index >= 0){  //if record was found
-    rv = 1;
-    memcpy(rec, &bboard.items[index], sizeof(struct bulletin_item));
+  const time_t secs = e->ts / 1000000000LL;
+  localtime_r(&secs, &tm);
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+  int len = snprintf(buf, LOG_LINE_LEN + 64, "%s.%06lld %-5s [t%d] %s",
+    date, (e->ts % 1000000000LL) / 1000, names[e->level], r->tid, e->line);
+  if(len > LOG_LINE_LEN + 62){
+    len = LOG_LINE_LEN + 62;
   }
-  if(cfg_debug){
-    printf("[READING DONE] item.num=%i\n", num);
+  if(buf[len-1] != '\n'){
+    buf[len++] = '\n';
   }
-  pthread_rwlock_unlock(&bboard.rwlock);
-
-  return rv;
+  return len;
 }
 
-static int bulletin_write(const char *user, const char *message){
+//LOG: write out all queued lines, and free rings of threads that are gone
+static void log_drain(){
+  static char buf[64*1024];
+  int len = 0;
+
+  pthread_mutex_lock(&log_mutex);
+  struct log_ring ** prev = &log_rings;
+  while(*prev){
+    struct log_ring * r = *prev;
+    const int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+
+    const unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for(; r->tail < head; __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE)){
+      if(len > (int) sizeof(buf) - (LOG_LINE_LEN + 64)){
+        log_flush(buf, &len);
+      }
+      len += log_format(&buf[len], r, &r->lines[r->tail & (LOG_RING_LEN - 1)]);
+    }
 
-  if((bboard.board_len + 1) > bboard.board_size){
-    bulletin_remap(); //increase size of bulletin board
-  }
+    const unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    if(dropped > 0){
+      struct timespec ts;
+      struct log_entry e;
 
-  //fill record data
-  const int index = ++bboard.board_len;
-  bboard.items[index].num = index;
-  strncpy(bboard.items[index].usr, user, MAX_USR_LEN);
-  strncpy(bboard.items[index].msg, message, MAX_MSG_LEN);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      e.ts = (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+      e.level = LOG_WARN;
+      snprintf(e.line, LOG_LINE_LEN, "%lu log lines dropped", dropped);
+
+      if(len > (int) sizeof(buf) - (LOG_LINE_LEN + 64)){
+        log_flush(buf, &len);
+      }
+      len += log_format(&buf[len], r, &e);
+    }
 
-  if(cfg_debug){
-    printf("[WRITING] item.num=%d\n", bboard.items[index].num);
-    sleep(DEBUG_TIME_WR);
+    if(dead){
+      *prev = r->next;
+      free(r);
+    }else{
+      prev = &r->next;
+    }
   }
+  pthread_mutex_unlock(&log_mutex);
 
-  //save info about last commit
-  commited_index = index;
-  commited.num = -1;  //writes have no number
+  log_flush(buf, &len);
+}
 
-  if(cfg_debug){
-    printf("[WRITE DONE] item.num=%d\n", bboard.items[index].num);
-  }
+static void * log_writer(void * arg){
+  const struct timespec ts = {0, 10*1000*1000};
 
-  return bboard.items[index].num;
+  while(__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)){
+    log_drain();
+    nanosleep(&ts, NULL);
+  }
+  log_drain();
+  return NULL;
 }
 
-static int bulletin_replace(const int num, const char *user, const char *message){
+//LOG: start the writer. After startup(), since fork keeps only one thread
+static int MAIN_ONLY log_open(){
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+  if(pthread_create(&log_thread, NULL, log_writer, NULL) != 0){
+    perror("pthread_create");
+    log_running = 0;
+    return -1;
+  }
+  return 0;
+}
 
-  if(cfg_debug){
-    printf("[REPLACING] item.num=%d\n", num);
-    sleep(DEBUG_TIME_WR);
+static void log_close(){
+  if(log_running){
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
   }
+}
 
-  const int index = bulletin_search(num);
-  if(index >= 0){
+static const char * inject_names[NINJECT] = {"read", "write", "replace", "sync_on",
+  "sync_write", "sync_off", "peer_send", "peer_recv"};
 
-    //save info for reverting commit
-    commited_index = index;
-    memcpy(&commited, &bboard.items[index], sizeof(struct bulletin_item));
+//INJECT: delay at site, and decide if it fails. Returns -1 on failure
+static int inject(const int site){
+  struct inject * in = &cfg_inject[site];
 
-    //id stays the same, update rest
-    strncpy(bboard.items[index].usr, user, MAX_USR_LEN);
-    strncpy(bboard.items[index].msg, message, MAX_MSG_LEN);
+  if((cfg_ninject == 0) || ((in->delay == 0) && (in->fail == 0))){
+    return 0;
   }
+  __atomic_fetch_add(&in->hits, 1, __ATOMIC_RELAXED);
 
-  if(cfg_debug){
-    printf("[REPLACE END] num=%d\n", bboard.items[index].num);
+  if(in->delay > 0){
+    struct timespec ts;
+    ts.tv_sec  = in->delay / 1000000000LL;
+    ts.tv_nsec = in->delay % 1000000000LL;
+    while(nanosleep(&ts, &ts) < 0 && (errno == EINTR));
   }
 
-  return bboard.items[index].num;
+  if(in->fail > 0){
+    if(inj_seed == 0){  //each thread has its own, repeatable sequence
+      inj_seed = cfg_inject_seed + __atomic_add_fetch(&inj_threads, 1, __ATOMIC_RELAXED);
+    }
+    if((unsigned int)(rand_r(&inj_seed) % 1000000) < in->fail){
+      __atomic_fetch_add(&in->fails, 1, __ATOMIC_RELAXED);
+      log_msg(LOG_DEBUG, "[INJECT] %s failed\n", inject_names[site]);
+      return -1;
+    }
+  }
+  return 0;
 }
 
-static int bulletin_commit(const int number, const char *user, const char *message){
-  int rc = 0;
-
-  //synchronize the commit operation
-  pthread_rwlock_wrlock(&bboard.rwlock);
+//INJECT: parse site:delay[:percent] into the faults of c, delay in us or with us/ms suffix
+static int inject_config(char * str, struct config * c){
+  int site;
 
-  //before precommit - just see who is available
-  if(psync_connect() < 0){  //read welcome message
-    pthread_rwlock_unlock(&bboard.rwlock);
+  char * name  = strtok(str, ":");
+  char * delay = strtok(NULL, ":");
+  char * fail  = strtok(NULL, ":");
+  if((name == NULL) || (delay == NULL)){
     return -1;
   }
 
-  //precommit - locks the bulletin board in all instances
-  rc = psync_wrall("SYNC_ON\n");
-  if(rc == 0){
-    //actual commit
-    rc = psync_commit(number, user, message);
-    if(rc >= 0){  //if commit succeeded
-      if(number == -1){
-        rc = bulletin_write(user, message);
-      }else{
-        rc = bulletin_replace(number, user, message);
-      }
+  for(site=0; site < NINJECT; site++){
+    if(strcmp(name, inject_names[site]) == 0){
+      break;
     }
   }
-
-  //if we had a failure in previous steps
-  if(rc < 0){
-    psync_wrall("SYNC_ABORT\n");
-  }else{
-    psync_wrall("SYNC_OFF\n");
+  if(site == NINJECT){
+    return -1;
   }
-  psync_disconnect();
 
-  pthread_rwlock_unlock(&bboard.rwlock);
-
-  return rc;
-}
+  char * end;
+  const double d = strtod(delay, &end);
+  if((d < 0) || (end == delay)){
+    return -1;
+  }
 
-static int bulletin_sync(const int on){
-  int rc;
-  if(on == 1){
-    if(cfg_debug){
-      printf("[SYNC ON]\n");
-    }
-    rc = (pthread_rwlock_wrlock(&bboard.rwlock) != 0) ? -1 : 0;
+  if(strcmp(end, "ms") == 0){
+    c->inject[site].delay = d * 1000000;
+  }else if((end[0] == '\0') || (strcmp(end, "us") == 0)){
+    c->inject[site].delay = d * 1000;
   }else{
-    if(cfg_debug){
-      printf("[SYNC OFF]\n");
+    return -1;
+  }
+
+  c->inject[site].fail = 0;
+  if(fail){
+    const double p = strtod(fail, &end);
+    if((p < 0) || (p > 100) || (end == fail) || ((end[0] != '\0') && (strcmp(end, "%") != 0))){
+      return -1;
     }
-    rc = (pthread_rwlock_unlock(&bboard.rwlock) != 0) ? -1 : 0;
+    c->inject[site].fail = p * 10000;
   }
 
-  return rc;
+  c->ninject++;
+  return 0;
 }
 
-static int bulletin_revert(){
-  int rc = 1;
-
-  if(cfg_debug){
-    printf("[ABORTING] item.num=%i\n", commited.num);
+//STAT: lock board for reading, and time how long we waited
+static int board_rdlock(struct bulletin_board * b){
+  if(pthread_rwlock_tryrdlock(&b->rwlock) == 0){
+    stat_hist_add(&tstats->rdlock, 0);
+    return 0;
   }
 
-  pthread_rwlock_wrlock(&bboard.rwlock);
-
-  if(commited.num == -1){
-    //reduce item count, and clear last item
-    memset(&bboard.items[--bboard.board_len], 0, sizeof(struct bulletin_board));
+  const long long start = now_ns();
+  const int rc = pthread_rwlock_rdlock(&b->rwlock);
+  stat_hist_add(&tstats->rdlock, now_ns() - start);
+  return rc;
+}
 
-    if(cfg_debug){
-      printf("[WRITING] Reverted last written item\n");
-    }
-  }else{
-    //restore old record
-    rc = bulletin_replace(commited.num, commited.usr, commited.msg);
-    if(cfg_debug){
-      if(rc > 0){
-        printf("[REPLACING] Undo item.num=%d, %s/%s\n", commited.num, commited.usr, commited.msg);
-      }else{
-        printf("[REPLACING] Undo item.num=%d error\n", commited.num);
-      }
-    }
+//STAT: lock board for writing, and time how long we waited
+static int board_wrlock(struct bulletin_board * b){
+  if(pthread_rwlock_trywrlock(&b->rwlock) == 0){
+    stat_hist_add(&tstats->wrlock, 0);
+    return 0;
   }
 
-  //clear last commit
-  commited_index = -1;
-  bzero(&commited, sizeof(struct bulletin_item));
-
-  pthread_rwlock_unlock(&bboard.rwlock);
+  const long long start = now_ns();
+  const int rc = pthread_rwlock_wrlock(&b->rwlock);
+  stat_hist_add(&tstats->wrlock, now_ns() - start);
   return rc;
 }
 
-static int peer_resolve(const char * hname, const int port, struct sockaddr_in *inaddr){
+//CACHE: allocate entries that fit in mem bytes
+static int cache_open(struct reply_cache * c, const int mem){
+  int i;
 
-  memset(inaddr, 0, sizeof(struct sockaddr_in));
-  inaddr->sin_family = AF_INET;
+  memset(c, 0, sizeof(struct reply_cache));
+  pthread_mutex_init(&c->mutex, NULL);
 
-  struct hostent * hinfo = gethostbyname(hname);
-  if(hinfo == NULL){
-    perror("gethostbyname");
-    return -1;
+  c->size = mem / sizeof(struct cache_entry);
+  if(c->size == 0){ //cache is off
+    return 0;
   }
 
-  memcpy(&inaddr->sin_addr, hinfo->h_addr, hinfo->h_length);
-  inaddr->sin_port = htons(port);
+  c->buckets = (int*) malloc(c->size*sizeof(int));
+  c->entries = (struct cache_entry*) calloc(c->size, sizeof(struct cache_entry));
+  if((c->buckets == NULL) || (c->entries == NULL)){
+    perror("malloc");
+    return -1;
+  }
 
+  for(i=0; i < c->size; i++){
+    c->buckets[i] = -1;
+    c->entries[i].next = -1;
+  }
   return 0;
 }
 
-//CONFIG: initialize the peers[]
-static int config_peers(char ** args, const int npeers){
-  int i = 0;
+static void cache_close(struct reply_cache * c){
+  free(c->buckets);
+  free(c->entries);
+  pthread_mutex_destroy(&c->mutex);
+  memset(c, 0, sizeof(struct reply_cache));
+}
 
-  cfg_npeers = npeers;
-  cfg_peer = (struct peer*) calloc(cfg_npeers, sizeof(struct peer));
-  if(cfg_peer == NULL){
-    perror("calloc");
-    return -1;
+//CACHE: remove entry e from its hash chain. Called with cache locked
+static void cache_unlink(struct reply_cache * c, const int e){
+  int * link = &c->buckets[c->entries[e].num % c->size];
+  while(*link != e){
+    link = &c->entries[*link].next;
   }
+  *link = c->entries[e].next;
 
-  for(i=0; i < npeers; i++){
-    char * save_ptr;
-    const char * hname = strtok_r(args[i], ":", &save_ptr);
-    const char * pport = strtok_r(NULL,    ":", &save_ptr);
+  c->entries[e].num = 0;
+  c->entries[e].next = -1;
+  c->used--;
+}
 
-    const int port = stoi(pport);
-    if((port < 0) || (port > 65535)){
-      return -1;
-    }
+//CACHE: copy rendered reply of post num to buf. Returns its length, or 0
+static int cache_get(struct reply_cache * c, const int num, const unsigned int ver, char * buf){
+  int e, len = 0;
 
-    if(peer_resolve(hname, port, &cfg_peer[i].inaddr) == -1){
-      return -1;
+  pthread_mutex_lock(&c->mutex);
+  for(e = c->buckets[num % c->size]; e != -1; e = c->entries[e].next){
+    if((c->entries[e].num == num) && (c->entries[e].ver == ver)){
+      c->entries[e].ref = 1;
+      len = c->entries[e].len;
+      memcpy(buf, c->entries[e].line, len);
+      break;
     }
+  }
 
-    cfg_peer[i].fd = -1;
+  if(len > 0){
+    c->hits++;
+  }else{
+    c->misses++;
   }
+  pthread_mutex_unlock(&c->mutex);
 
-  return i;
+  return len;
 }
 
-//CONFIG: setup config, using a file
-static int config_file(const char * config){
-  char line[1024];
-  char * args[10];
-
-  int fd = open(config, O_RDONLY);
-  if(fd == -1){
-    perror("open");
-    return -1;
-  }
-
-  int rv = 0;
-  while((readln(fd, line, sizeof(line)) > 0) && (rv == 0)){
+//CACHE: save rendered reply of post num, evicting with CLOCK if full
+static void cache_put(struct reply_cache * c, const int num, const unsigned int ver,
+                      const char * line, const int len){
+  int e;
 
-    char * opt = strtok(line, "=");
-    char * optarg = strtok(NULL, "=");
+  pthread_mutex_lock(&c->mutex);
 
-    if((opt == NULL) || (optarg == NULL)){
-      continue;
+  //drop older version, if we have one
+  for(e = c->buckets[num % c->size]; e != -1; e = c->entries[e].next){
+    if(c->entries[e].num == num){
+      cache_unlink(c, e);
+      break;
     }
+  }
 
-    if(strcmp(opt, "THMAX") == 0){
-      cfg_max_threads = stoi(optarg);
-      if(cfg_max_threads <= 0){
-        rv = -1;
-        break;
-      }
-
-    }else if(strcmp(opt, "BBPORT") == 0){
-      cfg_port[0] = stoi(optarg);
-      if((cfg_port[0] <=0) || (cfg_port[0] > 65535)){
-        rv = -1;
-        break;
-      }
+  //find a victim, clearing reference bits on the way
+  while(c->entries[c->hand].ref){
+    c->entries[c->hand].ref = 0;
+    c->hand = (c->hand + 1) % c->size;
+  }
+  e = c->hand;
+  c->hand = (c->hand + 1) % c->size;
 
-    }else if(strcmp(opt, "SYNCPORT") == 0){
-      cfg_port[1] = stoi(optarg);
-      if((cfg_port[1] <= 0) || (cfg_port[1] > 65535)){
-        rv = -1;
-        break;
-      }
+  if(c->entries[e].num != 0){
+    cache_unlink(c, e);
+    c->evictions++;
+  }
 
-    }else if(strcmp(opt, "BBFILE") == 0){
-      if(cfg_bulletin_file){  //if an old value exists
-        free(cfg_bulletin_file);
-      }
+  struct cache_entry * ce = &c->entries[e];
+  ce->num = num;
+  ce->ver = ver;
+  ce->ref = 1;
+  ce->len = len;
+  memcpy(ce->line, line, len);
 
-      cfg_bulletin_file = strdup(optarg);
-      if(cfg_bulletin_file == NULL){
-        perror("strdup");
-        rv = -1;
-        break;
-      }
+  const int b = num % c->size;
+  ce->next = c->buckets[b];
+  c->buckets[b] = e;
+  c->used++;
 
-    }else if(strcmp(opt, "PEERS") == 0){
-      cfg_npeers = stoa(optarg, args, 10);
-      if(cfg_npeers > 0){
-        if(config_peers(args, cfg_npeers) < 0){
-          rv = -1;
-          break;
-        }
-      }
+  pthread_mutex_unlock(&c->mutex);
+}
 
-    }else if(strcmp(opt, "DAEMON") == 0){
-      cfg_daemon = stob(optarg);
-      if(cfg_daemon == -1){
-        rv = -1;
-        break;
-      }
+//CACHE: drop rendered reply of post num
+static void cache_invalidate(struct reply_cache * c, const int num){
+  int e;
 
-    }else if(strcmp(opt, "DEBUG") == 0){
-      cfg_debug = stob(optarg);
-      if(cfg_debug == -1){
-        rv = -1;
-        break;
-      }
+  if(c->size == 0){
+    return;
+  }
 
-    }else{
-      fprintf(stderr, "Error: Invalid keyword '%s' in config %s\n", opt, config);
-      rv = -1;
+  pthread_mutex_lock(&c->mutex);
+  for(e = c->buckets[num % c->size]; e != -1; e = c->entries[e].next){
+    if(c->entries[e].num == num){
+      cache_unlink(c, e);
+      c->invalidations++;
       break;
     }
   }
-  close(fd);
-  return rv;
+  pthread_mutex_unlock(&c->mutex);
 }
 
-//CONFIG: setup config, from argv[]
-static int config_argv(const int argc, char * argv[]){
-  int opt;
-
-  while((opt = getopt(argc, argv, "b:c:dfp:s:T:")) > 0){
+//CACHE: change cache to mem bytes, on reload. Called with board write
+//locked, so no reader is between cache_get and cache_put
+static int cache_resize(struct reply_cache * c, const int mem){
+  struct reply_cache n;
+  int * buckets;
+  struct cache_entry * entries;
+
+  if(cache_open(&n, mem) < 0){
+    free(n.buckets);
+    free(n.entries);
+    pthread_mutex_destroy(&n.mutex);
+    return -1;
+  }
+  pthread_mutex_destroy(&n.mutex);
+
+  //STATS may be looking at it, keep the mutex and counters
+  pthread_mutex_lock(&c->mutex);
+  buckets = c->buckets;
+  entries = c->entries;
+  c->size = n.size;
+  c->used = c->hand = 0;
+  c->buckets = n.buckets;
+  c->entries = n.entries;
+  pthread_mutex_unlock(&c->mutex);
+
+  free(buckets);
+  free(entries);
+  return 0;
+}
 
-    switch(opt){
-      case 'b':
-        if(cfg_bulletin_file)
-          free(cfg_bulletin_file);
+//INDEX: FNV-1a hash of a term
+static unsigned int tindex_hash(const char * term, const int len){
+  unsigned int h = 2166136261u;
+  int i;
+  for(i=0; i < len; i++){
+    h = (h ^ (unsigned char) term[i]) * 16777619u;
+  }
+  return h;
+}
 
-        cfg_bulletin_file = strdup(optarg);
-        if(cfg_bulletin_file == NULL){
-          perror("strdup");
-          return -1;
-        }
-        break;
+static int tindex_open(struct term_index * ti, int nbuckets){
+  int size = 1024;
+  while(size < nbuckets){
+    size *= 2;
+  }
 
-      case 'c':
-        if(config_file(optarg) < 0)
-          return -1;
-        break;
+  ti->nterms = 0;
+  ti->nbuckets = size;
+  ti->buckets = (struct posting **) calloc(size, sizeof(struct posting*));
+  if(ti->buckets == NULL){
+    perror("calloc");
+    return -1;
+  }
+  return 0;
+}
 
-      case 'd':
-        cfg_debug = 1;
-        break;
+static void tindex_close(struct term_index * ti){
+  int i;
+  for(i=0; i < ti->nbuckets; i++){
+    struct posting * p = ti->buckets[i];
+    while(p){
+      struct posting * next = p->next;
+      free(p->term);
+      free(p->nums);
+      free(p);
+      p = next;
+    }
+  }
+  free(ti->buckets);
+  memset(ti, 0, sizeof(struct term_index));
+}
 
-      case 'f':
-        cfg_daemon = 0;
-        break;
+//INDEX: find posting of term, or NULL
+static struct posting * tindex_find(const struct term_index * ti, const char * term,
+                                    const int len, const unsigned int h){
+  struct posting * p;
+  for(p = ti->buckets[h & (ti->nbuckets - 1)]; p; p = p->next){
+    if((strncmp(p->term, term, len) == 0) && (p->term[len] == '\0')){
+      return p;
+    }
+  }
+  return NULL;
+}
 
-      case 'p':
-        cfg_port[0] = stoi(optarg);
-        if((cfg_port[0] <=0) || (cfg_port[0] > 65535)){
-          return -1;
-        }
-        break;
+//INDEX: double the buckets, when chains get long
+static void tindex_rehash(struct term_index * ti){
+  const int size = 2*ti->nbuckets;
+  struct posting ** buckets = (struct posting **) calloc(size, sizeof(struct posting*));
+  if(buckets == NULL){
+    return; //keep the long chains
+  }
 
-      case 's':
-        cfg_port[1] = stoi(optarg);
-        if((cfg_port[1] <=0) || (cfg_port[1] > 65535)){
-          return -1;
-        }
-        break;
+  int i;
+  for(i=0; i < ti->nbuckets; i++){
+    struct posting * p = ti->buckets[i];
+    while(p){
+      struct posting * next = p->next;
+      const unsigned int b = tindex_hash(p->term, strlen(p->term)) & (size - 1);
+      p->next = buckets[b];
+      buckets[b] = p;
+      p = next;
+    }
+  }
 
-      case 'T':
-        cfg_max_threads = stoi(optarg);
-        if(cfg_max_threads <= 0){
-          return -1;
-        }
-        break;
+  free(ti->buckets);
+  ti->buckets = buckets;
+  ti->nbuckets = size;
+}
 
-      default:
-        fprintf(stderr, "Error: Invalid option '%c'\n", opt);
-        return -1;
-        break;
+//INDEX: binary search num in posting, returns its position or where it goes
+static int posting_find(const struct posting * p, const int num){
+  int lo = 0, hi = p->len;
+  while(lo < hi){
+    const int mid = (lo + hi) / 2;
+    if(p->nums[mid] < num){
+      lo = mid + 1;
+    }else{
+      hi = mid;
     }
   }
+  return lo;
+}
 
-  const int nargs = argc - optind;
-  if(nargs > 0){
-    cfg_npeers = config_peers(&argv[optind], nargs);
-    if(cfg_npeers < 0){
+//INDEX: add num to posting list of term. Returns 1 if term is new, so
+//caller can count terms, 0 if not, and -1 on error
+static int tindex_add(struct term_index * ti, const char * term, const int len,
+                      const unsigned int h, const int num){
+  int rv = 0;
+
+  struct posting * p = tindex_find(ti, term, len, h);
+  if(p == NULL){
+    p = (struct posting *) calloc(1, sizeof(struct posting));
+    if((p == NULL) || ((p->term = strndup(term, len)) == NULL)){
+      perror("calloc");
+      free(p);
       return -1;
     }
-  }
 
-  return 0;
-}
+    const unsigned int b = h & (ti->nbuckets - 1);
+    p->next = ti->buckets[b];
+    ti->buckets[b] = p;
+    rv = 1;
+  }
 
-static int bb_pop(){ //pop one request from bounded buffer
+  //new posts come last, so search only when its not
+  int pos = p->len;
+  if((p->len > 0) && (p->nums[p->len-1] >= num)){
+    pos = posting_find(p, num);
+    if(p->nums[pos] == num){
+      return rv; //already there
+    }
+  }
 
-  pthread_mutex_lock(&rbb.mutex);
-  while(rbb.count <= 0){
-    pthread_cond_wait(&rbb.full, &rbb.mutex);
+  if(p->len == p->size){
+    const int size = (p->size == 0) ? 4 : 2*p->size;
+    int * nums = (int*) realloc(p->nums, size*sizeof(int));
+    if(nums == NULL){
+      perror("realloc");
+      return -1;
+    }
+    p->nums = nums;
+    p->size = size;
   }
 
-  const int fd = rbb.fds[rbb.out];
-  rbb.out = (rbb.out + 1) % MAX_RBB_LEN;
-  rbb.count--;
-  pthread_cond_signal(&rbb.empty);
-  pthread_mutex_unlock(&rbb.mutex);
+  memmove(&p->nums[pos+1], &p->nums[pos], (p->len - pos)*sizeof(int));
+  p->nums[pos] = num;
+  p->len++;
 
-  return fd;
+  return rv;
 }
 
-static int bb_push(const int fd){
+//INDEX: remove num from posting list of term
+static void tindex_del(struct term_index * ti, const char * term, const int len,
+                       const unsigned int h, const int num){
 
-  pthread_mutex_lock(&rbb.mutex);
-  while(rbb.count >= MAX_RBB_LEN){  //while bb is full
-    pthread_cond_wait(&rbb.empty, &rbb.mutex);
+  struct posting * p = tindex_find(ti, term, len, h);
+  if(p == NULL){
+    return;
   }
 
-  rbb.fds[rbb.in] = fd;
-  rbb.in = (rbb.in + 1) % MAX_RBB_LEN;
-  rbb.count++;
-
-  pthread_cond_signal(&rbb.full);
-  pthread_mutex_unlock(&rbb.mutex);
-
-  return 0;
+  const int pos = posting_find(p, num);
+  if((pos < p->len) && (p->nums[pos] == num)){
+    memmove(&p->nums[pos], &p->nums[pos+1], (p->len - pos - 1)*sizeof(int));
+    p->len--;
+  }
+  //empty postings are kept, the term is likely to come again
 }
 
-static int cmd_user(struct context *ctx, struct cmd * cmd){
-  if(cmd->nargs != 2){
-    return -1;  //invalid count of arguments
-  }
+//INDEX: get next word of str, lowercase, in term. Returns its length, 0 on end
+static int tindex_token(const char ** str, const char * end, char * term){
+  const char * s = *str;
+  int len = 0;
 
-  //validate username argument
-  if( (strchr(cmd->arg[1], '/') != NULL) || (strcmp(cmd->arg[1], nousername) == 0)){
-    dprintf(ctx->fd, "2.2 ERROR USER Invalid username\n");
+  while((s < end) && *s && !isalnum((unsigned char)*s)){
+    s++;
+  }
 
-  }else if(strcmp(ctx->rec.usr, nousername) != 0){
-    dprintf(ctx->fd, "2.2 ERROR USER Already registered\n");
-  }else{
-    strncpy(ctx->rec.usr, cmd->arg[1], MAX_USR_LEN);
-    dprintf(ctx->fd, "1.0 Hello %s, Welcome to Bulletin Board\n", ctx->rec.usr);
+  while((s < end) && *s && isalnum((unsigned char)*s)){
+    if(len < MAX_TERM_LEN){
+      term[len++] = tolower((unsigned char)*s);
+    }
+    s++;
   }
 
-  return 0; //sucess
+  *str = s;
+  return len;
 }
 
-static int cmd_read(struct context *ctx, struct cmd * cmd){
-  if(cmd->nargs != 2){
-    return -1;  //invalid count of arguments
+//grow the hot index from old_size to new_size slots
+static int bulletin_index_grow(struct bulletin_board * b, const int old_size, const int new_size){
+  int * nums = (int*) realloc(b->nums, new_size*sizeof(int));
+  if(nums == NULL){
+    perror("realloc");
+    return -1;
   }
+  b->nums = nums;
 
-  const int number = stoi(cmd->arg[1]);
-  if(number < 0){
+  unsigned int * vers = (unsigned int*) realloc(b->vers, new_size*sizeof(unsigned int));
+  if(vers == NULL){
+    perror("realloc");
     return -1;
   }
+  b->vers = vers;
 
-  switch(bulletin_read(number, &ctx->rec)){
-    case 0:
-      dprintf(ctx->fd, "2.1 UNKNOWN %s No such message\n", cmd->arg[1]);
-      break;
+  //new slots are free
+  memset(&b->nums[old_size], 0, (new_size - old_size)*sizeof(int));
+  memset(&b->vers[old_size], 0, (new_size - old_size)*sizeof(unsigned int));
+  return 0;
+}
 
-    case -1:
-      dprintf(ctx->fd, "2.2 ERROR READ system error\n");
-      break;
+//fill hot index from the mmaped records
+static int bulletin_index_load(struct bulletin_board * b){
+  int i;
 
-    default:
-      dprintf(ctx->fd, "2.0 MESSAGE %i %s/%s\n", number, ctx->rec.usr, ctx->rec.msg);
-      break;
+  if(bulletin_index_grow(b, 0, b->board_size) < 0){
+    return -1;
+  }
+
+  b->board_len = 0;
+  for(i=1; i < b->board_size; i++){ //slot 0 is never used
+    b->nums[i] = b->items[i].num;
+    if(b->nums[i] != 0){
+      b->vers[i] = 1;
+      b->board_len = i;
+    }
   }
   return 0;
 }
 
-static int cmd_write(struct context *ctx, struct cmd * cmd){
-  if(cmd->nargs != 2){
-    return -1;  //invalid count of arguments
+static int writen(const int fd, const char *buf, const int len){
+  int done = 0;
+  while(done < len){
+    const ssize_t rv = send(fd, &buf[done], len - done, MSG_NOSIGNAL);
+    if(rv < 0){
+      if(errno == EINTR){
+        continue;
+      }else if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+        //SO_SNDTIMEO, the other side doesn't read. We can't send the rest
+        //of this reply, so end the connection, for reader to see
+        shutdown(fd, SHUT_RDWR);
+        errno = EAGAIN;
+      }
+      perror("send");
+      tsend_failed = fd;
+      return -1;
+    }
+    done += rv;
   }
+  return done;
+}
 
-  const int number = bulletin_commit(-1, ctx->rec.usr, cmd->arg[1]);
-  switch(number){
-    case -1:
-      dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-      break;
+//NET: dprintf a reply. A reply that fails, after SO_SNDTIMEO or on a
+//closed connection, leaves fd in tsend_failed
+static int __attribute__((format(printf, 2, 3))) replyf(const int fd, const char * fmt, ...){
+  va_list ap;
 
-    default:
-      dprintf(ctx->fd, "3.0 WROTE %i\n", number);
-      break;
+  va_start(ap, fmt);
+  const int rv = vdprintf(fd, fmt, ap);
+  va_end(ap);
+
+  if(rv < 0){
+    tsend_failed = fd;
   }
-  return 0;
+  return rv;
 }
 
-static int cmd_replace(struct context *ctx, struct cmd * cmd){
-  if(cmd->nargs != 3){
-    return -1;  //invalid count of arguments
-  }
+static int bulletin_map(struct bulletin_board * b){
+  struct stat st;
 
-  const int number = stoi(cmd->arg[1]);
-  if(number < 0){
+  b->fd = open(b->file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if(b->fd == -1){
+    perror("open");
     return -1;
   }
 
-  switch(bulletin_commit(number, ctx->rec.usr, cmd->arg[2])){
-    case -1:
-      dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-      break;
+  if(fstat(b->fd, &st) == -1){
+    perror("lstat");
+    return -1;
+  }
 
-    case 0:
-      dprintf(ctx->fd, "3.1 UNKNOWN %s\n", cmd->arg[1]);
-      break;
+  if(st.st_size == 0){  //if its a new file
+    //allocate space for the records
+    st.st_size = 10 * sizeof(struct bulletin_item);
+    if(ftruncate(b->fd, st.st_size) < 0){
+      perror("ftruncate");
+      return -1;
+    }
+  }
+  b->board_size = st.st_size / sizeof(struct bulletin_item);
 
-    default:
-      dprintf(ctx->fd, "3.0 WROTE %i\n", number);
-      break;
+  b->items =  mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+  if(b->items == MAP_FAILED){
+    perror("mmap");
+    return -1;
   }
-  return 0;
+
+  //find how much items we have in bulletin board
+  return bulletin_index_load(b);
 }
 
-static int cmd_sync_on(struct context *ctx, struct cmd * cmd){
-  int rv = 0;
+//NET: connect a peer, on pc
+static int peer_connect(const struct peer * p, struct peer_conn * pc) {
+  const int unix_peer = (p->unaddr.sun_family == AF_UNIX);
 
-  if(ctx->sync_on == 0){
-    rv = bulletin_sync(1);
-    ctx->sync_on = 1;
-  }else{
-    //we can't call SYNC_ON twice
-    dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-    rv = -1;
+  pc->fd = socket(unix_peer ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if(pc->fd < 0){
+    perror("socket");
+    return -1;
   }
-  return rv;
-}
 
-static int cmd_sync_off(struct context *ctx, struct cmd * cmd){
-  int rv = 0;
+  //a peer that doesn't answer can't hold our write. Linux uses the send
+  //timeout for connect() too
+  sock_timeout(pc->fd, SO_SNDTIMEO, cfg_sync_write_timeout);
+  sock_timeout(pc->fd, SO_RCVTIMEO, cfg_sync_read_timeout);
 
-  if(ctx->sync_on == 1){
-    rv = bulletin_sync(0);
-    ctx->sync_on = 0;
-  }else{
-    //we can't call SYNC_OFF twice
-    dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-    rv = -1;
+  const int rv = unix_peer ? connect(pc->fd, (struct sockaddr *)&p->unaddr, sizeof(struct sockaddr_un))
+                           : connect(pc->fd, (struct sockaddr *)&p->inaddr, sizeof(struct sockaddr_in));
+  if(rv < 0) {
+    perror("connect");
+    close(pc->fd);
+    pc->fd = -1;
+    return -1;
   }
-  return rv;
-}
-
-static int cmd_sync_abort(struct context *ctx, struct cmd * cmd){
-  int rv = 0;
 
-  if(ctx->sync_on == 1){
-    rv = bulletin_revert();
-    rv = bulletin_sync(0);  //sync off on abort automatically
-    ctx->sync_on = 0;
-  }else{
-    //we can't call SYNC_ON twice
-    dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-    rv = -1;
+  //SYNC lines and ACKs are small, don't let Nagle hold them back
+  const int opt = 1;
+  if(!unix_peer){
+    setsockopt(pc->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
   }
-  return rv;
+  return 0;
+}
+
+//SYNC: connect to all peers. Each write has its own connections, so
+//boards replicate side by side. Called with the board write locked, so
+//a reload can't change cfg_peer
+static int psync_connect(struct peer_conn * pc){
+  int i;
+  for(i=0; i < cfg_npeers; i++){
+    pc[i].fd = -1;
+  }
+  for(i=0; i < cfg_npeers; i++){
+    const long long start = now_ns();
+    if(peer_connect(&cfg_peer[i], &pc[i]) == -1)
+      return -1;
+    stat_hist_add(&cfg_peer[i].phases[PHASE_CONNECT], now_ns() - start);
+  }
+  return 0;
+}
+
+//SYNC: disconnect all peers
+static void psync_disconnect(struct peer_conn * pc){
+  int i;
+  for(i=0; i < cfg_npeers; i++){
+    if(pc[i].fd > 0){
+      shutdown(pc[i].fd, SHUT_RDWR);
+      close(pc[i].fd);
+      pc[i].fd = -1;
+    }
+  }
+}
+
+//SYNC: wait for nreplies ACK/NACK from each peer, and time the phase
+//from start to the last reply of each peer
+static int psync_rdall(struct peer_conn * pc, char * buf, const int buf_size, const int nreplies,
+                       const int phase, const long long start){
+
+  int ack = 0, nack = 0;
+  struct timespec timeout;
+
+  int i, nfds = 0;
+  for(i=0; i < cfg_npeers; i++){
+    if(nfds < pc[i].fd)
+      nfds = pc[i].fd;
+    pc[i].nreplies = 0;
+  }
+  nfds++;
+
+  timeout.tv_sec  = cfg_sync_read_timeout / 1000;
+  timeout.tv_nsec = (cfg_sync_read_timeout % 1000) * 1000000L;
+
+  while((ack + nack) < (cfg_npeers * nreplies)){
+
+    fd_set rdfds;
+    FD_ZERO(&rdfds);
+    for(i=0; i < cfg_npeers; i++){
+      FD_SET(pc[i].fd, &rdfds);
+    }
+
+    switch(pselect(nfds + 1, &rdfds, NULL, NULL, &timeout, NULL)){
+      case -1:
+        perror("pselect");
+      case 0:
+        return -1;  //on timeout
+
+      default:
+
+        for(i=0; i < cfg_npeers; i++){
+          if(FD_ISSET(pc[i].fd, &rdfds)){
+
+
+            if( (readln(pc[i].fd, buf, buf_size) <= 0) ||
+                (inject(INJ_PEER_RECV) < 0) ){
+              return -1;
+            }
+
+            log_msg(LOG_DEBUG, "[PSYNC:%d] %s\n", i, buf);
+
+            if(strcmp(buf, "NACK") == 0){  //if peer failed
+              nack++;
+            }else if(strcmp(buf, "ACK") == 0){
+              ack++;
+            }else{
+              continue;
+            }
+
+            if(++pc[i].nreplies == nreplies){
+              stat_hist_add(&cfg_peer[i].phases[phase], now_ns() - start);
+            }
+          }
+        }
+        break;
+    } //end select
+  } //end while
+
+  return (nack > 0) ? -1 : 0; //if even one nack, then return error
+}
+
+//SYNC: send nlines commands in buf to all peers, and wait for their replies
+static int psync_wrall(struct peer_conn * pc, const char * buf, const int nlines, const int phase){
+  int i;
+  char buf2[MAX_LINE_LEN+1];
+  const int len = strlen(buf);
+  const long long start = now_ns();
+
+  for(i=0; i < cfg_npeers; i++){
+    log_msg(LOG_DEBUG, "[PSYNC:%d out] %s", i, buf);
+
+    if(inject(INJ_PEER_SEND) < 0){
+      return -1;
+    }
+
+    if(writen(pc[i].fd, buf, len) != len){
+      return -1;
+    }
+  }
+
+  return psync_rdall(pc, buf2, MAX_LINE_LEN, nlines, phase, start);
+}
+
+//SYNC: send the messages, all in one round
+static int psync_commit(struct peer_conn * pc, const int id, const char * username, char ** messages, const int n){
+  size_t size = 1, len = 0;
+  int i;
+
+  //messages are stored cut to MAX_MSG_LEN, send them so. A line then fits
+  //in MAX_LINE_LEN on the peer
+  const size_t ulen = strnlen(username, MAX_USR_LEN);
+  for(i=0; i < n; i++){
+    size += 32 + ulen + strnlen(messages[i], MAX_MSG_LEN);  //32 for command, id and separators
+  }
+
+  char * buf = (char*) malloc(size);
+  if(buf == NULL){
+    perror("malloc");
+    return -1;
+  }
+
+  for(i=0; i < n; i++){
+    const int rv = (id == -1) ?
+      snprintf(&buf[len], size - len, "SYNC_WRITE %.*s/%.*s\n", (int) ulen, username, MAX_MSG_LEN, messages[i]) :
+      snprintf(&buf[len], size - len, "SYNC_REPLACE %d/%.*s/%.*s\n", id, (int) ulen, username, MAX_MSG_LEN, messages[i]);
+    if((rv < 0) || ((size_t) rv >= (size - len))){ //can't be, size is the most it takes
+      free(buf);
+      return -1;
+    }
+    len += rv;
+  }
+
+  const int rc = psync_wrall(pc, buf, n, PHASE_WRITE);
+  free(buf);
+  return rc;
+}
+
+//Add or remove record at index, in the word and user indexes.
+//Called with board write locked
+static void bulletin_terms(struct bulletin_board * b, const int index, const int add){
+  const struct bulletin_item * item = &b->items[index];
+  const char * msg = item->msg;
+  const char * end = &item->msg[MAX_MSG_LEN];
+  char term[MAX_TERM_LEN];
+  int len;
+
+  while((len = tindex_token(&msg, end, term)) > 0){
+    const unsigned int h = tindex_hash(term, len);
+    if(add){
+      if(tindex_add(&b->words, term, len, h, item->num) == 1){
+        b->words.nterms++;
+      }
+    }else{
+      tindex_del(&b->words, term, len, h, item->num);
+    }
+  }
+
+  len = strnlen(item->usr, MAX_USR_LEN);
+  const unsigned int h = tindex_hash(item->usr, len);
+  if(add){
+    if(tindex_add(&b->users, item->usr, len, h, item->num) == 1){
+      b->users.nterms++;
+    }
+  }else{
+    tindex_del(&b->users, item->usr, len, h, item->num);
+  }
+
+  if(add && (b->words.nterms > 2*b->words.nbuckets)){
+    tindex_rehash(&b->words);
+  }
+  if(add && (b->users.nterms > 2*b->users.nbuckets)){
+    tindex_rehash(&b->users);
+  }
+}
+
+struct terms_job {  //part of the index build, run by one thread
+  struct bulletin_board * b;
+  int part, nparts;
+  int lo, hi;         //records we index
+  struct term_index words, users; //and their terms, until the merge
+  struct terms_job * jobs;  //all parts, for the merge
+  int nwords, nusers; //new terms we merged in the board
+};
+
+//Index words and users of records lo..hi-1, in our own indexes
+static void * bulletin_terms_thread(void * arg){
+  struct terms_job * job = (struct terms_job *) arg;
+  struct bulletin_board * b = job->b;
+  char term[MAX_TERM_LEN];
+  int i, len;
+
+  for(i=job->lo; i < job->hi; i++){
+    const struct bulletin_item * item = &b->items[i];
+    if(b->nums[i] == 0){
+      continue;
+    }
+
+    const char * msg = item->msg;
+    const char * end = &item->msg[MAX_MSG_LEN];
+    while((len = tindex_token(&msg, end, term)) > 0){
+      tindex_add(&job->words, term, len, tindex_hash(term, len), item->num);
+    }
+
+    len = strnlen(item->usr, MAX_USR_LEN);
+    tindex_add(&job->users, item->usr, len, tindex_hash(item->usr, len), item->num);
+  }
+
+  return NULL;
+}
+
+//Move terms in buckets from..to-1 of the parts to ti. A part bucket k
+//only has terms of ti buckets k, k + its nbuckets, ..., so threads with
+//their own buckets don't meet. Parts are in record order, so their post
+//numbers just follow each other. Returns new terms in ti
+static int bulletin_terms_merge(struct term_index * ti, struct terms_job * jobs, const int users,
+                                const int from, const int to){
+  int j, k, added = 0;
+
+  for(j=0; j < jobs[0].nparts; j++){
+    struct term_index * part = users ? &jobs[j].users : &jobs[j].words;
+
+    for(k=from; k < to; k++){
+      struct posting * p = part->buckets[k];
+      while(p){
+        struct posting * next = p->next;
+        const int len = strlen(p->term);
+        const unsigned int h = tindex_hash(p->term, len);
+        const unsigned int bk = h & (ti->nbuckets - 1);
+
+        struct posting * q;
+        for(q = ti->buckets[bk]; q && (strcmp(q->term, p->term) != 0); q = q->next);
+
+        if(q == NULL){
+          p->next = ti->buckets[bk];
+          ti->buckets[bk] = p;
+          added++;
+          p = next;
+          continue;
+        }
+
+        if((q->len > 0) && (p->len > 0) && (q->nums[q->len-1] >= p->nums[0])){  //record not in its slot, add one by one
+          int i;
+          for(i=0; i < p->len; i++){
+            tindex_add(ti, p->term, len, h, p->nums[i]);
+          }
+        }else{
+          int * nums = (int*) realloc(q->nums, (q->len + p->len)*sizeof(int));
+          if(nums == NULL){
+            perror("realloc");  //term misses these posts
+          }else{
+            memcpy(&nums[q->len], p->nums, p->len*sizeof(int));
+            q->nums = nums;
+            q->len += p->len;
+            q->size = q->len;
+          }
+        }
+        free(p->term);
+        free(p->nums);
+        free(p);
+        p = next;
+      }
+      part->buckets[k] = NULL;
+    }
+  }
+  return added;
+}
+
+//Merge our slice of the part buckets in the board indexes
+static void * bulletin_merge_thread(void * arg){
+  struct terms_job * job = (struct terms_job *) arg;
+  struct bulletin_board * b = job->b;
+  const long nw = job->words.nbuckets, nu = job->users.nbuckets;
+
+  job->nwords = bulletin_terms_merge(&b->words, job->jobs, 0,
+    nw * job->part / job->nparts, nw * (job->part + 1) / job->nparts);
+  job->nusers = bulletin_terms_merge(&b->users, job->jobs, 1,
+    nu * job->part / job->nparts, nu * (job->part + 1) / job->nparts);
+  return NULL;
+}
+
+//Run fn on all jobs, on a thread for each but the first, which we run.
+//Jobs of threads that didn't start run here too
+static void bulletin_terms_run(void * (*fn)(void *), struct terms_job * jobs, const int n){
+  pthread_t threads[64];
+  int i, nthreads = 0;
+
+  for(i=1; i < n; i++){
+    if(pthread_create(&threads[i], NULL, fn, &jobs[i]) != 0){
+      break;
+    }
+    nthreads++;
+  }
+
+  fn(&jobs[0]);
+  for(i=1; i <= nthreads; i++){
+    pthread_join(threads[i], NULL);
+  }
+  for(i=nthreads+1; i < n; i++){
+    fn(&jobs[i]);
+  }
+}
+
+//Build the word and user indexes from the board, using all cores. Each
+//thread tokenizes a range of records into its own indexes, then they
+//merge them in the board's, each on its own buckets
+static int bulletin_terms_load(struct bulletin_board * b){
+  struct terms_job jobs[64];
+  int i, rc = 0;
+
+  long nparts = sysconf(_SC_NPROCESSORS_ONLN);
+  if((nparts < 1) || (b->board_len < 10000)){
+    nparts = 1;
+  }else if(nparts > 64){
+    nparts = 64;
+  }
+
+  if( (tindex_open(&b->words, b->board_len) < 0) ||
+      (tindex_open(&b->users, b->board_len / 8) < 0) ){
+    return -1;
+  }
+
+  //parts have a share of the board buckets, a power of 2 that divides it
+  memset(jobs, 0, sizeof(jobs));
+  for(i=0; i < nparts; i++){
+    jobs[i].b = b;
+    jobs[i].part = i;
+    jobs[i].nparts = nparts;
+    jobs[i].lo = 1 + (long) b->board_len * i / nparts;
+    jobs[i].hi = 1 + (long) b->board_len * (i + 1) / nparts;
+    jobs[i].jobs = jobs;
+    if( (tindex_open(&jobs[i].words, b->words.nbuckets / nparts) < 0) ||
+        (tindex_open(&jobs[i].users, b->users.nbuckets / nparts) < 0) ){
+      rc = -1;
+    }
+  }
+
+  if(rc == 0){
+    bulletin_terms_run(bulletin_terms_thread, jobs, nparts);
+    bulletin_terms_run(bulletin_merge_thread, jobs, nparts);
+  }
+
+  for(i=0; i < nparts; i++){  //merged ones are empty
+    tindex_close(&jobs[i].words);
+    tindex_close(&jobs[i].users);
+    b->words.nterms += jobs[i].nwords;
+    b->users.nterms += jobs[i].nusers;
+  }
+  if(rc < 0){
+    return -1;
+  }
+
+  while(b->words.nterms > 2*b->words.nbuckets){
+    tindex_rehash(&b->words);
+  }
+  while(b->users.nterms > 2*b->users.nbuckets){
+    tindex_rehash(&b->users);
+  }
+
+  log_msg(LOG_DEBUG, "[INDEX] %d terms, %d users in %d records, %ld threads\n",
+    b->words.nterms, b->users.nterms, b->board_len, nparts);
+  return 0;
+}
+
+//Open board b from b->file, with a reply cache of cache_mem bytes
+static int bulletin_open(struct bulletin_board * b, const int cache_mem){
+
+  if(b->file == NULL){
+    return -1;
+  }
+
+  if(bulletin_map(b) == -1){
+    return -1;
+  }
+
+  pthread_rwlock_init(&b->rwlock, NULL);
+
+  if( (cache_open(&b->cache, cache_mem) < 0) ||
+      (bulletin_terms_load(b) < 0) ){
+    return -1;
+  }
+
+  //no transaction yet
+  memset(&b->undo, 0, sizeof(struct undo_log));
+
+  return 0;
+}
+
+static int bulletin_close(struct bulletin_board * b){
+  if(b->group != 0){  //a name only
+    pthread_rwlock_destroy(&b->rwlock);
+    return 0;
+  }
+
+  munmap(b->items, b->board_size*sizeof(struct bulletin_item));
+  close(b->fd);
+  pthread_rwlock_destroy(&b->rwlock);
+  cache_close(&b->cache);
+  tindex_close(&b->words);
+  tindex_close(&b->users);
+  free(b->undo.recs);
+  memset(&b->undo, 0, sizeof(struct undo_log));
+
+  free(b->nums);
+  free(b->vers);
+  b->nums = NULL;
+  b->vers = NULL;
+  return 0;
+}
+
+//Open a board for each BBFILE=[name:]path. A board with no name is
+//named after its file. CACHEMEM is shared by all of them. A board of
+//another group is only a name, for routing, its file isn't opened
+static int MAIN_ONLY boards_open(){
+  int i, j;
+
+  for(i=0; i < cfg_nboards; i++){
+    struct bulletin_board * b = &boards[i];
+    char * entry = cfg_board_file[i];
+    const char * colon = strchr(entry, ':');
+    const char * slash = strrchr(entry, '/');
+
+    if(colon && (colon > entry) && ((slash == NULL) || (slash > colon))){
+      b->name = strndup(entry, colon - entry);
+      b->file = &colon[1];
+    }else{
+      b->name = strdup(slash ? &slash[1] : entry);
+      b->file = entry;
+    }
+    if(b->name == NULL){
+      perror("strdup");
+      return -1;
+    }
+
+    for(j=0; j < i; j++){
+      if(strcmp(boards[j].name, b->name) == 0){
+        break;
+      }
+    }
+    if((b->name[0] == '\0') || (b->file[0] == '\0') || (j < i)){
+      fprintf(stderr, "Error: Invalid BBFILE '%s', each board needs its own name\n", entry);
+      free(b->name);
+      b->name = NULL;
+      return -1;
+    }
+
+    if(ngroups > 1){
+      b->group = ring_owner(b->name);
+      log_msg(LOG_INFO, "[ROUTE] board %s is on group %s\n", b->name, groups[b->group].name);
+    }
+    if(b->group != 0){
+      pthread_rwlock_init(&b->rwlock, NULL);  //boards_wrlock takes it
+      nboards++;
+      continue;
+    }
+
+    if(bulletin_open(b, cfg_cache_mem / cfg_nboards) < 0){
+      free(b->name);
+      b->name = NULL;
+      return -1;
+    }
+    nboards++;
+  }
+
+  return (nboards > 0) ? 0 : -1;
+}
+
+static void boards_close(){
+  int i;
+  for(i=0; i < nboards; i++){
+    bulletin_close(&boards[i]);
+    free(boards[i].name);
+    boards[i].name = NULL;
+  }
+  nboards = 0;
+}
+
+//Find board by name, NULL if we don't have it
+static struct bulletin_board * board_find(const char * name){
+  int i;
+  for(i=0; i < nboards; i++){
+    if(strcmp(boards[i].name, name) == 0){
+      return &boards[i];
+    }
+  }
+  return NULL;
+}
+
+//Write lock all boards, for what they share, like the peers. Boards are
+//always taken in this order, and a 2PC write holds only its own
+static void boards_wrlock(){
+  int i;
+  for(i=0; i < nboards; i++){
+    board_wrlock(&boards[i]);
+  }
+}
+
+static void boards_unlock(){
+  int i;
+  for(i=nboards-1; i >= 0; i--){
+    pthread_rwlock_unlock(&boards[i].rwlock);
+  }
+}
+
+//Called with board write locked
+static int bulletin_remap(struct bulletin_board * b){
+  //increase size of bulleting board with 10 items
+  const int new_size = b->board_size + 10;
+  if(ftruncate(b->fd, new_size*sizeof(struct bulletin_item)) < 0){
+    perror("ftruncate");
+    return -1;
+  }
+
+  //remap the board, without touching the lock we are holding
+  struct bulletin_item * items = mremap(b->items,
+    b->board_size*sizeof(struct bulletin_item),
+    new_size*sizeof(struct bulletin_item), MREMAP_MAYMOVE);
+  if(items == MAP_FAILED){
+    perror("mremap");
+    return -1;
+  }
+  b->items = items;
+
+  if(bulletin_index_grow(b, b->board_size, new_size) < 0){
+    return -1;
+  }
+  b->board_size = new_size;
+
+  return 0;
+}
+
+//Find a record by id
+static int bulletin_search(struct bulletin_board * b, const int num){
+
+  if(num <= 0){ //slot 0 is never used
+    return -1;
+  }
+
+  //writes put record num in slot num, so try it first
+  const int * nums = b->nums;
+  const int len = b->board_len + 1;
+  if((num < len) && (nums[num] == num)){
+    return num;
+  }
+
+  int i = 1;
+#ifdef __SSE2__
+  //compare 16 numbers per iteration, one cache line of the hot index
+  const __m128i key = _mm_set1_epi32(num);
+  for(; (i + 16) <= len; i += 16){
+    const __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) &nums[i]),    key);
+    const __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) &nums[i+4]),  key);
+    const __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) &nums[i+8]),  key);
+    const __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) &nums[i+12]), key);
+    const __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if(_mm_movemask_epi8(any) != 0){
+      break;  //its in this block, finish with the loop below
+    }
+  }
+#endif
+
+  for(; i < len; i++){
+    if(nums[i] == num)
+      return i;
+  }
+  return -1;
+}
+
+//Render record at index as a READ reply line, returns its length
+static int bulletin_render(struct bulletin_board * b, const int index, char * buf){
+  const struct bulletin_item * item = &b->items[index];
+  return snprintf(buf, CACHE_LINE_LEN, "2.0 MESSAGE %i %.*s/%.*s\n", item->num,
+            MAX_USR_LEN, item->usr, MAX_MSG_LEN, item->msg);
+}
+
+//Send record num as a READ reply. It is taken from the reply cache, or
+//rendered, under the read lock, and sent after it, so a slow client
+//can't hold the board
+static int bulletin_send(struct bulletin_board * b, const int fd, const int num){
+  char line[CACHE_LINE_LEN];
+  int len;
+
+  board_rdlock(b);
+
+  log_msg(LOG_DEBUG, "[READING] item.num=%i\n", num);
+  if(inject(INJ_READ) < 0){
+    pthread_rwlock_unlock(&b->rwlock);
+    return -1;
+  }
+
+  const int index = bulletin_search(b, num);
+  if(index < 0){
+    pthread_rwlock_unlock(&b->rwlock);
+    return 0;
+  }
+
+  if(b->cache.size > 0){
+    const unsigned int ver = b->vers[index];
+
+    len = cache_get(&b->cache, num, ver, line);
+    if(len == 0){ //render it once, for next readers
+      len = bulletin_render(b, index, line);
+      cache_put(&b->cache, num, ver, line, len);
+    }
+  }else{
+    len = bulletin_render(b, index, line);
+  }
+
+  log_msg(LOG_DEBUG, "[READING DONE] item.num=%i\n", num);
+  pthread_rwlock_unlock(&b->rwlock);
+
+  return (writen(fd, line, len) < 0) ? -1 : 1;
+}
+
+//Render records nums[0..n) in buf. Missing records are reported as
+//UNKNOWN if unknown is set, else skipped. Called with board read locked
+static int bulletin_render_many(struct bulletin_board * b, const int * nums, const int n, const int unknown,
+                                char * buf, int * found){
+  int i, len = 0;
+
+  for(i=0; i < n; i++){
+    const int index = bulletin_search(b, nums[i]);
+    if(index >= 0){
+      len += bulletin_render(b, index, &buf[len]);
+      (*found)++;
+    }else if(unknown){
+      len += snprintf(&buf[len], CACHE_LINE_LEN, "2.1 UNKNOWN %i No such message\n", nums[i]);
+    }
+  }
+  return len;
+}
+
+//Send records nums[0..n) in one reply, rendered under a single read lock.
+//Returns how many messages were sent.
+static int bulletin_send_many(struct bulletin_board * b, const int fd, const int * nums, const int n, const int unknown){
+  int len, found = 0;
+
+  char * buf = (char*) malloc((n + 1) * CACHE_LINE_LEN);
+  if(buf == NULL){
+    perror("malloc");
+    return -1;
+  }
+
+  board_rdlock(b);
+
+  log_msg(LOG_DEBUG, "[READING] %d items\n", n);
+  if(inject(INJ_READ) < 0){
+    pthread_rwlock_unlock(&b->rwlock);
+    free(buf);
+    return -1;
+  }
+
+  len = bulletin_render_many(b, nums, n, unknown, buf, &found);
+
+  log_msg(LOG_DEBUG, "[READING DONE] %d items\n", n);
+  pthread_rwlock_unlock(&b->rwlock);
+
+  len += snprintf(&buf[len], CACHE_LINE_LEN, "2.3 END %i\n", found);
+
+  const int rv = writen(fd, buf, len);
+  free(buf);
+
+  return (rv < 0) ? -1 : found;
+}
+
+//Send posts that have all words of query, at most MAX_RANGE_LEN.
+//Returns how many messages were sent.
+static int bulletin_send_search(struct bulletin_board * b, const int fd, const char * query){
+  const struct posting * p[MAX_CMD_ARGS];
+  char term[MAX_TERM_LEN];
+  int i, j, len, n = 0, found = 0;
+  const char * end = query + strlen(query);
+
+  int * nums = (int*) malloc(MAX_RANGE_LEN*sizeof(int));
+  char * buf = (char*) malloc((MAX_RANGE_LEN + 1) * CACHE_LINE_LEN);
+  if((nums == NULL) || (buf == NULL)){
+    perror("malloc");
+    free(nums);
+    free(buf);
+    return -1;
+  }
+
+  board_rdlock(b);
+
+  int nterms = 0, missing = 0;
+  while((nterms < MAX_CMD_ARGS) && ((len = tindex_token(&query, end, term)) > 0)){
+    p[nterms] = tindex_find(&b->words, term, len, tindex_hash(term, len));
+    if((p[nterms] == NULL) || (p[nterms]->len == 0)){
+      missing = 1;
+      break;
+    }
+
+    //keep the shortest list first, we walk it
+    if(p[nterms]->len < p[0]->len){
+      const struct posting * tmp = p[0];
+      p[0] = p[nterms];
+      p[nterms] = tmp;
+    }
+    nterms++;
+  }
+
+  if(!missing && (nterms > 0)){
+    //intersect, probing the other lists with binary search
+    for(i=0; (i < p[0]->len) && (n < MAX_RANGE_LEN); i++){
+      const int num = p[0]->nums[i];
+      for(j=1; j < nterms; j++){
+        const int pos = posting_find(p[j], num);
+        if((pos == p[j]->len) || (p[j]->nums[pos] != num)){
+          break;
+        }
+      }
+      if(j == nterms){
+        nums[n++] = num;
+      }
+    }
+  }
+
+  len = bulletin_render_many(b, nums, n, 0, buf, &found);
+  pthread_rwlock_unlock(&b->rwlock);
+
+  len += snprintf(&buf[len], CACHE_LINE_LEN, "2.3 END %i\n", found);
+
+  const int rv = writen(fd, buf, len);
+  free(nums);
+  free(buf);
+
+  return (rv < 0) ? -1 : found;
+}
+
+//Send posts of user usr, with number from or above, at most count.
+//Returns how many messages were sent.
+static int bulletin_send_user(struct bulletin_board * b, const int fd, const char * usr, const int from, const int count){
+  int i, len, n = 0, found = 0;
+
+  int * nums = (int*) malloc(count*sizeof(int));
+  char * buf = (char*) malloc((count + 1) * CACHE_LINE_LEN);
+  if((nums == NULL) || (buf == NULL)){
+    perror("malloc");
+    free(nums);
+    free(buf);
+    return -1;
+  }
+
+  board_rdlock(b);
+
+  len = strnlen(usr, MAX_USR_LEN);
+  const struct posting * p = tindex_find(&b->users, usr, len, tindex_hash(usr, len));
+  if(p){
+    for(i = posting_find(p, from); (i < p->len) && (n < count); i++){
+      nums[n++] = p->nums[i];
+    }
+  }
+
+  len = bulletin_render_many(b, nums, n, 0, buf, &found);
+  pthread_rwlock_unlock(&b->rwlock);
+
+  len += snprintf(&buf[len], CACHE_LINE_LEN, "2.3 END %i\n", found);
+
+  const int rv = writen(fd, buf, len);
+  free(nums);
+  free(buf);
+
+  return (rv < 0) ? -1 : found;
+}
+
+//Start a new transaction. Called with board write locked
+static void bulletin_begin(struct bulletin_board * b){
+  b->undo.len = 0;
+}
+
+//Add a record to undo log of current transaction
+static struct undo_rec * bulletin_undo_push(struct bulletin_board * b, const int index){
+  struct undo_log * u = &b->undo;
+
+  if(u->len == u->size){
+    const int size = (u->size == 0) ? 16 : 2*u->size;
+    struct undo_rec * recs = (struct undo_rec *) realloc(u->recs, size*sizeof(struct undo_rec));
+    if(recs == NULL){
+      perror("realloc");
+      return NULL;
+    }
+    u->recs = recs;
+    u->size = size;
+  }
+
+  struct undo_rec * rec = &u->recs[u->len++];
+  rec->index = index;
+  return rec;
+}
+
+static int bulletin_write(struct bulletin_board * b, const char *user, const char *message){
+
+  if(inject(INJ_WRITE) < 0){
+    return -1;
+  }
+
+  if((b->board_len + 1) >= b->board_size){
+    if(bulletin_remap(b) < 0){ //increase size of bulletin board
+      return -1;
+    }
+  }
+
+  //fill record data
+  const int index = ++b->board_len;
+  b->items[index].num = index;
+  b->nums[index] = index;
+  b->vers[index]++;
+  strncpy(b->items[index].usr, user, MAX_USR_LEN);
+  strncpy(b->items[index].msg, message, MAX_MSG_LEN);
+  bulletin_terms(b, index, 1);
+
+  log_msg(LOG_DEBUG, "[WRITING] item.num=%d\n", b->items[index].num);
+
+  //save info for reverting commit
+  struct undo_rec * u = bulletin_undo_push(b, index);
+  if(u){
+    u->write = 1;
+  }
+
+  log_msg(LOG_DEBUG, "[WRITE DONE] item.num=%d\n", b->items[index].num);
+
+  return b->items[index].num;
+}
+
+static int bulletin_replace(struct bulletin_board * b, const int num, const char *user, const char *message){
+
+  log_msg(LOG_DEBUG, "[REPLACING] item.num=%d\n", num);
+  if(inject(INJ_REPLACE) < 0){
+    return -1;
+  }
+
+  const int index = bulletin_search(b, num);
+  if(index >= 0){
+
+    //save info for reverting commit
+    struct undo_rec * u = bulletin_undo_push(b, index);
+    if(u){
+      u->write = 0;
+      memcpy(&u->item, &b->items[index], sizeof(struct bulletin_item));
+    }
+
+    //id stays the same, update rest
+    bulletin_terms(b, index, 0);
+    strncpy(b->items[index].usr, user, MAX_USR_LEN);
+    strncpy(b->items[index].msg, message, MAX_MSG_LEN);
+    b->vers[index]++;
+    bulletin_terms(b, index, 1);
+
+    cache_invalidate(&b->cache, num);
+  }
+
+  log_msg(LOG_DEBUG, "[REPLACE END] num=%d\n", num);
+
+  return (index >= 0) ? b->items[index].num : 0;
+}
+
+//WATCH: append len bytes to a growing array
+static int watch_append(char ** buf, int * len, const char * data, const int dlen){
+  char * b = (char*) realloc(*buf, *len + dlen);
+  if(b == NULL){
+    perror("realloc");
+    return -1;
+  }
+  memcpy(&b[*len], data, dlen);
+  *buf = b;
+  *len += dlen;
+  return 0;
+}
+
+//WATCH: queue post num of board b for watchers. Called with b write locked
+static void watch_publish(struct bulletin_board * b, const int num){
+  int rc = 0;
+
+  pthread_mutex_lock(&whub.mutex);
+  if(whub.efd > 0){ //if hub is running
+    if(whub.qlen == whub.qsize){
+      const int size = (whub.qsize == 0) ? 64 : 2*whub.qsize;
+      struct watch_post * q = (struct watch_post*) realloc(whub.queue, size*sizeof(struct watch_post));
+      if(q == NULL){
+        rc = -1;
+      }else{
+        whub.queue = q;
+        whub.qsize = size;
+      }
+    }
+
+    if(rc == 0){
+      whub.queue[whub.qlen].board = b;
+      whub.queue[whub.qlen++].num = num;
+      whub.published++;
+      const uint64_t one = 1;
+      write(whub.efd, &one, sizeof(one));
+    }
+  }
+  pthread_mutex_unlock(&whub.mutex);
+}
+
+//Publish changes of current transaction to watchers, on commit.
+//Called with board write locked
+static void bulletin_publish(struct bulletin_board * b){
+  int i;
+  for(i=0; i < b->undo.len; i++){
+    const int index = b->undo.recs[i].index;
+    if(b->nums[index] != 0){
+      watch_publish(b, b->nums[index]);
+    }
+  }
+  b->undo.len = 0;  //its commited, nothing to revert
+}
+
+//WATCH: close and free a watcher. Called from hub thread
+static void watch_drop(struct watcher * w){
+  epoll_ctl(whub.epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  shutdown(w->fd, SHUT_RDWR);
+  close(w->fd);
+
+  //move last one in our place
+  whub.watchers[w->pos] = whub.watchers[--whub.nwatchers];
+  whub.watchers[w->pos]->pos = w->pos;
+  whub.nparked -= (w->board == NULL);
+
+  free(w->out);
+  free(w);
+}
+
+//ROUTE: routed connection w has its next request, give it back to a
+//worker. Called from hub thread
+static void watch_unpark(struct watcher * w){
+  epoll_ctl(whub.epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+  whub.watchers[w->pos] = whub.watchers[--whub.nwatchers];
+  whub.watchers[w->pos]->pos = w->pos;
+  whub.nparked--;
+
+  bb_push(&shards[w->fd % nshards], w->fd, PRIO_RESUME);
+  free(w);
+}
+
+//WATCH: send what watcher has pending, without blocking. Returns -1 if
+//watcher has to be dropped
+static int watch_flush(struct watcher * w){
+  int sent = 0;
+
+  while(sent < w->len){
+    const ssize_t rv = send(w->fd, &w->out[sent], w->len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(rv < 0){
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+        break;
+      }
+      return -1;
+    }
+    sent += rv;
+  }
+
+  w->len -= sent;
+  memmove(w->out, &w->out[sent], w->len);
+
+  //wait for socket to drain, or give up on a slow reader
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | ((w->len > 0) ? EPOLLOUT : 0);
+  ev.data.ptr = w;
+  epoll_ctl(whub.epfd, EPOLL_CTL_MOD, w->fd, &ev);
+
+  return (w->len > MAX_WATCH_BUF) ? -1 : 0;
+}
+
+//WATCH: render posts in queue once, and push them to every watcher of their board
+static void watch_fanout(struct watch_post * queue, const int qlen, const unsigned long first){
+  char line[CACHE_LINE_LEN];
+  int i, j;
+
+  for(i=0; i < qlen; i++){
+    struct bulletin_board * b = queue[i].board;
+    int len = 0;
+
+    board_rdlock(b);
+    const int index = bulletin_search(b, queue[i].num);
+    if(index >= 0){
+      len = bulletin_render(b, index, line);
+    }
+    pthread_rwlock_unlock(&b->rwlock);
+
+    //backwards, so a dropped watcher is swapped with one we did
+    for(j=whub.nwatchers-1; (len > 0) && (j >= 0); j--){
+      struct watcher * w = whub.watchers[j];
+      if((w->board == b) && (w->since <= (first + i))){
+        //a reader that fell MAX_WATCH_BUF behind is dropped, not queued for
+        if(((w->len + len) > MAX_WATCH_BUF) || (watch_append(&w->out, &w->len, line, len) < 0)){
+          watch_drop(w);
+        }
+      }
+    }
+  }
+
+  for(j=whub.nwatchers-1; j >= 0; j--){
+    struct watcher * w = whub.watchers[j];
+    if((w->len > 0) && (watch_flush(w) < 0)){
+      watch_drop(w);
+    }
+  }
+}
+
+static void * watch_thread(void * arg){
+  struct epoll_event evs[64];
+  int i;
+
+  while(1){
+    const int n = epoll_wait(whub.epfd, evs, 64, -1);
+    if((n < 0) && (errno != EINTR)){
+      perror("epoll_wait");
+      break;
+    }
+
+    for(i=0; i < n; i++){
+      if(evs[i].data.ptr == NULL){  //its the eventfd
+        uint64_t cnt;
+        read(whub.efd, &cnt, sizeof(cnt));
+        continue;
+      }
+
+      struct watcher * w = (struct watcher *) evs[i].data.ptr;
+      if(w->board == NULL){ //a worker reads the request, or the hang up
+        watch_unpark(w);
+        continue;
+      }
+      if(evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
+        char buf[256];  //watchers only talk to hang up
+        const ssize_t rv = recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if((rv == 0) || ((rv < 0) && (errno != EAGAIN))){
+          watch_drop(w);
+          continue;
+        }
+      }
+      if((evs[i].events & EPOLLOUT) && (watch_flush(w) < 0)){
+        watch_drop(w);
+      }
+    }
+
+    //take new watchers and queued posts
+    pthread_mutex_lock(&whub.mutex);
+    const int nold = whub.nwatchers;
+    const int stop = whub.stop;
+    struct watch_post * queue = whub.queue;
+    const int qlen = whub.qlen;
+    const unsigned long first = whub.published - whub.qlen;
+    whub.queue = NULL;
+    whub.qlen = whub.qsize = 0;
+
+    for(i=0; i < whub.nadded; i++){
+      struct watcher * w = whub.added[i];
+      if(whub.nwatchers == whub.size){
+        const int size = (whub.size == 0) ? 64 : 2*whub.size;
+        struct watcher ** ws = (struct watcher **) realloc(whub.watchers, size*sizeof(struct watcher*));
+        if(ws == NULL){
+          close(w->fd);
+          free(w->out);
+          free(w);
+          continue;
+        }
+        whub.watchers = ws;
+        whub.size = size;
+      }
+
+      w->pos = whub.nwatchers;
+      whub.watchers[whub.nwatchers++] = w;
+      whub.nparked += (w->board == NULL);
+
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.ptr = w;
+      epoll_ctl(whub.epfd, EPOLL_CTL_ADD, w->fd, &ev);
+    }
+    whub.nadded = 0;
+    pthread_mutex_unlock(&whub.mutex);
+
+    if(stop){
+      free(queue);
+      break;
+    }
+
+    //send catch-up output of new watchers, before posts queue up after it
+    for(i=whub.nwatchers-1; i >= nold; i--){
+      struct watcher * w = whub.watchers[i];
+      if((w->len > 0) && (watch_flush(w) < 0)){
+        watch_drop(w);
+      }
+    }
+
+    watch_fanout(queue, qlen, first);
+    free(queue);
+  }
+
+  while(whub.nwatchers > 0){
+    watch_drop(whub.watchers[0]);
+  }
+  return NULL;
+}
+
+//WATCH: park connection fd on board b, with catch-up output in out. Called
+//with b read locked, so no commit can be published before watcher is added.
+//A NULL b parks a routed connection until it has a request
+static int watch_add(const struct bulletin_board * b, const int fd, char * out, const int len){
+
+  struct watcher * w = (struct watcher *) calloc(1, sizeof(struct watcher));
+  if(w == NULL){
+    perror("calloc");
+    return -1;
+  }
+  w->fd  = fd;
+  w->board = b;
+  w->out = out;
+  w->len = len;
+
+  pthread_mutex_lock(&whub.mutex);
+  if(whub.stop){  //we are shutting down
+    pthread_mutex_unlock(&whub.mutex);
+    free(w);
+    return -1;
+  }
+  if(whub.nadded == whub.addsize){
+    const int size = (whub.addsize == 0) ? 16 : 2*whub.addsize;
+    struct watcher ** added = (struct watcher **) realloc(whub.added, size*sizeof(struct watcher*));
+    if(added == NULL){
+      pthread_mutex_unlock(&whub.mutex);
+      free(w);
+      return -1;
+    }
+    whub.added = added;
+    whub.addsize = size;
+  }
+
+  w->since = whub.published;
+  whub.added[whub.nadded++] = w;
+
+  const uint64_t one = 1;
+  write(whub.efd, &one, sizeof(one));
+  pthread_mutex_unlock(&whub.mutex);
+
+  return 0;
+}
+
+static int MAIN_ONLY watch_open(){
+  memset(&whub, 0, sizeof(struct watch_hub));
+  pthread_mutex_init(&whub.mutex, NULL);
+
+  whub.efd = eventfd(0, EFD_NONBLOCK);
+  whub.epfd = epoll_create1(0);
+  if((whub.efd == -1) || (whub.epfd == -1)){
+    perror("epoll");
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if(epoll_ctl(whub.epfd, EPOLL_CTL_ADD, whub.efd, &ev) == -1){
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  if(pthread_create(&whub.thread, NULL, watch_thread, NULL) != 0){
+    return -1;
+  }
+  return 0;
+}
+
+static void watch_close(){
+  const uint64_t one = 1;
+
+  pthread_mutex_lock(&whub.mutex);
+  whub.stop = 1;
+  write(whub.efd, &one, sizeof(one));
+  pthread_mutex_unlock(&whub.mutex);
+
+  pthread_join(whub.thread, NULL);
+
+  //workers still running may publish or park, hub stays stopped for them
+  pthread_mutex_lock(&whub.mutex);
+  close(whub.efd);
+  close(whub.epfd);
+  whub.efd = whub.epfd = -1;
+  free(whub.queue);
+  free(whub.added);
+  free(whub.watchers);
+  whub.queue = NULL;
+  whub.added = NULL;
+  whub.watchers = NULL;
+  whub.nadded = whub.addsize = 0;
+  whub.qlen = whub.qsize = whub.nwatchers = whub.size = whub.nparked = 0;
+  pthread_mutex_unlock(&whub.mutex);
+}
+
+//Send posts from number from, and park connection to get new ones
+static int bulletin_watch(struct bulletin_board * b, const int fd, int from){
+  int i, len = 0, found = 0;
+
+  char * buf = (char*) malloc((MAX_RANGE_LEN + 1) * CACHE_LINE_LEN);
+  if(buf == NULL){
+    perror("malloc");
+    return -1;
+  }
+
+  board_rdlock(b);
+
+  //catch up with at most MAX_RANGE_LEN of the latest posts
+  if(from == 0){
+    from = b->board_len + 1;
+  }else if(from < (b->board_len - MAX_RANGE_LEN + 1)){
+    from = b->board_len - MAX_RANGE_LEN + 1;
+  }
+
+  for(i=from; i <= b->board_len; i++){
+    const int index = bulletin_search(b, i);
+    if(index >= 0){
+      len += bulletin_render(b, index, &buf[len]);
+      found++;
+    }
+  }
+  len += snprintf(&buf[len], CACHE_LINE_LEN, "2.3 END %i\n", found);
+
+  const int rv = watch_add(b, fd, buf, len);
+  pthread_rwlock_unlock(&b->rwlock);
+
+  if(rv < 0){
+    free(buf);
+  }
+  return rv;
+}
+
+//Undo all changes of current transaction. Called with board write locked
+static int bulletin_revert(struct bulletin_board * b){
+  struct undo_log * u = &b->undo;
+
+  log_msg(LOG_DEBUG, "[ABORTING] %d changes\n", u->len);
+
+  while(u->len > 0){
+    const struct undo_rec * rec = &u->recs[--u->len];
+    const int index = rec->index;
+
+    bulletin_terms(b, index, 0);
+    if(rec->write){
+      //reduce item count, and clear last item
+      b->board_len--;
+      memset(&b->items[index], 0, sizeof(struct bulletin_item));
+      b->nums[index] = 0;
+
+      log_msg(LOG_DEBUG, "[WRITING] Reverted written item.num=%d\n", index);
+    }else{
+      //restore old record
+      memcpy(&b->items[index], &rec->item, sizeof(struct bulletin_item));
+      bulletin_terms(b, index, 1);
+      log_msg(LOG_DEBUG, "[REPLACING] Undo item.num=%d, %s/%s\n", rec->item.num, rec->item.usr, rec->item.msg);
+    }
+    b->vers[index]++;
+
+    cache_invalidate(&b->cache, rec->write ? index : rec->item.num);
+  }
+
+  return 1;
+}
+
+//Commit messages to all peers and then to our board, as one transaction.
+//Returns number of first record, 0 if record to replace is missing, or -1
+static int bulletin_commit(struct bulletin_board * b, const int number, const char *user, char ** messages, const int n){
+  int i, rc = 0, first = 0;
+  char line[MAX_LINE_LEN];
+
+  const unsigned long id = trace_id();
+  const long long start = now_ns();
+  long long t;
+
+  //synchronize the commit operation
+  board_wrlock(b);
+  trace_span(TR_LOCK_WAIT, id, start);
+  bulletin_begin(b);
+
+  //before precommit - just see who is available
+  t = now_ns();
+  struct peer_conn * pc = (struct peer_conn *) calloc(cfg_npeers + 1, sizeof(struct peer_conn));
+  if((pc == NULL) || (psync_connect(pc) < 0)){  //read welcome message
+    if(pc){
+      psync_disconnect(pc);
+      free(pc);
+    }
+    pthread_rwlock_unlock(&b->rwlock);
+    trace_span(TR_CONNECT, id, t);
+    trace_span(TR_COMMIT, id, start);
+    return -1;
+  }
+  trace_span(TR_CONNECT, id, t);
+
+  //precommit - locks our board in all instances
+  snprintf(line, sizeof(line), "SYNC_ON %lx/%s\n", id, b->name);
+  t = now_ns();
+  rc = psync_wrall(pc, line, 1, PHASE_PREPARE);
+  trace_span(TR_PREPARE, id, t);
+  if(rc == 0){
+    //actual commit
+    t = now_ns();
+    rc = psync_commit(pc, number, user, messages, n);
+    trace_span(TR_WRITE, id, t);
+
+    t = now_ns();
+    for(i=0; (i < n) && (rc >= 0); i++){  //if commit succeeded
+      if(number == -1){
+        rc = bulletin_write(b, user, messages[i]);
+      }else{
+        rc = bulletin_replace(b, number, user, messages[i]);
+      }
+
+      if(i == 0){
+        first = rc;
+      }
+    }
+    trace_span(TR_LOCAL_WRITE, id, t);
+  }
+
+  //if we had a failure in previous steps
+  t = now_ns();
+  if(rc < 0){
+    bulletin_revert(b); //undo what we wrote so far
+    psync_wrall(pc, "SYNC_ABORT\n", 1, PHASE_FINISH);
+  }else{
+    psync_wrall(pc, "SYNC_OFF\n", 1, PHASE_FINISH);
+    rc = first;
+    bulletin_publish(b);
+  }
+  psync_disconnect(pc);
+  free(pc);
+  trace_span(TR_FINISH, id, t);
+
+  pthread_rwlock_unlock(&b->rwlock);
+  trace_span(TR_COMMIT, id, start);
+
+  return rc;
+}
+
+static int bulletin_sync(struct bulletin_board * b, const int on){
+  int rc;
+  if(on == 1){
+    log_msg(LOG_DEBUG, "[SYNC ON]\n");
+    rc = (board_wrlock(b) != 0) ? -1 : 0;
+    bulletin_begin(b);
+  }else{
+    log_msg(LOG_DEBUG, "[SYNC OFF]\n");
+    bulletin_publish(b); //nothing on abort, revert emptied the log
+    rc = (pthread_rwlock_unlock(&b->rwlock) != 0) ? -1 : 0;
+  }
+
+  return rc;
+}
+
+static int peer_resolve(const char * hname, const int port, struct sockaddr_in *inaddr){
+
+  memset(inaddr, 0, sizeof(struct sockaddr_in));
+  inaddr->sin_family = AF_INET;
+
+  struct hostent * hinfo = gethostbyname(hname);
+  if(hinfo == NULL){
+    perror("gethostbyname");
+    return -1;
+  }
+
+  memcpy(&inaddr->sin_addr, hinfo->h_addr, hinfo->h_length);
+  inaddr->sin_port = htons(port);
+
+  return 0;
+}
+
+//CONFIG: int settings, and where they are in a struct config. Ports come
+//first, config_reload moves them by index
+#define CFG_OFF(f) offsetof(struct config, f)
+static const struct cfg_int cfg_ints[] = {
+  {&cfg_port[0],                CFG_OFF(port[0]),                "BBPORT",           RELOAD_PORT},
+  {&cfg_port[1],                CFG_OFF(port[1]),                "SYNCPORT",         RELOAD_PORT},
+  {&cfg_max_threads,            CFG_OFF(max_threads),            "THMAX",            RELOAD_POOL},
+  {&cfg_min_threads,            CFG_OFF(min_threads),            "THMIN",            RELOAD_POOL},
+  {&cfg_queue_wait,             CFG_OFF(queue_wait),             "QUEUEWAIT",        RELOAD_NOW},
+  {&cfg_idle_time,              CFG_OFF(idle_time),              "THIDLE",           RELOAD_NOW},
+  {&cfg_acceptors,              CFG_OFF(acceptors),              "ACCEPTORS",        RELOAD_RESTART},
+  {&cfg_io,                     CFG_OFF(io),                     "IO",               RELOAD_RESTART},
+  {&cfg_backlog,                CFG_OFF(backlog),                "BACKLOG",          RELOAD_BACKLOG},
+  {&cfg_queue_deadline,         CFG_OFF(queue_deadline),         "QUEUEDEADLINE",    RELOAD_NOW},
+  {&cfg_read_timeout,           CFG_OFF(read_timeout),           "READTIMEOUT",      RELOAD_NOW},
+  {&cfg_write_timeout,          CFG_OFF(write_timeout),          "WRITETIMEOUT",     RELOAD_NOW},
+  {&cfg_sync_read_timeout,      CFG_OFF(sync_read_timeout),      "SYNCREADTIMEOUT",  RELOAD_NOW},
+  {&cfg_sync_write_timeout,     CFG_OFF(sync_write_timeout),     "SYNCWRITETIMEOUT", RELOAD_NOW},
+  {&cfg_user_rate[RATE_READ],   CFG_OFF(user_rate[RATE_READ]),   "USERRATE reads",   RELOAD_NOW},
+  {&cfg_user_rate[RATE_WRITE],  CFG_OFF(user_rate[RATE_WRITE]),  "USERRATE writes",  RELOAD_NOW},
+  {&cfg_ip_rate[RATE_READ],     CFG_OFF(ip_rate[RATE_READ]),     "IPRATE reads",     RELOAD_NOW},
+  {&cfg_ip_rate[RATE_WRITE],    CFG_OFF(ip_rate[RATE_WRITE]),    "IPRATE writes",    RELOAD_NOW},
+  {&cfg_daemon,                 CFG_OFF(daemon),                 "DAEMON",           RELOAD_RESTART},
+  {&cfg_debug,                  CFG_OFF(debug),                  "DEBUG",            RELOAD_NOW},
+  {&cfg_cache_mem,              CFG_OFF(cache_mem),              "CACHEMEM",         RELOAD_CACHE},
+  {&cfg_metrics_port,           CFG_OFF(metrics_port),           "METRICSPORT",      RELOAD_METRICS},
+  {&cfg_trace,                  CFG_OFF(trace),                  "TRACE",            RELOAD_RESTART},
+  {&cfg_log_level,              CFG_OFF(log_level),              "LOGLEVEL",         RELOAD_NOW},
+  {&cfg_log_rate,               CFG_OFF(log_rate),               "LOGRATE",          RELOAD_NOW},
+  {&cfg_route_idle,             CFG_OFF(route_idle),             "ROUTEIDLE",        RELOAD_NOW},
+  {(int *) &cfg_inject_seed,    CFG_OFF(inject_seed),            "INJECTSEED",       RELOAD_NOW}};
+#define NCFG_INTS (sizeof(cfg_ints) / sizeof(struct cfg_int))
+
+//CONFIG: int setting i of cfg_ints[], in c
+static int * config_int(struct config * c, const int i){
+  return (int *) ((char *) c + cfg_ints[i].off);
+}
+
+//CONFIG: copy the settings we run with to c
+static void config_get(struct config * c){
+  int i;
+
+  for(i=0; i < NCFG_INTS; i++){
+    *config_int(c, i) = *cfg_ints[i].val;
+  }
+  memcpy(c->inject, cfg_inject, sizeof(cfg_inject));
+  c->ninject = cfg_ninject;
+  memcpy(c->board_file, cfg_board_file, sizeof(cfg_board_file));
+  c->nboards = cfg_nboards;
+  c->group = cfg_group;
+  memcpy(c->route, cfg_route, sizeof(cfg_route));
+  c->nroutes = cfg_nroutes;
+  c->sock[0] = cfg_sock[0];
+  c->sock[1] = cfg_sock[1];
+  c->trace_file = cfg_trace_file;
+  c->peer = cfg_peer;
+  c->npeers = cfg_npeers;
+}
+
+//CONFIG: run with all settings of c. Only before our threads start,
+//config_reload applies what changed itself
+static void config_set(struct config * c){
+  int i;
+
+  for(i=0; i < NCFG_INTS; i++){
+    *cfg_ints[i].val = *config_int(c, i);
+  }
+  memcpy(cfg_inject, c->inject, sizeof(cfg_inject));
+  cfg_ninject = c->ninject;
+  memcpy(cfg_board_file, c->board_file, sizeof(cfg_board_file));
+  cfg_nboards = c->nboards;
+  cfg_group = c->group;
+  memcpy(cfg_route, c->route, sizeof(cfg_route));
+  cfg_nroutes = c->nroutes;
+  cfg_sock[0] = c->sock[0];
+  cfg_sock[1] = c->sock[1];
+  cfg_trace_file = c->trace_file;
+  cfg_peer = c->peer;
+  cfg_npeers = c->npeers;
+}
+
+//CONFIG: fill peers p[] from host:port, or /path, args
+static int peers_parse(char ** args, const int npeers, struct peer * p){
+  int i = 0;
+
+  for(i=0; i < npeers; i++){
+    if(args[i][0] == '/'){  //peer on this host, at a Unix socket
+      struct sockaddr_un * su = &p[i].unaddr;
+      if(strlen(args[i]) >= sizeof(su->sun_path)){
+        return -1;
+      }
+      su->sun_family = AF_UNIX;
+      strcpy(su->sun_path, args[i]);
+      continue;
+    }
+
+    char * save_ptr;
+    const char * hname = strtok_r(args[i], ":", &save_ptr);
+    const char * pport = strtok_r(NULL,    ":", &save_ptr);
+
+    const int port = stoi(pport);
+    if((port < 0) || (port > 65535)){
+      return -1;
+    }
+
+    if(peer_resolve(hname, port, &p[i].inaddr) == -1){
+      return -1;
+    }
+  }
+
+  return i;
+}
+
+//CONFIG: initialize the peers of c
+static int config_peers(char ** args, const int npeers, struct config * c){
+  c->npeers = npeers;
+  c->peer = (struct peer*) calloc(c->npeers, sizeof(struct peer));
+  if(c->peer == NULL){
+    perror("calloc");
+    return -1;
+  }
+
+  return peers_parse(args, npeers, c->peer);
+}
+
+//CONFIG: peers[] of a reload, that we had before, keep their stats.
+//Called with board write locked. Returns how many we kept
+static int config_peers_carry(struct peer * peers, const int npeers,
+                              const struct peer * old, const int nold){
+  int i, j, kept = 0;
+
+  for(i=0; i < npeers; i++){
+    for(j=0; j < nold; j++){
+      if( (memcmp(&peers[i].inaddr, &old[j].inaddr, sizeof(struct sockaddr_in)) == 0) &&
+          (memcmp(&peers[i].unaddr, &old[j].unaddr, sizeof(struct sockaddr_un)) == 0) ){
+        memcpy(peers[i].phases, old[j].phases, sizeof(old[j].phases));
+        kept++;
+        break;
+      }
+    }
+  }
+  return kept;
+}
+
+//CONFIG: free list[] of a setting a file sets again
+static void config_list_clear(char ** list, int * n){
+  int i;
+
+  for(i=0; i < *n; i++){
+    free(list[i]);
+    list[i] = NULL;
+  }
+  *n = 0;
+}
+
+//CONFIG: read file config into c. What it doesn't set stays as it is in c.
+//BBFILE and ROUTE lists are the ones of the last file that has them
+static int config_file(const char * config, struct config * c){
+  char line[1024];
+  char * args[11];  //stoa ends them with NULL
+  int files = 0, routes = 0;  //seen in this file
+
+  int fd = open(config, O_RDONLY);
+  if(fd == -1){
+    perror("open");
+    return -1;
+  }
+
+  int rv = 0;
+  while((readln(fd, line, sizeof(line)) > 0) && (rv == 0)){
+
+    char * opt = strtok(line, "=");
+    char * optarg = strtok(NULL, "=");
+
+    if((opt == NULL) || (optarg == NULL)){
+      continue;
+    }
+
+    if(strcmp(opt, "THMAX") == 0){
+      c->max_threads = stoi(optarg);
+      if((c->max_threads <= 0) || (c->max_threads > MAX_WORKERS)){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "THMIN") == 0){
+      c->min_threads = stoi(optarg);
+      if(c->min_threads <= 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "QUEUEWAIT") == 0){
+      c->queue_wait = stoi(optarg);
+      if(c->queue_wait <= 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "THIDLE") == 0){
+      c->idle_time = stoi(optarg);
+      if(c->idle_time <= 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "ACCEPTORS") == 0){
+      c->acceptors = stoi(optarg);
+      if(c->acceptors < 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "IO") == 0){
+      if(strcasecmp(optarg, "uring") == 0){
+        c->io = IO_URING;
+      }else if(strcasecmp(optarg, "classic") == 0){
+        c->io = IO_CLASSIC;
+      }else{
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "BACKLOG") == 0){
+      c->backlog = stoi(optarg);
+      if((c->backlog <= 0) || (c->backlog > MAX_RBB_LEN)){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "QUEUEDEADLINE") == 0){
+      c->queue_deadline = stoi(optarg);
+      if(c->queue_deadline < 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "READTIMEOUT") == 0){
+      c->read_timeout = stoi(optarg);
+      if(c->read_timeout < 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "WRITETIMEOUT") == 0){
+      c->write_timeout = stoi(optarg);
+      if(c->write_timeout < 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "SYNCREADTIMEOUT") == 0){
+      c->sync_read_timeout = stoi(optarg);
+      if(c->sync_read_timeout <= 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "SYNCWRITETIMEOUT") == 0){
+      c->sync_write_timeout = stoi(optarg);
+      if(c->sync_write_timeout <= 0){
+        rv = -1;
+        break;
+      }
+
+    }else if((strcmp(opt, "USERRATE") == 0) || (strcmp(opt, "IPRATE") == 0)){
+      int * rate = (opt[0] == 'U') ? c->user_rate : c->ip_rate;
+      if( (sscanf(optarg, "%d:%d", &rate[RATE_READ], &rate[RATE_WRITE]) != 2) ||
+          (rate[RATE_READ] < 0) || (rate[RATE_WRITE] < 0) ){
+        rv = -1;
+        break;
+      }
+
+    }else if((strcmp(opt, "BBSOCK") == 0) || (strcmp(opt, "SYNCSOCK") == 0)){
+      const int i = (opt[0] == 'S') ? 1 : 0;
+      free(c->sock[i]);
+      c->sock[i] = strdup(optarg);
+      if(c->sock[i] == NULL){
+        perror("strdup");
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "BBPORT") == 0){
+      c->port[0] = stoi(optarg);
+      if((c->port[0] <=0) || (c->port[0] > 65535)){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "SYNCPORT") == 0){
+      c->port[1] = stoi(optarg);
+      if((c->port[1] <= 0) || (c->port[1] > 65535)){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "BBFILE") == 0){
+      if(files++ == 0){ //boards of an earlier file are replaced, not added to
+        config_list_clear(c->board_file, &c->nboards);
+      }
+      if(c->nboards == MAX_BOARDS){  //each BBFILE is one more board
+        rv = -1;
+        break;
+      }
+
+      c->board_file[c->nboards] = strdup(optarg);
+      if(c->board_file[c->nboards] == NULL){
+        perror("strdup");
+        rv = -1;
+        break;
+      }
+      c->nboards++;
+
+    }else if(strcmp(opt, "GROUP") == 0){
+      free(c->group);
+      c->group = strdup(optarg);
+      if(c->group == NULL){
+        perror("strdup");
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "ROUTE") == 0){
+      if(routes++ == 0){
+        config_list_clear(c->route, &c->nroutes);
+      }
+      if(c->nroutes == (MAX_GROUPS - 1)){  //each ROUTE is one more group
+        rv = -1;
+        break;
+      }
+
+      c->route[c->nroutes] = strdup(optarg);
+      if(c->route[c->nroutes] == NULL){
+        perror("strdup");
+        rv = -1;
+        break;
+      }
+      c->nroutes++;
+
+    }else if(strcmp(opt, "ROUTEIDLE") == 0){
+      c->route_idle = stoi(optarg);
+      if((c->route_idle < 0) || (c->route_idle > MAX_ROUTE_IDLE)){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "PEERS") == 0){
+      c->npeers = stoa(optarg, args, 10);
+      if(c->npeers > 0){
+        if(config_peers(args, c->npeers, c) < 0){
+          rv = -1;
+          break;
+        }
+      }
+
+    }else if(strcmp(opt, "CACHEMEM") == 0){
+      c->cache_mem = stoi(optarg);
+      if(c->cache_mem < 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "METRICSPORT") == 0){
+      c->metrics_port = stoi(optarg);
+      if((c->metrics_port < 0) || (c->metrics_port > 65535)){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "TRACE") == 0){
+      c->trace = stob(optarg);
+      if(c->trace == -1){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "TRACEFILE") == 0){
+      if(c->trace_file){
+        free(c->trace_file);
+      }
+
+      c->trace_file = strdup(optarg);
+      if(c->trace_file == NULL){
+        perror("strdup");
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "INJECT") == 0){
+      if(inject_config(optarg, c) < 0){
+        fprintf(stderr, "Error: Invalid INJECT '%s', use site:delay[us|ms][:fail%%]\n", optarg);
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "INJECTSEED") == 0){
+      c->inject_seed = stoi(optarg);
+
+    }else if(strcmp(opt, "DAEMON") == 0){
+      c->daemon = stob(optarg);
+      if(c->daemon == -1){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "DEBUG") == 0){
+      c->debug = stob(optarg);
+      if(c->debug == -1){
+        rv = -1;
+        break;
+      }
+      if(c->debug){
+        c->log_level = LOG_DEBUG;
+      }
+
+    }else if(strcmp(opt, "LOGLEVEL") == 0){
+      const char * levels[] = {"error", "warn", "info", "debug"};
+      for(c->log_level = LOG_DEBUG; c->log_level >= 0; c->log_level--){
+        if(strcasecmp(optarg, levels[c->log_level]) == 0){
+          break;
+        }
+      }
+      if(c->log_level < 0){
+        rv = -1;
+        break;
+      }
+
+    }else if(strcmp(opt, "LOGRATE") == 0){
+      c->log_rate = stoi(optarg);
+      if(c->log_rate < 0){
+        rv = -1;
+        break;
+      }
+
+    }else{
+      fprintf(stderr, "Error: Invalid keyword '%s' in config %s\n", opt, config);
+      rv = -1;
+      break;
+    }
+  }
+  close(fd);
+  return rv;
+}
+
+//CONFIG: setup config, using a file
+static int config_load(const char * config){
+  struct config c;
+
+  config_get(&c);
+  const int rv = config_file(config, &c);
+  config_set(&c); //on errors we exit, and c has what it allocated
+  return rv;
+}
+
+//CONFIG: setup config, from argv[]
+static int MAIN_ONLY config_argv(const int argc, char * argv[]){
+  int opt;
+
+  while((opt = getopt(argc, argv, "b:c:dfp:s:T:")) > 0){
+
+    switch(opt){
+      case 'b': //file of first board
+        if(cfg_nboards == 0){
+          cfg_nboards = 1;
+        }
+        free(cfg_board_file[0]);
+
+        cfg_board_file[0] = strdup(optarg);
+        if(cfg_board_file[0] == NULL){
+          perror("strdup");
+          return -1;
+        }
+        break;
+
+      case 'c':
+        if(config_load(optarg) < 0)
+          return -1;
+        break;
+
+      case 'd':
+        cfg_debug = 1;
+        cfg_log_level = LOG_DEBUG;
+        break;
+
+      case 'f':
+        cfg_daemon = 0;
+        break;
+
+      case 'p':
+        cfg_port[0] = stoi(optarg);
+        if((cfg_port[0] <=0) || (cfg_port[0] > 65535)){
+          return -1;
+        }
+        break;
+
+      case 's':
+        cfg_port[1] = stoi(optarg);
+        if((cfg_port[1] <=0) || (cfg_port[1] > 65535)){
+          return -1;
+        }
+        break;
+
+      case 'T':
+        cfg_max_threads = stoi(optarg);
+        if((cfg_max_threads <= 0) || (cfg_max_threads > MAX_WORKERS)){
+          return -1;
+        }
+        break;
+
+      default:
+        fprintf(stderr, "Error: Invalid option '%c'\n", opt);
+        return -1;
+        break;
+    }
+  }
+
+  const int nargs = argc - optind;
+  if(nargs > 0){
+    struct config c;
+    config_get(&c);
+    const int rv = config_peers(&argv[optind], nargs, &c);
+    config_set(&c);
+    if(rv < 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+//POOL: turn away a connection we have no room or time for
+static void conn_busy(const int fd){
+  send(fd, "2.2 ERROR BUSY\n", 15, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+}
+
+//POOL: THMIN, THMAX if it is not set
+static int thr_min(){
+  return ((cfg_min_threads <= 0) || (cfg_min_threads > cfg_max_threads)) ? cfg_max_threads : cfg_min_threads;
+}
+
+//POOL: worker slots. With peers, each shard has one on top of its share
+//of THMAX, for the sync port
+static int thr_slots(){
+  return cfg_max_threads + ((cfg_npeers > 0) ? nshards : 0);
+}
+
+//POOL: can a worker of shard sh take the fd at head of q. With peers,
+//clients leave a running worker of a shard to the sync port, so
+//replication never waits behind client sessions, or for the pool to grow
+static int bb_admit(struct shard * sh, const struct bounded_buf * q){
+  const int clients = __atomic_load_n(&sh->rbb.clients, __ATOMIC_RELAXED);
+  return q->prio[q->out] || (cfg_npeers == 0) ||
+         ((clients < (sh->nslots - 1)) && (clients < (__atomic_load_n(&sh->rbb.nthreads, __ATOMIC_RELAXED) - 1)));
+}
+
+//POOL: take fd at head of q, for ctx. Called with q locked
+static int bb_take(struct context * ctx, struct bounded_buf * q){
+  const int fd = q->fds[q->out];
+
+  ctx->prio = q->prio[q->out];
+  ctx->queued = now_ns() - q->when[q->out];
+  stat_hist_add(&q->wait, ctx->queued);
+  q->out = (q->out + 1) % MAX_RBB_LEN;
+  q->count--;
+  pthread_cond_signal(&q->empty);
+
+  if(!ctx->prio){
+    __atomic_fetch_add(&shards[ctx->shard].rbb.clients, 1, __ATOMIC_RELAXED);
+  }
+  return fd;
+}
+
+//SHARD: take a request queued on another shard, whose workers are busy.
+//Only trylock, a busy queue is not worth waiting for
+static int bb_steal(struct context * ctx){
+  struct shard * own = &shards[ctx->shard];
+  int i;
+
+  for(i=1; i < nshards; i++){
+    struct bounded_buf * q = &shards[(ctx->shard + i) % nshards].rbb;
+    if(pthread_mutex_trylock(&q->mutex) != 0){
+      continue;
+    }
+
+    //-1 tells a worker of that shard to exit, leave it to them
+    if((q->count > 0) && (q->fds[q->out] > 0) && !q->stop && bb_admit(own, q)){
+      const int fd = bb_take(ctx, q);
+      pthread_mutex_unlock(&q->mutex);
+
+      __atomic_fetch_add(&own->rbb.steals, 1, __ATOMIC_RELAXED);
+      return fd;
+    }
+    pthread_mutex_unlock(&q->mutex);
+  }
+  return -1;
+}
+
+//POOL: worker leaves the pool. Called with q locked, and unlocks it
+static int bb_retire(struct context * ctx, struct bounded_buf * q, const char * why){
+  q->nthreads--;
+  q->shrunk++;
+  ctx->state = THR_EXITED;
+  pthread_cond_signal(&q->grow);  //manager joins us
+  log_msg(LOG_INFO, "[POOL] worker %s, down to %d threads\n", why, q->nthreads);
+  pthread_mutex_unlock(&q->mutex);
+  return -1;
+}
+
+//POOL: pop one request from bounded buffer of our shard, or steal one.
+//Returns -1 when worker should exit, on shutdown, after idling for
+//THIDLE with more than THMIN workers, or when a reload took its slot
+static int bb_pop(struct context * ctx){
+  struct shard * sh = &shards[ctx->shard];
+  struct bounded_buf * q = &sh->rbb;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&q->mutex);
+  while((q->count <= 0) || !bb_admit(sh, q) || ((ctx->slot >= thr_slots()) && !q->stop)){
+    if((ctx->slot >= thr_slots()) && !q->stop){
+      return bb_retire(ctx, q, "over THMAX");
+    }
+    pthread_mutex_unlock(&q->mutex);
+    const int fd = bb_steal(ctx);
+    if(fd > 0){
+      return fd;
+    }
+    pthread_mutex_lock(&q->mutex);
+    if((q->count > 0) && bb_admit(sh, q)){
+      break;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += cfg_idle_time;
+
+    q->idle++;
+    const int rc = pthread_cond_timedwait(&q->full, &q->mutex, &deadline);
+    q->idle--;
+
+    if( (rc == ETIMEDOUT) && (q->count <= 0) && !q->stop &&
+        (q->nthreads > sh->min) ){
+      return bb_retire(ctx, q, "idle");
+    }
+  }
+
+  const int fd = bb_take(ctx, q);
+  pthread_mutex_unlock(&q->mutex);
+
+  return fd;
+}
+
+//POOL: queue fd for a worker of shard sh. prio fds (sync port, and exit
+//markers) go to the head, and may use the queue past BACKLOG. A client
+//fd that finds BACKLOG queued is shed, with a BUSY reply
+static int bb_push(struct shard * sh, const int fd, const int prio){
+  struct bounded_buf * q = &sh->rbb;
+  int i, slot;
+
+  pthread_mutex_lock(&q->mutex);
+  if(!prio && (q->count >= cfg_backlog)){
+    q->shed++;
+    pthread_mutex_unlock(&q->mutex);
+    log_msg(LOG_INFO, "[POOL] %d connections queued, shed sock %d\n", cfg_backlog, fd);
+    conn_busy(fd);
+    return 0;
+  }
+
+  while(q->count >= MAX_RBB_LEN){  //while bb is full
+    pthread_cond_wait(&q->empty, &q->mutex);
+  }
+
+  if(prio){
+    q->out = (q->out + MAX_RBB_LEN - 1) % MAX_RBB_LEN;
+    slot = q->out;
+  }else{
+    slot = q->in;
+    q->in = (q->in + 1) % MAX_RBB_LEN;
+  }
+  q->fds[slot] = fd;
+  q->when[slot] = now_ns();
+  q->prio[slot] = prio;
+  q->count++;
+
+  pthread_cond_signal(&q->full);
+  const int idle = q->idle;
+  if((idle == 0) && (q->nthreads < sh->nslots)){
+    pthread_cond_signal(&q->grow); //nobody to take it now
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  //our workers are all busy, wake an idle one on another shard to steal it
+  for(i=1; (idle == 0) && (fd > 0) && (i < nshards); i++){
+    struct bounded_buf * o = &shards[(sh - shards + i) % nshards].rbb;
+    if(__atomic_load_n(&o->idle, __ATOMIC_RELAXED) > 0){
+      pthread_mutex_lock(&o->mutex);
+      pthread_cond_signal(&o->full);
+      pthread_mutex_unlock(&o->mutex);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static int cmd_user(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  //validate username argument
+  if( (strchr(cmd->arg[1], '/') != NULL) || (strcmp(cmd->arg[1], nousername) == 0)){
+    replyf(ctx->fd, "2.2 ERROR USER Invalid username\n");
+
+  }else if(strcmp(ctx->rec.usr, nousername) != 0){
+    replyf(ctx->fd, "2.2 ERROR USER Already registered\n");
+  }else{
+    strncpy(ctx->rec.usr, cmd->arg[1], MAX_USR_LEN);
+    replyf(ctx->fd, "1.0 Hello %s, Welcome to Bulletin Board\n", ctx->rec.usr);
+  }
+
+  return 0; //sucess
+}
+
+//switch session to the board named, or tell which one we are on
+static int cmd_board(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs == 1){
+    replyf(ctx->fd, "1.0 BOARD %s\n", ctx->board->name);
+    return 0;
+  }else if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  struct bulletin_board * b = board_find(cmd->arg[1]);
+  if(b == NULL){
+    replyf(ctx->fd, "2.2 ERROR BOARD No such board\n");
+  }else if(ctx->batch){ //a batch commits to one board
+    replyf(ctx->fd, "2.2 ERROR BOARD Batch is open\n");
+  }else{
+    ctx->board = b;
+    replyf(ctx->fd, "1.0 BOARD %s\n", b->name);
+  }
+  return 0;
+}
+
+static int cmd_read(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  const int number = stoi(cmd->arg[1]);
+  if(number < 0){
+    return -1;
+  }
+
+  switch(bulletin_send(ctx->board, ctx->fd, number)){
+    case 0:
+      replyf(ctx->fd, "2.1 UNKNOWN %s No such message\n", cmd->arg[1]);
+      break;
+
+    case -1:
+      replyf(ctx->fd, "2.2 ERROR READ system error\n");
+      break;
+
+    default:  //reply was sent from the board
+      break;
+  }
+  return 0;
+}
+
+static int cmd_readrange(struct context *ctx, struct cmd * cmd){
+  char * args[5];
+  int nums[MAX_RANGE_LEN];
+
+  if((cmd->nargs != 2) || (stoa(cmd->arg[1], args, 4) != 2)){
+    return -1;  //invalid count of arguments
+  }
+
+  const int from  = stoi(args[0]);
+  const int count = stoi(args[1]);
+  if( (from < 0) || (count <= 0) || (count > MAX_RANGE_LEN) ||
+      (from > (INT_MAX - count)) ){
+    return -1;
+  }
+
+  int i;
+  for(i=0; i < count; i++){
+    nums[i] = from + i;
+  }
+
+  if(bulletin_send_many(ctx->board, ctx->fd, nums, count, 0) < 0){
+    replyf(ctx->fd, "2.2 ERROR READ system error\n");
+  }
+  return 0;
+}
+
+static int cmd_mread(struct context *ctx, struct cmd * cmd){
+  int nums[MAX_RANGE_LEN];
+  char * save_ptr;
+
+  if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  int n = 0;
+  char * arg = strtok_r(cmd->arg[1], ",", &save_ptr);
+  while(arg){
+    if(n == MAX_RANGE_LEN){
+      return -1;
+    }
+
+    nums[n] = stoi(arg);
+    if(nums[n++] < 0){
+      return -1;
+    }
+    arg = strtok_r(NULL, ",", &save_ptr);
+  }
+
+  if(n == 0){
+    return -1;
+  }
+
+  if(bulletin_send_many(ctx->board, ctx->fd, nums, n, 1) < 0){
+    replyf(ctx->fd, "2.2 ERROR READ system error\n");
+  }
+  return 0;
+}
+
+static int cmd_search(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  if(bulletin_send_search(ctx->board, ctx->fd, cmd->arg[1]) < 0){
+    replyf(ctx->fd, "2.2 ERROR READ system error\n");
+  }
+  return 0;
+}
+
+static int cmd_listuser(struct context *ctx, struct cmd * cmd){
+  char * args[5];
+
+  if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  int from = 0, count = MAX_RANGE_LEN;
+  switch(stoa(cmd->arg[1], args, 4)){
+    case 3:
+      from  = stoi(args[1]);
+      count = stoi(args[2]);
+      break;
+    case 1:
+      break;
+    default:
+      return -1;
+  }
+
+  if((from < 0) || (count <= 0) || (count > MAX_RANGE_LEN)){
+    return -1;
+  }
+
+  if(bulletin_send_user(ctx->board, ctx->fd, args[0], from, count) < 0){
+    replyf(ctx->fd, "2.2 ERROR READ system error\n");
+  }
+  return 0;
+}
+
+//returns 1 if connection was parked, 0 if not
+static int cmd_watch(struct context *ctx, struct cmd * cmd){
+  int from = 0;
+
+  if(cmd->nargs == 2){
+    from = stoi(cmd->arg[1]);
+    if(from <= 0){
+      return -1;
+    }
+  }else if(cmd->nargs != 1){
+    return -1;  //invalid count of arguments
+  }
+
+  //the hub only listens for a hang up, so requests sent after WATCH
+  //would be lost
+  if(ctx->in_pos < ctx->in_len){
+    replyf(ctx->fd, "2.2 ERROR WATCH must be the last request sent\n");
+    return 0;
+  }
+
+  if(bulletin_watch(ctx->board, ctx->fd, from) < 0){
+    replyf(ctx->fd, "2.2 ERROR READ system error\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int cmd_write(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 2){
+    return -1;  //invalid count of arguments
+  }
+
+  //the board would cut it, refuse it instead, queued or not
+  if(strlen(cmd->arg[1]) > MAX_MSG_LEN){
+    replyf(ctx->fd, "3.2 ERROR WRITE message is over %d chars\n", MAX_MSG_LEN);
+    return 0;
+  }
+
+  if(ctx->batch){ //queue it, until COMMIT
+    if(ctx->batch_len == MAX_BATCH_LEN){
+      replyf(ctx->fd, "3.2 ERROR WRITE batch is full\n");
+      return 0;
+    }
+
+    ctx->batch[ctx->batch_len] = strdup(cmd->arg[1]);
+    if(ctx->batch[ctx->batch_len] == NULL){
+      perror("strdup");
+      replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+      return 0;
+    }
+    replyf(ctx->fd, "3.0 QUEUED %i\n", ++ctx->batch_len);
+    return 0;
+  }
+
+  const int number = bulletin_commit(ctx->board, -1, ctx->rec.usr, &cmd->arg[1], 1);
+  switch(number){
+    case -1:
+      replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+      break;
+
+    default:
+      replyf(ctx->fd, "3.0 WROTE %i\n", number);
+      break;
+  }
+  return 0;
+}
+
+//drop messages queued after BEGIN
+static void batch_free(struct context *ctx){
+  int i;
+
+  if(ctx->batch == NULL){
+    return;
+  }
+
+  for(i=0; i < ctx->batch_len; i++){
+    free(ctx->batch[i]);
+  }
+  free(ctx->batch);
+  ctx->batch = NULL;
+  ctx->batch_len = 0;
+}
+
+static int cmd_begin(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 1){
+    return -1;  //invalid count of arguments
+  }
+
+  if(ctx->batch){
+    replyf(ctx->fd, "3.2 ERROR WRITE batch already started\n");
+    return 0;
+  }
+
+  ctx->batch = (char**) calloc(MAX_BATCH_LEN, sizeof(char*));
+  if(ctx->batch == NULL){
+    perror("calloc");
+    replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+    return 0;
+  }
+  ctx->batch_len = 0;
+
+  replyf(ctx->fd, "3.0 BEGIN\n");
+  return 0;
+}
+
+static int cmd_commit(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 1){
+    return -1;  //invalid count of arguments
+  }
+
+  if((ctx->batch == NULL) || (ctx->batch_len == 0)){
+    replyf(ctx->fd, "3.2 ERROR WRITE no batch to commit\n");
+    batch_free(ctx);
+    return 0;
+  }
+
+  const int number = bulletin_commit(ctx->board, -1, ctx->rec.usr, ctx->batch, ctx->batch_len);
+  switch(number){
+    case -1:
+      replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+      break;
+
+    default:  //batch is written in consecutive records
+      replyf(ctx->fd, "3.0 WROTE %i-%i\n", number, number + ctx->batch_len - 1);
+      break;
+  }
+
+  batch_free(ctx);
+  return 0;
+}
+
+static int cmd_abort(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 1){
+    return -1;  //invalid count of arguments
+  }
+
+  if(ctx->batch == NULL){
+    replyf(ctx->fd, "3.2 ERROR WRITE no batch to abort\n");
+  }else{
+    replyf(ctx->fd, "3.0 ABORTED %i\n", ctx->batch_len);
+    batch_free(ctx);
+  }
+  return 0;
+}
+
+static int cmd_replace(struct context *ctx, struct cmd * cmd){
+  if(cmd->nargs != 3){
+    return -1;  //invalid count of arguments
+  }
+
+  const int number = stoi(cmd->arg[1]);
+  if(number < 0){
+    return -1;
+  }
+
+  if(strlen(cmd->arg[2]) > MAX_MSG_LEN){
+    replyf(ctx->fd, "3.2 ERROR WRITE message is over %d chars\n", MAX_MSG_LEN);
+    return 0;
+  }
+
+  switch(bulletin_commit(ctx->board, number, ctx->rec.usr, &cmd->arg[2], 1)){
+    case -1:
+      replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+      break;
+
+    case 0:
+      replyf(ctx->fd, "3.1 UNKNOWN %s\n", cmd->arg[1]);
+      break;
+
+    default:
+      replyf(ctx->fd, "3.0 WROTE %i\n", number);
+      break;
+  }
+  return 0;
+}
+
+static const char * stat_cmd_names[NSTAT_CMDS] = {"user", "read", "readrange",
+  "mread", "search", "listuser", "write", "replace", "begin", "commit", "abort",
+  "stats", "watch", "sync_on", "sync_off", "sync_abort", "sync_write",
+  "sync_replace", "trace", "board", "route", "invalid"};
+
+static const char * stat_phase_names[NPHASES] = {"connect", "prepare", "write", "finish"};
+
+//STAT: sum stats of all threads
+static void stats_collect(struct thread_stats * sum){
+  int i, j;
+
+  memset(sum, 0, sizeof(struct thread_stats));
+  for(i=-1; i < MAX_SLOTS; i++){
+    struct context * ctx = (i < 0) ? NULL : __atomic_load_n(&tctx[i], __ATOMIC_ACQUIRE);
+    if((i >= 0) && (ctx == NULL)){
+      continue;
+    }
+    struct thread_stats * ts = (i < 0) ? &other_stats : &ctx->stats;
+
+    for(j=0; j < NSTAT_CMDS; j++){
+      stat_hist_merge(&sum->cmds[j], &ts->cmds[j]);
+      sum->errors[j] += __atomic_load_n(&ts->errors[j], __ATOMIC_RELAXED);
+    }
+    stat_hist_merge(&sum->rdlock, &ts->rdlock);
+    stat_hist_merge(&sum->wrlock, &ts->wrlock);
+  }
+}
+
+//STAT: sum of queue and pool counters of all shards
+static void stats_pool(struct bounded_buf * pool){
+  int i;
+
+  memset(pool, 0, sizeof(struct bounded_buf));
+  for(i=0; i < nshards; i++){
+    struct bounded_buf * q = &shards[i].rbb;
+
+    pthread_mutex_lock(&q->mutex);
+    pool->count    += q->count;
+    pool->nthreads += q->nthreads;
+    pool->idle     += q->idle;
+    pool->grown    += q->grown;
+    pool->shrunk   += q->shrunk;
+    pool->steals   += q->steals;
+    pool->clients  += q->clients;
+    pool->shed     += q->shed;
+    pool->late     += q->late;
+    stat_hist_merge(&pool->wait, &q->wait);
+    pthread_mutex_unlock(&q->mutex);
+  }
+}
+
+//STAT: sum of reply cache counters of all boards
+static void stats_cache(struct reply_cache * cache){
+  int i;
+
+  memset(cache, 0, sizeof(struct reply_cache));
+  for(i=0; i < nboards; i++){
+    struct reply_cache * c = &boards[i].cache;
+    if(boards[i].group != 0){ //has none
+      continue;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    cache->hits          += c->hits;
+    cache->misses        += c->misses;
+    cache->evictions     += c->evictions;
+    cache->invalidations += c->invalidations;
+    cache->used          += c->used;
+    cache->size          += c->size;
+    pthread_mutex_unlock(&c->mutex);
+  }
+}
+
+//STAT: histogram as STATS lines, in us
+static void stats_text_hist(FILE * f, const char * name, const struct stat_hist * h){
+  fprintf(f, "5.0 STAT %s_count %lu\n", name, h->count);
+  fprintf(f, "5.0 STAT %s_mean_us %.1f\n", name, h->count ? h->sum_ns / 1000.0 / h->count : 0.0);
+  fprintf(f, "5.0 STAT %s_p50_us %.1f\n", name, stat_hist_quantile(h, 0.50) / 1000.0);
+  fprintf(f, "5.0 STAT %s_p99_us %.1f\n", name, stat_hist_quantile(h, 0.99) / 1000.0);
+  fprintf(f, "5.0 STAT %s_max_us %.1f\n", name, h->max_ns / 1000.0);
+}
+
+//STAT: print everything as STATS reply
+static void stats_text(FILE * f){
+  struct thread_stats sum;
+  struct bounded_buf pool;
+  struct reply_cache cache;
+  char name[64];
+  int i, j, len = 0, size = 0;
+
+  stats_collect(&sum);
+  stats_pool(&pool);
+  stats_cache(&cache);
+
+  fprintf(f, "5.0 STAT sessions %d\n", __atomic_load_n(&stat_sessions, __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT throttled_reads %lu\n", __atomic_load_n(&stat_throttled[RATE_READ], __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT throttled_writes %lu\n", __atomic_load_n(&stat_throttled[RATE_WRITE], __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT reloads %lu\n", __atomic_load_n(&stat_reloads[0], __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT reload_errors %lu\n", __atomic_load_n(&stat_reloads[1], __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT routed %lu\n", __atomic_load_n(&stat_routed[0], __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT route_errors %lu\n", __atomic_load_n(&stat_routed[1], __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT route_connects %lu\n", __atomic_load_n(&stat_route_connects, __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT watchers %d\n", __atomic_load_n(&whub.nwatchers, __ATOMIC_RELAXED) -
+    __atomic_load_n(&whub.nparked, __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT route_parked %d\n", __atomic_load_n(&whub.nparked, __ATOMIC_RELAXED));
+  fprintf(f, "5.0 STAT queue_depth %d\n", pool.count);
+  fprintf(f, "5.0 STAT pool_threads %d\n", pool.nthreads);
+  fprintf(f, "5.0 STAT pool_idle %d\n", pool.idle);
+  fprintf(f, "5.0 STAT pool_min %d\n", thr_min());
+  fprintf(f, "5.0 STAT pool_max %d\n", cfg_max_threads);
+  fprintf(f, "5.0 STAT pool_grown %lu\n", pool.grown);
+  fprintf(f, "5.0 STAT pool_shrunk %lu\n", pool.shrunk);
+  fprintf(f, "5.0 STAT pool_shards %d\n", nshards);
+  fprintf(f, "5.0 STAT pool_steals %lu\n", pool.steals);
+  fprintf(f, "5.0 STAT pool_clients %d\n", pool.clients);
+  fprintf(f, "5.0 STAT queue_shed %lu\n", pool.shed);
+  fprintf(f, "5.0 STAT queue_late %lu\n", pool.late);
+  stats_text_hist(f, "queue_wait", &pool.wait);
+  fprintf(f, "5.0 STAT boards %d\n", nboards);
+  fprintf(f, "5.0 STAT groups %d\n", ngroups);
+  for(i=0; i < nboards; i++){
+    const int blen = __atomic_load_n(&boards[i].board_len, __ATOMIC_RELAXED);
+    const int bsize = __atomic_load_n(&boards[i].board_size, __ATOMIC_RELAXED);
+    fprintf(f, "5.0 STAT board_%s_len %d\n", boards[i].name, blen);
+    fprintf(f, "5.0 STAT board_%s_size %d\n", boards[i].name, bsize);
+    len += blen;
+    size += bsize;
+  }
+  fprintf(f, "5.0 STAT board_len %d\n", len);
+  fprintf(f, "5.0 STAT board_size %d\n", size);
+
+  for(i=0; i < NSTAT_CMDS; i++){
+    if(sum.cmds[i].count > 0){
+      snprintf(name, sizeof(name), "cmd_%s", stat_cmd_names[i]);
+      stats_text_hist(f, name, &sum.cmds[i]);
+      fprintf(f, "5.0 STAT cmd_%s_errors %lu\n", stat_cmd_names[i], sum.errors[i]);
+    }
+  }
+
+  for(i=0; i < NINJECT; i++){
+    if(cfg_inject[i].delay || cfg_inject[i].fail){
+      fprintf(f, "5.0 STAT inject_%s_hits %lu\n", inject_names[i],
+        __atomic_load_n(&cfg_inject[i].hits, __ATOMIC_RELAXED));
+      fprintf(f, "5.0 STAT inject_%s_fails %lu\n", inject_names[i],
+        __atomic_load_n(&cfg_inject[i].fails, __ATOMIC_RELAXED));
+    }
+  }
+
+  stats_text_hist(f, "rdlock_wait", &sum.rdlock);
+  stats_text_hist(f, "wrlock_wait", &sum.wrlock);
+
+  pthread_mutex_lock(&peers_mutex);
+  for(i=0; i < cfg_npeers; i++){
+    for(j=0; j < NPHASES; j++){
+      snprintf(name, sizeof(name), "peer%d_%s", i, stat_phase_names[j]);
+      stats_text_hist(f, name, &cfg_peer[i].phases[j]);
+    }
+  }
+  pthread_mutex_unlock(&peers_mutex);
+
+  fprintf(f, "5.0 STAT cache_hits %lu\n", cache.hits);
+  fprintf(f, "5.0 STAT cache_misses %lu\n", cache.misses);
+  fprintf(f, "5.0 STAT cache_hit_ratio %.3f\n",
+    (cache.hits + cache.misses) ? (double) cache.hits / (cache.hits + cache.misses) : 0.0);
+  fprintf(f, "5.0 STAT cache_evictions %lu\n", cache.evictions);
+  fprintf(f, "5.0 STAT cache_invalidations %lu\n", cache.invalidations);
+  fprintf(f, "5.0 STAT cache_entries %d\n", cache.used);
+  fprintf(f, "5.0 STAT cache_bytes %lu\n", cache.used*sizeof(struct cache_entry));
+  fprintf(f, "5.0 STAT cache_budget_bytes %lu\n", cache.size*sizeof(struct cache_entry));
+  fprintf(f, "5.0 END\n");
+}
+
+//STAT: histogram in Prometheus text format, in seconds
+static void stats_prom_hist(FILE * f, const char * name, const char * labels, const struct stat_hist * h){
+  unsigned long sum = 0;
+  int i;
+
+  for(i=0; i < STAT_HIST_LEN - 1; i++){
+    sum += h->counts[i];
+    fprintf(f, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, (1UL << (i + 10)) / 1e9, sum);
+  }
+  fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, h->count);
+  fprintf(f, "%s_sum{%s} %.9f\n", name, labels, h->sum_ns / 1e9);
+  fprintf(f, "%s_count{%s} %lu\n", name, labels, h->count);
+}
+
+//STAT: print everything in Prometheus text format
+static void stats_prom(FILE * f){
+  struct thread_stats sum;
+  struct bounded_buf pool;
+  struct reply_cache cache;
+  char labels[192], addr[INET_ADDRSTRLEN];
+  int i, j;
+
+  stats_collect(&sum);
+  stats_pool(&pool);
+  stats_cache(&cache);
+
+  fprintf(f, "# TYPE bbserv_sessions gauge\nbbserv_sessions %d\n",
+    __atomic_load_n(&stat_sessions, __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_throttled_total counter\n");
+  fprintf(f, "bbserv_throttled_total{class=\"read\"} %lu\n", __atomic_load_n(&stat_throttled[RATE_READ], __ATOMIC_RELAXED));
+  fprintf(f, "bbserv_throttled_total{class=\"write\"} %lu\n", __atomic_load_n(&stat_throttled[RATE_WRITE], __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_reloads_total counter\n");
+  fprintf(f, "bbserv_reloads_total{result=\"ok\"} %lu\n", __atomic_load_n(&stat_reloads[0], __ATOMIC_RELAXED));
+  fprintf(f, "bbserv_reloads_total{result=\"error\"} %lu\n", __atomic_load_n(&stat_reloads[1], __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_routed_total counter\n");
+  fprintf(f, "bbserv_routed_total{result=\"ok\"} %lu\n", __atomic_load_n(&stat_routed[0], __ATOMIC_RELAXED));
+  fprintf(f, "bbserv_routed_total{result=\"error\"} %lu\n", __atomic_load_n(&stat_routed[1], __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_route_connects_total counter\nbbserv_route_connects_total %lu\n",
+    __atomic_load_n(&stat_route_connects, __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_watchers gauge\nbbserv_watchers %d\n",
+    __atomic_load_n(&whub.nwatchers, __ATOMIC_RELAXED) - __atomic_load_n(&whub.nparked, __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_route_parked gauge\nbbserv_route_parked %d\n",
+    __atomic_load_n(&whub.nparked, __ATOMIC_RELAXED));
+  fprintf(f, "# TYPE bbserv_queue_depth gauge\nbbserv_queue_depth %d\n", pool.count);
+  fprintf(f, "# TYPE bbserv_pool_threads gauge\nbbserv_pool_threads %d\n", pool.nthreads);
+  fprintf(f, "# TYPE bbserv_pool_idle gauge\nbbserv_pool_idle %d\n", pool.idle);
+  fprintf(f, "# TYPE bbserv_pool_grown_total counter\nbbserv_pool_grown_total %lu\n", pool.grown);
+  fprintf(f, "# TYPE bbserv_pool_shrunk_total counter\nbbserv_pool_shrunk_total %lu\n", pool.shrunk);
+  fprintf(f, "# TYPE bbserv_pool_shards gauge\nbbserv_pool_shards %d\n", nshards);
+  fprintf(f, "# TYPE bbserv_pool_steals_total counter\nbbserv_pool_steals_total %lu\n", pool.steals);
+  fprintf(f, "# TYPE bbserv_pool_clients gauge\nbbserv_pool_clients %d\n", pool.clients);
+  fprintf(f, "# TYPE bbserv_queue_shed_total counter\nbbserv_queue_shed_total %lu\n", pool.shed);
+  fprintf(f, "# TYPE bbserv_queue_late_total counter\nbbserv_queue_late_total %lu\n", pool.late);
+  fprintf(f, "# TYPE bbserv_queue_wait_seconds histogram\n");
+  stats_prom_hist(f, "bbserv_queue_wait_seconds", "queue=\"rbb\"", &pool.wait);
+  fprintf(f, "# TYPE bbserv_board_len gauge\n");
+  for(i=0; i < nboards; i++){
+    fprintf(f, "bbserv_board_len{board=\"%s\"} %d\n", boards[i].name,
+      __atomic_load_n(&boards[i].board_len, __ATOMIC_RELAXED));
+  }
+  fprintf(f, "# TYPE bbserv_board_size gauge\n");
+  for(i=0; i < nboards; i++){
+    fprintf(f, "bbserv_board_size{board=\"%s\"} %d\n", boards[i].name,
+      __atomic_load_n(&boards[i].board_size, __ATOMIC_RELAXED));
+  }
+
+  fprintf(f, "# TYPE bbserv_command_seconds histogram\n");
+  for(i=0; i < NSTAT_CMDS; i++){
+    if(sum.cmds[i].count > 0){
+      snprintf(labels, sizeof(labels), "cmd=\"%s\"", stat_cmd_names[i]);
+      stats_prom_hist(f, "bbserv_command_seconds", labels, &sum.cmds[i]);
+    }
+  }
+  fprintf(f, "# TYPE bbserv_command_errors_total counter\n");
+  for(i=0; i < NSTAT_CMDS; i++){
+    if(sum.cmds[i].count > 0){
+      fprintf(f, "bbserv_command_errors_total{cmd=\"%s\"} %lu\n", stat_cmd_names[i], sum.errors[i]);
+    }
+  }
+
+  fprintf(f, "# TYPE bbserv_lock_wait_seconds histogram\n");
+  stats_prom_hist(f, "bbserv_lock_wait_seconds", "mode=\"read\"", &sum.rdlock);
+  stats_prom_hist(f, "bbserv_lock_wait_seconds", "mode=\"write\"", &sum.wrlock);
+
+  fprintf(f, "# TYPE bbserv_peer_phase_seconds histogram\n");
+  pthread_mutex_lock(&peers_mutex);
+  for(i=0; i < cfg_npeers; i++){
+    const struct peer * p = &cfg_peer[i];
+    char name[sizeof(p->unaddr.sun_path) + 8];
+    if(p->unaddr.sun_family == AF_UNIX){
+      snprintf(name, sizeof(name), "%s", p->unaddr.sun_path);
+    }else{
+      inet_ntop(AF_INET, &p->inaddr.sin_addr, addr, sizeof(addr));
+      snprintf(name, sizeof(name), "%s:%d", addr, ntohs(p->inaddr.sin_port));
+    }
+    for(j=0; j < NPHASES; j++){
+      snprintf(labels, sizeof(labels), "peer=\"%s\",phase=\"%s\"", name, stat_phase_names[j]);
+      stats_prom_hist(f, "bbserv_peer_phase_seconds", labels, &cfg_peer[i].phases[j]);
+    }
+  }
+  pthread_mutex_unlock(&peers_mutex);
+
+  fprintf(f, "# TYPE bbserv_cache_hits_total counter\nbbserv_cache_hits_total %lu\n", cache.hits);
+  fprintf(f, "# TYPE bbserv_cache_misses_total counter\nbbserv_cache_misses_total %lu\n", cache.misses);
+  fprintf(f, "# TYPE bbserv_cache_evictions_total counter\nbbserv_cache_evictions_total %lu\n", cache.evictions);
+  fprintf(f, "# TYPE bbserv_cache_invalidations_total counter\nbbserv_cache_invalidations_total %lu\n", cache.invalidations);
+  fprintf(f, "# TYPE bbserv_cache_entries gauge\nbbserv_cache_entries %d\n", cache.used);
+}
+
+//STAT: render stats with print, and send them to fd in one go
+static int stats_send(const int fd, const char * header, void (*print)(FILE *)){
+  char * buf = NULL;
+  size_t len = 0;
+
+  FILE * f = open_memstream(&buf, &len);
+  if(f == NULL){
+    perror("open_memstream");
+    return -1;
+  }
+  fputs(header, f);
+  print(f);
+  fclose(f);
+
+  const int rc = (writen(fd, buf, len) == len) ? 0 : -1;
+  free(buf);
+  return rc;
+}
+
+static int cmd_stats(struct context *ctx, struct cmd * cmd){
+  return stats_send(ctx->fd, "", stats_text);
+}
+
+static const char * trace_names[NTRACE] = {"commit", "lock_wait", "connect", "prepare",
+  "write", "local_write", "finish", "sync_on", "sync_write", "sync_replace", "sync_off",
+  "sync_abort", "sync_locked"};
+
+//TRACE: save spans of all threads to file, in Chrome trace JSON.
+//Returns number of spans saved, or -1
+static int trace_dump(const char * file){
+  int i, nspans = 0;
+
+  FILE * f = fopen(file, "w");
+  if(f == NULL){
+    perror("fopen");
+    return -1;
+  }
+
+  fprintf(f, "{\"traceEvents\":[\n");
+  for(i=0; i < MAX_SLOTS; i++){
+    const struct context * ctx = __atomic_load_n(&tctx[i], __ATOMIC_ACQUIRE);
+    struct trace_ring * r = ctx ? ctx->trace : NULL;
+    if(r == NULL){
+      continue;
+    }
+
+    const unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long j = (head > TRACE_RING_LEN) ? (head - TRACE_RING_LEN) : 0;
+    for(; j < head; j++){
+      struct span * sp = &r->spans[j & (TRACE_RING_LEN - 1)];
+
+      const unsigned int seq = __atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE);
+      const struct span copy = *sp;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if((seq & 1) || (seq != __atomic_load_n(&sp->seq, __ATOMIC_RELAXED))){
+        continue; //thread is writing over it
+      }
+
+      fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"2pc\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":\"%lx\"}}\n",
+        nspans ? "," : "", trace_names[copy.name], cfg_port[0], r->tid,
+        copy.start / 1000.0, copy.dur / 1000.0, copy.id);
+      nspans++;
+    }
+  }
+  fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  if(fclose(f) != 0){
+    perror("fclose");
+    return -1;
+  }
+  return nspans;
+}
+
+static int cmd_trace(struct context *ctx, struct cmd * cmd){
+  const char * file = cfg_trace_file ? cfg_trace_file : "bbserv.trace.json";
+
+  if(cfg_trace == 0){
+    replyf(ctx->fd, "5.2 ERROR TRACE is off\n");
+    return 0;
+  }
+
+  const int nspans = trace_dump(file);
+  if(nspans < 0){
+    return -1;
+  }
+  replyf(ctx->fd, "5.0 TRACE %d %s\n", nspans, file);
+  return 0;
+}
+
+static int cmd_sync_on(struct context *ctx, struct cmd * cmd){
+  int rv = 0;
+
+  if(ctx->sync_on == 0){
+    //coordinator sends its correlation id and board, older ones don't
+    ctx->trace_id = (cmd->nargs > 1) ? strtoul(cmd->arg[1], NULL, 16) : 0;
+    ctx->sync_board = (cmd->nargs > 2) ? board_find(cmd->arg[2]) : &boards[0];
+    if((ctx->sync_board == NULL) || (ctx->sync_board->group != 0)){
+      log_msg(LOG_WARN, "[SYNC] %lx is for board %s, we don't have it\n", ctx->trace_id,
+        (cmd->nargs > 2) ? cmd->arg[2] : boards[0].name);
+      ctx->sync_board = NULL;
+      return -1;  //NACK, coordinator aborts
+    }
+
+    if(inject(INJ_SYNC_ON) < 0){
+      return -1;  //NACK, without the lock
+    }
+
+    const long long start = now_ns();
+    rv = bulletin_sync(ctx->sync_board, 1);
+    ctx->sync_on = 1;
+    ctx->sync_start = now_ns();
+    trace_span(TR_SYNC_ON, ctx->trace_id, start);
+  }else{
+    //we can't call SYNC_ON twice
+    replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+    rv = -1;
+  }
+  return rv;
+}
+
+static int cmd_sync_off(struct context *ctx, struct cmd * cmd){
+  int rv = 0;
+
+  if(ctx->sync_on == 1){
+    const int fail = inject(INJ_SYNC_OFF);
+
+    const long long start = now_ns();
+    rv = bulletin_sync(ctx->sync_board, 0);
+    ctx->sync_on = 0;
+    if(fail < 0){
+      rv = -1; //NACK, but we are done with the lock
+    }
+    trace_span(TR_SYNC_OFF, ctx->trace_id, start);
+    trace_span(TR_SYNC_LOCKED, ctx->trace_id, ctx->sync_start);
+  }else{
+    //we can't call SYNC_OFF twice
+    replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+    rv = -1;
+  }
+  return rv;
+}
+
+//SYNC: drop what we got since SYNC_ON, and unlock the board
+static int sync_abort(struct context * ctx){
+  const long long start = now_ns();
+  bulletin_revert(ctx->sync_board);
+  const int rv = bulletin_sync(ctx->sync_board, 0);  //sync off on abort automatically
+  ctx->sync_on = 0;
+  trace_span(TR_SYNC_ABORT, ctx->trace_id, start);
+  trace_span(TR_SYNC_LOCKED, ctx->trace_id, ctx->sync_start);
+  return rv;
+}
+
+static int cmd_sync_abort(struct context *ctx, struct cmd * cmd){
+  int rv = 0;
+
+  if(ctx->sync_on == 1){
+    rv = sync_abort(ctx);
+  }else{
+    //we can't call SYNC_ON twice
+    replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+    rv = -1;
+  }
+  return rv;
 }
 
 static int cmd_sync_write(struct context *ctx, struct cmd * cmd){
   int rv = 0;
 
-  if(ctx->sync_on == 1){
-    if(cmd->nargs != 3){
-      rv = -1;  //invalid count of arguments
-    }else{
-      rv = bulletin_write(cmd->arg[1], cmd->arg[2]);
-    }
+  if(ctx->sync_on == 1){
+    if(cmd->nargs != 3){
+      rv = -1;  //invalid count of arguments
+    }else if(inject(INJ_SYNC_WRITE) < 0){
+      rv = -1;
+    }else{
+      const long long start = now_ns();
+      rv = bulletin_write(ctx->sync_board, cmd->arg[1], cmd->arg[2]);
+      trace_span(TR_SYNC_WRITE, ctx->trace_id, start);
+    }
+
+  }else{
+    //we can't call SYNC_ON twice
+    replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+    rv = -1;
+  }
+  return rv;
+}
+
+static int cmd_sync_replace(struct context *ctx, struct cmd * cmd){
+  int rv = 0;
+
+  if(ctx->sync_on == 1){
+    if(cmd->nargs != 4){
+      rv = -1;  //invalid count of arguments
+    }else if(inject(INJ_SYNC_WRITE) < 0){
+      rv = -1;
+    }else{
+      const int number = stoi(cmd->arg[1]);
+      if(number < 0){
+        rv = -1;
+      }else{
+        const long long start = now_ns();
+        rv = bulletin_replace(ctx->sync_board, number, cmd->arg[2], cmd->arg[3]);
+        trace_span(TR_SYNC_REPLACE, ctx->trace_id, start);
+      }
+    }
+
+  }else{
+    //we can't call SYNC_ON twice
+    replyf(ctx->fd, "3.2 ERROR WRITE system error\n");
+    rv = -1;
+  }
+  return rv;
+}
+
+//RATE: FNV-1a hash of key, with type in it, so users and IPs don't mix. Never 0
+static unsigned long rate_hash(const char type, const void * key, const int len){
+  const unsigned char * p = (const unsigned char *) key;
+  unsigned long h = 14695981039346656037UL;
+  int i;
+
+  h = (h ^ (unsigned char) type) * 1099511628211UL;
+  for(i=0; i < len; i++){
+    h = (h ^ p[i]) * 1099511628211UL;
+  }
+  return h ? h : 1;
+}
+
+//RATE: bucket of key in shard sh, added if it's new. We probe from the
+//slot of the hash. A bucket that is full again has no state, so it can be
+//taken for another key. NULL if shard has no room. Called with sh locked,
+//a bucket we return can't change key until it's unlocked
+static struct rate_bucket * rate_bucket(struct rate_shard * sh, const unsigned long key,
+                                        const long long now){
+  const unsigned int first = key % RATE_SLOTS;
+  struct rate_bucket * free_b = NULL;
+  unsigned int i;
+
+  for(i=0; i < RATE_SLOTS; i++){
+    struct rate_bucket * b = &sh->slots[(first + i) % RATE_SLOTS];
+    if(b->key == key){
+      return b;
+    }
+    if( (free_b == NULL) &&
+        ((b->key == 0) || ((b->tat[RATE_READ] <= now) && (b->tat[RATE_WRITE] <= now))) ){
+      free_b = b;
+    }
+    if(b->key == 0){ //end of probe, key isn't here
+      break;
+    }
+  }
+
+  if(free_b){ //its tats are past, so it's full for key too
+    free_b->key = key;
+  }
+  return free_b;
+}
+
+//RATE: take n tokens of class c from b, filled at rate/s, up to a second of
+//them. A full bucket lets any n go, so big batches aren't locked out.
+//Returns 0, or ns until there are enough. Called with its shard locked
+static long long rate_take(struct rate_bucket * b, const int c, const int rate, const int n,
+                           const long long now){
+  const long long cost = 1000000000LL * n / rate;
+  const long long tat = b->tat[c];
+  const long long next = ((tat > now) ? tat : now) + cost;
+
+  if((tat > now) && ((next - now) > 1000000000LL)){
+    return next - now - 1000000000LL;
+  }
+  b->tat[c] = next;
+  return 0;
+}
+
+//RATE: class of cmd, and how many tokens it takes. -1 if it isn't limited
+static int rate_class(const struct context * ctx, const struct cmd * cmd, int * n){
+  static const char * reads[]  = {"READ", "READRANGE", "MREAD", "SEARCH", "LISTUSER", "WATCH", NULL};
+  static const char * writes[] = {"WRITE", "REPLACE", "COMMIT", NULL};
+  int i;
+
+  *n = 1;
+  for(i=0; reads[i]; i++){
+    if(strcmp(cmd->arg[0], reads[i]) == 0){
+      return RATE_READ;
+    }
+  }
+  for(i=0; writes[i]; i++){
+    if(strcmp(cmd->arg[0], writes[i]) == 0){
+      if(ctx->batch){ //WRITE after BEGIN only queues, COMMIT pays for all
+        if(i != 2){
+          return -1;
+        }
+        *n = (ctx->batch_len > 0) ? ctx->batch_len : 1;
+      }
+      return RATE_WRITE;
+    }
+  }
+  return -1;
+}
+
+//RATE: can ctx run cmd, under the limits of its user and IP.
+//Returns 0, or ms until it can, and its class in c
+static int rate_limit(struct context * ctx, const struct cmd * cmd, int * c_out){
+  int n, i;
+
+  const int c = ctx->prio ? -1 : rate_class(ctx, cmd, &n);
+  *c_out = c;
+  if(c < 0){
+    return 0;
+  }
+
+  const int limit[2] = {cfg_user_rate[c], cfg_ip_rate[c]};
+  const unsigned long keys[2] = {
+    rate_hash('u', ctx->rec.usr, strnlen(ctx->rec.usr, MAX_USR_LEN)),
+    rate_hash('i', &ctx->addr, sizeof(unsigned int))};
+  const long long now = now_ns();
+
+  for(i=0; i < 2; i++){
+    if((limit[i] == 0) || ((i == 1) && (ctx->addr == 0))){
+      continue;
+    }
+
+    //a stripe lock, so the bucket stays ours from lookup to update
+    struct rate_shard * sh = &rates[(keys[i] >> 32) % NRATE_SHARDS];
+    pthread_mutex_lock(&sh->mutex);
+    struct rate_bucket * b = rate_bucket(sh, keys[i], now);
+    const long long wait = b ? rate_take(b, c, limit[i], n, now) : 0; //no bucket: table is full of busy ones, let it go
+    pthread_mutex_unlock(&sh->mutex);
+
+    if(wait > 0){
+      __atomic_fetch_add(&stat_throttled[c], 1, __ATOMIC_RELAXED);
+      return (int) (wait / 1000000) + 1;
+    }
+  }
+  return 0;
+}
+
+//ROUTE: hash of a ring key. FNV-1a of keys that differ in their last
+//bytes, like g0#1 and g1#1, stay close, so finish it like murmur3 does
+static unsigned int ring_hash(const char * key, const int len){
+  unsigned int h = tindex_hash(key, len);
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+//ROUTE: order ring points by hash, then by group name, so that servers
+//make the same ring whatever order their ROUTE lines are in
+static int ring_cmp(const void * a, const void * b){
+  const struct ring_point * pa = (const struct ring_point *) a;
+  const struct ring_point * pb = (const struct ring_point *) b;
+
+  if(pa->hash != pb->hash){
+    return (pa->hash < pb->hash) ? -1 : 1;
+  }
+  return strcmp(groups[pa->group].name, groups[pb->group].name);
+}
+
+//ROUTE: group that owns board name, at the first ring point after its hash
+static int ring_owner(const char * name){
+  const unsigned int h = ring_hash(name, strlen(name));
+  int lo = 0, hi = ring_len;
+
+  while(lo < hi){
+    const int mid = (lo + hi) / 2;
+    if(ring[mid].hash < h){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return ring[(lo == ring_len) ? 0 : lo].group;
+}
+
+//ROUTE: make our GROUP and one group for each ROUTE, and their points on
+//the hash ring, that boards_open gives boards to. Without GROUP all boards
+//are ours
+static int MAIN_ONLY groups_open(){
+  char * args[MAX_CMD_ARGS + 1];
+  int i, j, k;
+
+  groups[0].name = cfg_group;
+  pthread_mutex_init(&groups[0].mutex, NULL);
+  ngroups = 1;
+
+  if(cfg_group == NULL){
+    if(cfg_nroutes > 0){
+      fprintf(stderr, "Error: ROUTE needs GROUP\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  for(i=0; i < cfg_nroutes; i++){
+    struct group * g = &groups[ngroups++];
+    pthread_mutex_init(&g->mutex, NULL);
+
+    char * line = strdup(cfg_route[i]);
+    if(line == NULL){
+      perror("strdup");
+      return -1;
+    }
+
+    const int n = stoa(line, args, MAX_CMD_ARGS);
+    if(n >= 2){
+      g->name  = strdup(args[0]);
+      g->nodes = (struct peer *) calloc(n - 1, sizeof(struct peer));
+      g->nnodes = n - 1;
+    }
+    for(j=0; g->name && (j < ngroups - 1); j++){
+      if(strcmp(groups[j].name, g->name) == 0){
+        break;
+      }
+    }
+
+    if( (n < 2) || (g->name == NULL) || (g->nodes == NULL) || (j < ngroups - 1) ||
+        (peers_parse(&args[1], g->nnodes, g->nodes) < 0) ){
+      fprintf(stderr, "Error: Invalid ROUTE '%s', use group host:port ... of another group\n", cfg_route[i]);
+      free(line);
+      return -1;
+    }
+    free(line);
+  }
+
+  for(i=0; i < ngroups; i++){
+    for(k=0; k < RING_POINTS; k++){
+      char key[CACHE_LINE_LEN];
+      const int len = snprintf(key, sizeof(key), "%s#%d", groups[i].name, k);
+      ring[ring_len].hash = ring_hash(key, len);
+      ring[ring_len++].group = i;
+    }
+  }
+  qsort(ring, ring_len, sizeof(struct ring_point), ring_cmp);
+  return 0;
+}
+
+static void groups_close(){
+  int i;
+  for(i=0; i < ngroups; i++){
+    struct group * g = &groups[i];
+    while(g->nidle > 0){
+      close(g->idle[--g->nidle]);
+    }
+    if(i > 0){  //ours is cfg_group
+      free(g->name);
+    }
+    free(g->nodes);
+    pthread_mutex_destroy(&g->mutex);
+    memset(g, 0, sizeof(struct group));
+  }
+  ngroups = 1;
+  ring_len = 0;
+}
+
+//ROUTE: take an open connection to node of g, or to any node if node
+//is -1. Returns -1 if there is none
+static int route_idle(struct group * g, int * node){
+  int i, fd = -1;
+
+  pthread_mutex_lock(&g->mutex);
+  for(i=g->nidle-1; i >= 0; i--){
+    if((*node < 0) || (g->idle_node[i] == *node)){
+      fd = g->idle[i];
+      *node = g->idle_node[i];
+      g->nidle--;
+      g->idle[i] = g->idle[g->nidle];
+      g->idle_node[i] = g->idle_node[g->nidle];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g->mutex);
+  return fd;
+}
+
+//ROUTE: connection to node home of group g, one left open or a new one.
+//If home is down, to another node. All writes on a board go to one node,
+//two coordinators on a board would wait on each other. reused tells the
+//connection was open, and the server may have closed it since
+static int route_get(struct group * g, const int home, int * node, int * reused){
+  struct peer_conn pc;
+  int i;
+
+  *node = home;
+  int fd = route_idle(g, node);
+  *reused = (fd >= 0);
+  if(fd < 0){
+    if(peer_connect(&g->nodes[home], &pc) == 0){
+      fd = pc.fd;
+    }else{  //home is down, use what we have open to the others
+      *node = -1;
+      fd = route_idle(g, node);
+      *reused = (fd >= 0);
+    }
+  }
+
+  for(i=1; (fd < 0) && (i < g->nnodes); i++){  //the next nodes after home
+    *node = (home + i) % g->nnodes;
+    if(peer_connect(&g->nodes[*node], &pc) == 0){
+      fd = pc.fd;
+    }
+  }
+
+  if((fd >= 0) && !*reused){
+    __atomic_fetch_add(&stat_route_connects, 1, __ATOMIC_RELAXED);
+    //a routed write is a 2PC there, give it time for all its phases
+    sock_timeout(fd, SO_RCVTIMEO, 4 * cfg_sync_read_timeout);
+  }
+  return fd;
+}
+
+//ROUTE: keep connection for the next request, up to ROUTEIDLE of them
+static void route_put(struct group * g, const int node, const int fd){
+  pthread_mutex_lock(&g->mutex);
+  if(g->nidle < cfg_route_idle){
+    g->idle[g->nidle] = fd;
+    g->idle_node[g->nidle++] = node;
+    pthread_mutex_unlock(&g->mutex);
+    return;
+  }
+  pthread_mutex_unlock(&g->mutex);
+  close(fd);
+}
+
+//ROUTE: send req on fd, and collect the reply lines between marks
+//nmarks-1 and nmarks in out, byte by byte, so lines of any length pass.
+//Only the start of a line that is still like mark is held back. Returns
+//0, -1 if reply was cut short, or -2 if nothing came back
+static int route_relay(const int fd, const char * req, const int req_len, const char * mark,
+                       const int nmarks, char ** out, size_t * out_len){
+  char in[CONN_BUF_LEN];
+  const int mark_len = strlen(mark);
+  int in_pos = 0, in_len = 0, len = 0, same = 0, marks = 0, got = 0, rv = 0;
+
+  FILE * f = open_memstream(out, out_len);
+  if(f == NULL){
+    perror("open_memstream");
+    return -1;
+  }
+
+  if(writen(fd, req, req_len) != req_len){
+    rv = -2;
+  }
+
+  while((rv == 0) && (marks < nmarks)){
+    if(in_pos == in_len){
+      const ssize_t n = recv(fd, in, sizeof(in), 0);
+      if(n <= 0){
+        if((n < 0) && (errno == EINTR)){
+          continue;
+        }
+        rv = got ? -1 : -2;
+        break;
+      }
+      in_pos = 0;
+      in_len = n;
+      got = 1;
+    }
+
+    const char c = in[in_pos++];
+    const int keep = (marks == (nmarks - 1));
+    if(c != '\n'){
+      if((len == same) && (same < mark_len) && (c == mark[same])){
+        same++; //may be the mark, hold it
+      }else if(keep){
+        if(len == same){
+          fwrite(mark, 1, same, f);
+        }
+        fputc(c, f);
+      }
+      len++;
+      continue;
+    }
+
+    if((len == same) && (same == mark_len)){
+      marks++;
+    }else if(keep){
+      if(len == same){
+        fwrite(mark, 1, same, f);
+      }
+      fputc('\n', f);
+    }
+    len = same = 0;
+  }
+
+  fclose(f);
+  return rv;
+}
+
+//ROUTE: run line on a server of the group that owns our board, as our
+//user, and pass its reply on. A COMMIT takes the batch with it. Returns
+//-1 if the group can't be reached
+static int route_request(struct context * ctx, const struct cmd * cmd, const char * line){
+  struct bulletin_board * b = ctx->board;
+  struct group * g = &groups[b->group];
+  char mark[CACHE_LINE_LEN];
+  char * req = NULL, * out = NULL;
+  size_t req_len = 0, out_len = 0;
+  int i, reused, node, nmarks = 2, rv = -2;
+  const int home = ring_hash(b->name, strlen(b->name)) % g->nnodes;
+
+  FILE * f = open_memstream(&req, &req_len);
+  if(f == NULL){
+    perror("open_memstream");
+    return -1;
+  }
+
+  //each ROUTE is answered with mark, so we know where replies are
+  snprintf(mark, sizeof(mark), "1.0 ROUTE %s", b->name);
+  fprintf(f, "ROUTE %s/%s\n", b->name, ctx->rec.usr);
+  if(ctx->batch && (strcmp(cmd->arg[0], "COMMIT") == 0)){
+    fprintf(f, "BEGIN\n");
+    for(i=0; i < ctx->batch_len; i++){
+      fprintf(f, "WRITE %s\n", ctx->batch[i]);
+    }
+    fprintf(f, "ROUTE %s/%s\n", b->name, ctx->rec.usr);
+    nmarks++;
+  }
+  fprintf(f, "%s\nROUTE %s/%s\n", line, b->name, ctx->rec.usr);
+  fclose(f);
+
+  //connections left open may have been closed by the server, try the
+  //next one. A new connection that fails won't do better
+  while(rv == -2){
+    const int fd = route_get(g, home, &node, &reused);
+    if(fd < 0){
+      break;
+    }
+
+    free(out);
+    out = NULL;
+    rv = route_relay(fd, req, req_len, mark, nmarks, &out, &out_len);
+    if(rv == 0){
+      route_put(g, node, fd);
+    }else{
+      close(fd);
+    }
+
+    if(!reused){
+      break;
+    }
+  }
+
+  if(rv == 0){
+    __atomic_fetch_add(&stat_routed[0], 1, __ATOMIC_RELAXED);
+    writen(ctx->fd, out, out_len);
+  }else{
+    __atomic_fetch_add(&stat_routed[1], 1, __ATOMIC_RELAXED);
+    log_msg(LOG_WARN, "[ROUTE] group %s of board %s doesn't answer\n", g->name, b->name);
+  }
+  free(req);
+  free(out);
+
+  return (rv == 0) ? 0 : -1;
+}
+
+//ROUTE: pass a request on a board of another group to it. Returns the
+//ST_ of the command, for its stats
+static int route_cmd(struct context * ctx, const struct cmd * cmd, const char * line){
+  const struct group * g = &groups[ctx->board->group];
+  int sc, n;
+
+  const int c = rate_class(ctx, cmd, &n);
+  for(sc=0; (sc < ST_INVALID) && (strcasecmp(cmd->arg[0], stat_cmd_names[sc]) != 0); sc++);
+
+  if(sc == ST_WATCH){  //watchers wait on the owner's watch hub
+    replyf(ctx->fd, "2.2 ERROR WATCH board %s is on group %s\n", ctx->board->name, g->name);
+  }else if(route_request(ctx, cmd, line) < 0){
+    replyf(ctx->fd, "%s group %s is down\n", (c == RATE_WRITE) ? "3.2 ERROR WRITE" : "2.2 ERROR READ", g->name);
+  }
 
-  }else{
-    //we can't call SYNC_ON twice
-    dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-    rv = -1;
+  if(sc == ST_COMMIT){
+    batch_free(ctx);
   }
-  return rv;
+  return sc;
 }
 
-static int cmd_sync_replace(struct context *ctx, struct cmd * cmd){
-  int rv = 0;
+//ROUTE: a server of another group runs the requests of its client here,
+//on board and as user, until the next ROUTE. Only on the sync port
+static int cmd_route(struct context *ctx, struct cmd * cmd){
+  if(!ctx->prio){
+    replyf(ctx->fd, "2.2 ERROR ROUTE only on sync port\n");
+    return 0;
+  }
 
-  if(ctx->sync_on == 1){
-    if(cmd->nargs != 4){
-      rv = -1;  //invalid count of arguments
-    }else{
-      const int number = stoi(cmd->arg[1]);
-      if(number < 0){
-        rv = -1;
-      }else{
-        rv = bulletin_replace(number, cmd->arg[2], cmd->arg[3]);
-      }
-    }
+  if(cmd->nargs != 3){
+    return -1;
+  }
 
-  }else{
-    //we can't call SYNC_ON twice
-    dprintf(ctx->fd, "3.2 ERROR WRITE system error\n");
-    rv = -1;
+  struct bulletin_board * b = board_find(cmd->arg[1]);
+  if((b == NULL) || (b->group != 0)){
+    log_msg(LOG_WARN, "[ROUTE] request for board %s, it isn't ours. Check GROUP and ROUTE of all servers\n", cmd->arg[1]);
+    replyf(ctx->fd, "2.2 ERROR ROUTE board %s isn't ours\n", cmd->arg[1]);
+    return -1;
   }
-  return rv;
+
+  //client timeouts from now on. It stays a sync session, so it doesn't
+  //take a client slot, and the routing server took its rate limits
+  if(!ctx->routed){
+    __atomic_store_n(&ctx->routed, 1, __ATOMIC_RELEASE);
+    ctx->rd_timeout = cfg_read_timeout * 1000;
+    sock_timeout(ctx->fd, SO_RCVTIMEO, ctx->rd_timeout);
+    sock_timeout(ctx->fd, SO_SNDTIMEO, cfg_write_timeout * 1000);
+  }
+
+  ctx->board = b;
+  strncpy(ctx->rec.usr, cmd->arg[2], MAX_USR_LEN);
+  replyf(ctx->fd, "1.0 ROUTE %s\n", b->name);
+  return 0;
 }
 
 static int request_handler(struct context * ctx){
 
-  if(dprintf(ctx->fd, "Welcome to bulletin board.\n") <= 0){
+  //deadlines, so a silent or slow connection can't keep this worker
+  ctx->rd_timeout = ctx->prio ? cfg_sync_read_timeout : cfg_read_timeout * 1000;
+  sock_timeout(ctx->fd, SO_RCVTIMEO, ctx->rd_timeout);
+  sock_timeout(ctx->fd, SO_SNDTIMEO, ctx->prio ? cfg_sync_write_timeout : cfg_write_timeout * 1000);
+
+  if((ctx->prio != PRIO_RESUME) && (replyf(ctx->fd, "Welcome to bulletin board.\n") <= 0)){
     perror("dprintf");
     return -1;
   }
@@ -958,231 +4772,954 @@ static int request_handler(struct context * ctx){
   memset(&ctx->rec, 0, sizeof(struct bulletin_item));
 
   strncpy(ctx->rec.usr, nousername, MAX_USR_LEN);
+  ctx->board = &boards[0];
+  ctx->routed = 0;
+
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(struct sockaddr_in);
+  ctx->addr = 0;
+  if((getpeername(ctx->fd, (struct sockaddr *) &sa, &salen) == 0) && (sa.sin_family == AF_INET)){
+    ctx->addr = sa.sin_addr.s_addr;
+  }
 
 
-  int len = 0, rv = 0, sync_on = 0;
+  int len = 0, rv = 0, ncmds = 0;  //commands since last ROUTE
   struct cmd cmd;
+  char raw[MAX_LINE_LEN + 1];  //line before stocmd, to route it
 
-  while((len = readln(ctx->fd, ctx->line, MAX_LINE_LEN)) > 0){
+  __atomic_fetch_add(&stat_sessions, 1, __ATOMIC_RELAXED);
 
+  ctx->in_pos = ctx->in_len = 0;
+  while((len = conn_readln(ctx, ctx->line, MAX_LINE_LEN)) > 0){
+
+    if(ngroups > 1){
+      memcpy(raw, ctx->line, len + 1);
+    }
     if(stocmd(ctx->line, &cmd) == -1){  //conver line to command
       break;
     }
 
+    int rc;
+    const int wait = rate_limit(ctx, &cmd, &rc);
+    if(wait > 0){
+      replyf(ctx->fd, "%s ERROR THROTTLED retry in %d ms\n", (rc == RATE_WRITE) ? "3.2" : "2.2", wait);
+      continue;
+    }
+
+    const long long start = now_ns();
+    int sc = ST_INVALID;
     rv = 0;
-    if(strcmp(cmd.arg[0], "USER") == 0){
+    errno = 0;
+    tsend_failed = -1;
+    int n;
+    if((ctx->board->group != 0) && !ctx->routed && (rate_class(ctx, &cmd, &n) >= 0)){
+      sc = route_cmd(ctx, &cmd, raw);
+
+    }else if(strcmp(cmd.arg[0], "USER") == 0){
+      sc = ST_USER;
       rv = cmd_user(ctx, &cmd);
 
+    }else if(strcmp(cmd.arg[0], "BOARD") == 0){
+      sc = ST_BOARD;
+      rv = cmd_board(ctx, &cmd);
+
     }else if(strcmp(cmd.arg[0], "READ") == 0){
+      sc = ST_READ;
       rv = cmd_read(ctx, &cmd);
 
+    }else if(strcmp(cmd.arg[0], "READRANGE") == 0){
+      sc = ST_READRANGE;
+      rv = cmd_readrange(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "MREAD") == 0){
+      sc = ST_MREAD;
+      rv = cmd_mread(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "SEARCH") == 0){
+      sc = ST_SEARCH;
+      rv = cmd_search(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "LISTUSER") == 0){
+      sc = ST_LISTUSER;
+      rv = cmd_listuser(ctx, &cmd);
+
     }else if(strcmp(cmd.arg[0], "WRITE") == 0){
+      sc = ST_WRITE;
       rv = cmd_write(ctx, &cmd);
 
     }else if(strcmp(cmd.arg[0], "REPLACE") == 0){
+      sc = ST_REPLACE;
       rv = cmd_replace(ctx, &cmd);
 
+    }else if(strcmp(cmd.arg[0], "BEGIN") == 0){
+      sc = ST_BEGIN;
+      rv = cmd_begin(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "COMMIT") == 0){
+      sc = ST_COMMIT;
+      rv = cmd_commit(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "ABORT") == 0){
+      sc = ST_ABORT;
+      rv = cmd_abort(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "STATS") == 0){
+      sc = ST_STATS;
+      rv = cmd_stats(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "TRACE") == 0){
+      sc = ST_TRACE;
+      rv = cmd_trace(ctx, &cmd);
+
+    }else if(strcmp(cmd.arg[0], "WATCH") == 0){
+      sc = ST_WATCH;
+      rv = cmd_watch(ctx, &cmd);
+      if(rv == 1){ //connection is now with watch hub
+        stat_cmd(sc, start, 0);
+        __atomic_fetch_sub(&stat_sessions, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ctx->routed, 0, __ATOMIC_RELEASE);
+        batch_free(ctx);
+        return 1;
+      }
+
+    }else if(strcmp(cmd.arg[0], "ROUTE") == 0){
+      sc = ST_ROUTE;
+      rv = cmd_route(ctx, &cmd);
+      if(rv < 0){ //don't run what follows on the wrong board
+        stat_cmd(sc, start, rv);
+        break;
+      }
+
+      //a ROUTE after commands ends a routed request. If the next one isn't
+      //here yet, it waits in the hub, so idle connections don't keep workers
+      if( (ncmds > 0) && (ctx->in_pos == ctx->in_len) && (ctx->batch == NULL) &&
+          (tsend_failed != ctx->fd) && (watch_add(NULL, ctx->fd, NULL, 0) == 0) ){
+        stat_cmd(sc, start, rv);
+        __atomic_fetch_sub(&stat_sessions, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&ctx->routed, 0, __ATOMIC_RELEASE);
+        return 1;
+      }
+      ncmds = -1;
+
     }else if(strcmp(cmd.arg[0], "QUIT") == 0){
       break;
 
     }else if(strncmp(cmd.arg[0], "SYNC_", 5) == 0){ //if its a sync command
 
-      if(strcmp(cmd.arg[0], "SYNC_ON") == 0){
-        rv = cmd_sync_on(ctx, &cmd);
+      if(strcmp(cmd.arg[0], "SYNC_ON") == 0){
+        sc = ST_SYNC_ON;
+        rv = cmd_sync_on(ctx, &cmd);
+
+      }else if(strcmp(cmd.arg[0], "SYNC_OFF") == 0){
+        sc = ST_SYNC_OFF;
+        rv = cmd_sync_off(ctx, &cmd);
+
+      }else if(strcmp(cmd.arg[0], "SYNC_ABORT") == 0){
+        sc = ST_SYNC_ABORT;
+        rv = cmd_sync_abort(ctx, &cmd);
+        stat_cmd(sc, start, rv);
+        break;  //close the connection
+
+      }else if(strcmp(cmd.arg[0], "SYNC_WRITE") == 0){
+        sc = ST_SYNC_WRITE;
+        rv = cmd_sync_write(ctx, &cmd);
+
+      }else if(strcmp(cmd.arg[0], "SYNC_REPLACE") == 0){
+        sc = ST_SYNC_REPLACE;
+        rv = cmd_sync_replace(ctx, &cmd);
+
+      }else{
+        replyf(ctx->fd, "2.2 ERROR Invalid message\n");
+        rv = -1;
+      }
+
+      //send sync command status
+      if(rv >= 0){
+        write(ctx->fd, "ACK\n", 4);
+      }else{
+        write(ctx->fd, "NACK\n", 5);
+      }
+
+    }else{
+      replyf(ctx->fd, "2.2 ERROR Invalid message\n");
+    }
+
+    if(rv < 0){
+      replyf(ctx->fd, "2.2 ERROR Invalid command arguments\n");
+    }
+    stat_cmd(sc, start, rv);
+
+    //commands don't check their replies, a send to our client that failed
+    //(SO_SNDTIMEO, or client is gone) is in tsend_failed. errno can be
+    //left by sends to peers, or by a non-blocking send that was finished
+    if(tsend_failed == ctx->fd){
+      log_msg(LOG_INFO, "[THREAD] sock %d doesn't read replies, closing\n", ctx->fd);
+      len = -1;
+      break;
+    }
+    ncmds++;
+  }
+  __atomic_fetch_sub(&stat_sessions, 1, __ATOMIC_RELAXED);
+
+  if((len > 0) && (rv == 0)){  //send bye only on quit
+    replyf(ctx->fd, "4.0 BYE %s\n", ctx->rec.usr);
+  }
+
+  if(ctx->sync_on){  //coordinator went away, or silent, in the middle of 2PC
+    log_msg(LOG_WARN, "[SYNC] coordinator of %lx is gone, aborting\n", ctx->trace_id);
+    sync_abort(ctx);
+  }
+  batch_free(ctx);
+  __atomic_store_n(&ctx->routed, 0, __ATOMIC_RELEASE);  //before fd is closed
+
+  return 0;
+}
+
+//SHARD: run this thread on the CPU of shard sh
+static void shard_pin(const struct shard * sh){
+  cpu_set_t set;
+
+  if(sh->cpu < 0){
+    return;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(sh->cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+
+static void* bbserv_thread(void * arg){
+  struct context * ctx = (struct context*) arg;
+  tstats = &ctx->stats;
+  tring = ctx->trace;
+  shard_pin(&shards[ctx->shard]);
+
+  ctx->ring.fd = -1;
+  if((cfg_io == IO_URING) && (uring_open(&ctx->ring, 4) < 0)){
+    log_msg(LOG_WARN, "[URING] setup failed, worker uses recv: %s\n", strerror(errno));
+  }
+
+  while((ctx->fd = bb_pop(ctx)) > 0){
+    struct bounded_buf * q = &shards[ctx->shard].rbb;
+
+    if(!ctx->prio && (cfg_queue_deadline > 0) && (ctx->queued > cfg_queue_deadline * 1000000LL)){
+      //client has likely given up on us
+      __atomic_fetch_add(&q->late, 1, __ATOMIC_RELAXED);
+      log_msg(LOG_INFO, "[THREAD] sock %d queued %lld ms, turned away\n", ctx->fd, ctx->queued / 1000000);
+      conn_busy(ctx->fd);
+
+    }else{
+      log_msg(LOG_DEBUG, "[THREAD] Request on sock %d\n", ctx->fd);
+      if(request_handler(ctx) != 1){  //1 if connection was parked, not ours to close
+        shutdown(ctx->fd, SHUT_RDWR);
+        close(ctx->fd);
+      }
+    }
+
+    if(!ctx->prio){
+      __atomic_fetch_sub(&q->clients, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  uring_close(&ctx->ring);
+  pthread_exit(NULL);
+}
+
+//POOL: context for slot i, made on first use. Called with rbb of its shard locked
+static struct context * thr_context(const int i){
+  if(tctx[i]){
+    return tctx[i];
+  }
+
+  struct context * ctx = (struct context *) calloc(1, sizeof(struct context));
+  if(ctx == NULL){
+    perror("calloc");
+    return NULL;
+  }
+  ctx->shard = i % nshards;
+  ctx->slot = i;
+
+  if(cfg_trace){
+    ctx->trace = (struct trace_ring *) calloc(1, sizeof(struct trace_ring));
+    if(ctx->trace == NULL){
+      perror("calloc");
+      free(ctx);
+      return NULL;
+    }
+    ctx->trace->tid = i;
+  }
+
+  __atomic_store_n(&tctx[i], ctx, __ATOMIC_RELEASE);  //STATS and TRACE look at it now
+  return ctx;
+}
+
+//POOL: join retired workers of shard sh, and free their slots. They
+//hold no locks on the way out. Called with its rbb locked
+static void thr_reap(struct shard * sh){
+  int i;
+
+  for(i = sh - shards; i < MAX_SLOTS; i += nshards){
+    if(tctx[i] && (tctx[i]->state == THR_EXITED)){
+      pthread_join(tctx[i]->thread, NULL);
+      tctx[i]->state = THR_FREE;
+    }
+  }
+}
+
+//POOL: start a worker in a free slot of shard sh. Called with its rbb locked
+static int thr_spawn(struct shard * sh){
+  int i;
+
+  thr_reap(sh); //shards without a manager join theirs here
+  for(i = sh - shards; i < thr_slots(); i += nshards){
+    if((tctx[i] == NULL) || (tctx[i]->state == THR_FREE)){
+      break;
+    }
+  }
+
+  if(i >= thr_slots()){
+    return -1;
+  }
+
+  struct context * ctx = thr_context(i);
+  if(ctx == NULL){
+    return -1;
+  }
+
+  if(pthread_create(&ctx->thread, NULL, bbserv_thread, (void*)ctx) != 0){
+    perror("pthread_create");
+    return -1;
+  }
+  ctx->state = THR_RUNNING;
+  sh->rbb.nthreads++;
+  return 0;
+}
+
+//POOL: add workers to shard while requests wait longer than QUEUEWAIT,
+//and none is idle, or free to take them. Join the ones that retire
+static void * thr_manager(void * arg){
+  struct shard * sh = (struct shard *) arg;
+  struct bounded_buf * q = &sh->rbb;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&q->mutex);
+  while(!q->stop){
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long) cfg_queue_wait * 1000;
+    deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&q->grow, &q->mutex, &deadline);
+    thr_reap(sh);
+
+    if((q->count > 0) && ((q->idle == 0) || !bb_admit(sh, q)) && (q->nthreads < sh->nslots)){
+      const long long waited = now_ns() - q->when[q->out];
+      if(waited >= cfg_queue_wait * 1000LL){
+        //one worker for each waiting request, as far as THMAX lets us
+        int i;
+        for(i=0; (i < q->count) && (thr_spawn(sh) == 0); i++){
+          q->grown++;
+        }
+        log_msg(LOG_INFO, "[POOL] queue wait %lld us, up to %d threads\n",
+          waited / 1000, q->nthreads);
+      }
+    }
+  }
+  pthread_mutex_unlock(&q->mutex);
+
+  return NULL;
+}
+
+//SHARD: accept connections on our sockets, for our workers
+static void * shard_acceptor(void * arg){
+  struct shard * sh = (struct shard *) arg;
+  int sd, port;
+
+  shard_pin(sh);
+  while((sd = select_ports(sh, &port)) > 0){
+    bb_push(sh, sd, port & 1);
+  }
+  return NULL;
+}
+
+//POOL: our share of THMAX and THMIN, and the sync worker with peers,
+//which always runs. Slot i is for shard i % nshards, so a shard keeps
+//its slots when THMAX changes. Called with rbb locked
+static void shard_slots(struct shard * sh){
+  const int i = sh - shards;
+  const int share = (cfg_max_threads - i + nshards - 1) / nshards;
+  const int sync = (cfg_npeers > 0) ? 1 : 0;
+
+  sh->nslots = share + sync;
+  sh->min = (thr_min() * share + cfg_max_threads - 1) / cfg_max_threads + sync;
+}
+
+//POOL: start manager of shard sh, if it has slots over THMIN
+static int shard_manage(struct shard * sh){
+  struct bounded_buf * q = &sh->rbb;
+
+  if(q->managed || (sh->min >= sh->nslots)){
+    return 0;
+  }
+  if(pthread_create(&q->manager, NULL, thr_manager, sh) != 0){
+    perror("pthread_create");
+    return -1;
+  }
+  q->managed = 1;
+  return 0;
+}
+
+static int MAIN_ONLY thr_preallocate(){
+  int i, j, rc = 0;
+
+  //split worker slots, and THMIN, between shards
+  const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  for(i=0; (i < nshards) && (rc == 0); i++){
+    struct shard * sh = &shards[i];
+    struct bounded_buf * q = &sh->rbb;
+
+    memset(q, 0, sizeof(struct bounded_buf));
+    if( (pthread_mutex_init(&q->mutex, NULL) != 0) ||
+        (pthread_cond_init(&q->empty, NULL)  != 0) ||
+        (pthread_cond_init(&q->full, NULL)   != 0) ||
+        (pthread_cond_init(&q->grow, NULL)   != 0)){
+      return -1;
+    }
+
+    sh->cpu = ((nshards > 1) && (ncpu > 0)) ? (i % ncpu) : -1;
+
+    pthread_mutex_lock(&q->mutex);
+    shard_slots(sh);
+    for(j=0; j < sh->min; j++){
+      if(thr_spawn(sh) < 0){
+        rc = -1;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    if(rc == 0){
+      rc = shard_manage(sh);
+    }
+  }
+
+  return rc;
+}
+
+//POOL: apply THMAX and THMIN of a reload. Workers start up to the new
+//THMIN, and a worker whose slot is past THMAX exits after its session
+static int thr_resize(){
+  int i, rc = 0;
+
+  for(i=0; i < nshards; i++){
+    struct shard * sh = &shards[i];
+    struct bounded_buf * q = &sh->rbb;
+
+    pthread_mutex_lock(&q->mutex);
+    shard_slots(sh);
+    while((q->nthreads < sh->min) && (thr_spawn(sh) == 0));
+    pthread_cond_broadcast(&q->full); //idle workers check their slot
+    pthread_mutex_unlock(&q->mutex);
+
+    if(shard_manage(sh) < 0){
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+//SHARD: start acceptors, once the board is open. Main thread accepts for shard 0
+static int MAIN_ONLY shard_start(){
+  int i;
+  for(i=1; i < nshards; i++){
+    if(pthread_create(&shards[i].acceptor, NULL, shard_acceptor, &shards[i]) != 0){
+      perror("pthread_create");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+//Called after close_ports(), so acceptors are on their way out
+static int thr_deallocate(){
+  int i, j;
+
+  for(i=1; i < nshards; i++){
+    pthread_join(shards[i].acceptor, NULL);
+  }
+
+  for(i=0; i < nshards; i++){
+    struct shard * sh = &shards[i];
+    struct bounded_buf * q = &sh->rbb;
+
+    pthread_mutex_lock(&q->mutex);
+    q->stop = 1; //no more growing, shrinking or stealing
+    pthread_cond_signal(&q->grow);
+    const int nthreads = q->nthreads;
+    pthread_mutex_unlock(&q->mutex);
+
+    if(q->managed){
+      pthread_join(q->manager, NULL);
+      q->managed = 0;
+    }
+
+    for(j=0; j < nthreads; j++){
+      bb_push(sh, -1, 1);
+    }
+  }
+
+  for(i=0; i < MAX_SLOTS; i++){
+    if(tctx[i] && (tctx[i]->state != THR_FREE)){
+      pthread_join(tctx[i]->thread, NULL);
+    }
+  }
+
+  for(i=0; i < nshards; i++){
+    struct bounded_buf * q = &shards[i].rbb;
+    uring_close(&shards[i].ring);
+    close(shards[i].wake);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->empty);
+    pthread_cond_destroy(&q->full);
+    pthread_cond_destroy(&q->grow);
+  }
+  free(shards);
+  shards = NULL;
+  nshards = 0;
+
+  for(i=0; i < MAX_SLOTS; i++){
+    if(tctx[i]){
+      free(tctx[i]->trace);
+      free(tctx[i]);
+      tctx[i] = NULL;
+    }
+  }
+  return 0;
+}
+
+//Open Unix socket at path, for clients or peers on this host
+static int unix_listen(const char * path){
+  struct sockaddr_un su;
+
+  if(strlen(path) >= sizeof(su.sun_path)){
+    fprintf(stderr, "Error: socket path %s is too long\n", path);
+    return -1;
+  }
+  memset(&su, 0, sizeof(struct sockaddr_un));
+  su.sun_family = AF_UNIX;
+  strcpy(su.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd == -1){
+    perror("socket");
+    return -1;
+  }
+
+  unlink(path); //left by a server that didn't exit clean. pidfile says we are the only one
+  if( (bind(fd, (struct sockaddr *)&su, sizeof(struct sockaddr_un)) == -1) ||
+      (listen(fd, cfg_backlog) < 0) ){
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+
+  log_msg(LOG_INFO, "Using socket %s on skt %d\n", path, fd);
+  return fd;
+}
+
+//Open TCP port, for one shard. Shared with SO_REUSEPORT, if we have many
+static int port_listen(const int port){
+  struct sockaddr_in sa;
+
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family       = AF_INET;
+  sa.sin_addr.s_addr  = htonl(INADDR_ANY);
+  sa.sin_port         = htons(port);
+
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd == -1){
+    perror("socket");
+    return -1;
+  }
+
+  const int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+  if(nshards > 1){  //kernel spreads connections over shards
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int));
+  }
 
-      }else if(strcmp(cmd.arg[0], "SYNC_OFF") == 0){
-          rv = cmd_sync_off(ctx, &cmd);
+  if(bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == -1){
+    perror("bind");
+    close(fd);
+    return -1;
+  }
 
-      }else if(strcmp(cmd.arg[0], "SYNC_ABORT") == 0){
-        rv = cmd_sync_abort(ctx, &cmd);
-        break;  //close the connection
+  if (listen(fd, cfg_backlog) < 0 ) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
 
-      }else if(strcmp(cmd.arg[0], "SYNC_WRITE") == 0){
-        rv = cmd_sync_write(ctx, &cmd);
+  log_msg(LOG_INFO, "Using port %i on skt %d\n", port, fd);
+  return fd;
+}
 
-      }else if(strcmp(cmd.arg[0], "SYNC_REPLACE") == 0){
-        rv = cmd_sync_replace(ctx, &cmd);
+//Open our ports, once for each shard
+static int MAIN_ONLY open_ports(){
+  int i, j;
 
-      }else{
-        dprintf(ctx->fd, "2.2 ERROR Invalid message\n");
-        rv = -1;
-      }
+  nshards = cfg_acceptors;
+  if(nshards <= 0){
+    nshards = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if(nshards > cfg_max_threads){ //each needs a worker
+    nshards = cfg_max_threads;
+  }
+  if(nshards <= 0){
+    nshards = 1;
+  }
 
-      //send sync command status
-      if(rv >= 0){
-        write(ctx->fd, "ACK\n", 4);
-      }else{
-        write(ctx->fd, "NACK\n", 5);
-      }
+  shards = (struct shard *) calloc(nshards, sizeof(struct shard));
+  if(shards == NULL){
+    perror("calloc");
+    return -1;
+  }
 
-    }else{
-      dprintf(ctx->fd, "2.2 ERROR Invalid message\n");
+  for(j=0; j < nshards; j++){
+    struct shard * sh = &shards[j];
+    sh->io = cfg_io;
+    sh->ring.fd = -1; //opened by the thread that accepts
+    for(i=0; i < NPORTS; i++){
+      sh->sfd[i] = sh->stale[i] = sh->armed[i] = -1;
     }
 
-    if(rv < 0){
-      dprintf(ctx->fd, "2.2 ERROR Invalid command arguments\n");
+    sh->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(sh->wake == -1){
+      perror("eventfd");
+      return -1;
     }
-  }
 
-  if((len > 0) && (rv == 0)){  //send bye only on quit
-    dprintf(ctx->fd, "4.0 BYE %s\n", ctx->rec.usr);
+    for(i=0; i < 2; i++){
+      if((sh->sfd[i] = port_listen(cfg_port[i])) < 0){
+        return -1;
+      }
+    }
   }
 
-  if(sync_on > 0){
-    bulletin_sync(0);
+  //Unix sockets can't be shared with SO_REUSEPORT, shard 0 takes them
+  for(i=0; i < 2; i++){
+    if(cfg_sock[i] && ((shards[0].sfd[2 + i] = unix_listen(cfg_sock[i])) < 0)){
+      return -1;
+    }
   }
 
   return 0;
 }
 
-static void* bbserv_thread(void * arg){
-  struct context * ctx = (struct context*) arg;
+//SHARD: is fd one of our listening sockets
+static int is_port_fd(const int fd){
+  int i, j;
+  for(i=0; i < nshards; i++){
+    for(j=0; j < NPORTS; j++){
+      if(shards[i].sfd[j] == fd){
+        return 1;
+      }
+    }
+    if(shards[i].wake == fd){
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  while((ctx->fd = bb_pop()) > 0){
+//METRICS: answer every connection with a Prometheus text page
+static void * metrics_thread(void * arg){
+  char buf[1024];
+  const struct timeval tv = {1, 0};
 
-    if(cfg_debug){
-      printf("[THREAD] Request on sock %d\n", ctx->fd);
+  while(1){
+    const int fd = accept(mfd, NULL, NULL);
+    if(fd < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      break;  //socket was shut down
     }
-    request_handler(ctx);
 
-    shutdown(ctx->fd, SHUT_RDWR);
-    close(ctx->fd);
+    //we serve any path, so just take the request
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+    recv(fd, buf, sizeof(buf), 0);
+
+    stats_send(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n", stats_prom);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
   }
 
-  pthread_exit(NULL);
+  return NULL;
 }
 
-static int thr_preallocate(){
+static int metrics_open(){
+  struct sockaddr_in sa;
+
+  if(cfg_metrics_port == 0){
+    return 0;
+  }
+
+  memset(&sa, 0, sizeof(struct sockaddr_in));
+  sa.sin_family       = AF_INET;
+  sa.sin_addr.s_addr  = htonl(INADDR_ANY);
+  sa.sin_port         = htons(cfg_metrics_port);
 
-  tctx = (struct context *) calloc(cfg_max_threads, sizeof(struct context));
-  if(tctx == NULL){
+  mfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(mfd == -1){
+    perror("socket");
     return -1;
   }
 
-  //initialize the bb
-  rbb.in = rbb.out = rbb.count = 0;
-  memset(&rbb, 0, sizeof(struct bounded_buf));
+  const int opt = 1;
+  setsockopt(mfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
 
-  if( (pthread_mutex_init(&rbb.mutex, NULL) != 0) ||
-      (pthread_cond_init(&rbb.empty, NULL)  != 0) ||
-      (pthread_cond_init(&rbb.full, NULL)   != 0)){
+  if( (bind(mfd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == -1) ||
+      (listen(mfd, 5) < 0) ){
+    perror("bind");
+    close(mfd);
+    mfd = -1;
     return -1;
   }
 
-  int i, rc = 0;
-  for(i=0; i < cfg_max_threads; i++){
-    if(pthread_create(&tctx[i].thread, NULL, bbserv_thread, (void*)&tctx[i]) != 0){
-      rc = -1;
-      break;
-    }
+  if(pthread_create(&mthread, NULL, metrics_thread, NULL) != 0){
+    close(mfd);
+    mfd = -1;
+    return -1;
   }
+  return 0;
+}
 
-  return rc;
+static void metrics_close(){
+  if(mfd < 0){
+    return;
+  }
+  shutdown(mfd, SHUT_RDWR);  //wakes up accept()
+  pthread_join(mthread, NULL);
+  close(mfd);
+  mfd = -1;
 }
 
-static int thr_deallocate(){
-  int i;
-  for(i=0; i < cfg_max_threads; i++){
-    bb_push(-1);
+static void close_ports(){
+  int i, j;
+
+  for(j=0; j < nshards; j++){
+    struct shard * sh = &shards[j];
+    for(i=0; i < NPORTS; i++){
+      if(sh->sfd[i] >= 0){
+        shutdown(sh->sfd[i], SHUT_RDWR);
+        close(sh->sfd[i]);
+      }
+      const int fd = __atomic_exchange_n(&sh->stale[i], -1, __ATOMIC_ACQ_REL);
+      if(fd >= 0){  //acceptor didn't get to it
+        close(fd);
+      }
+    }
   }
 
-  for(i=0; i < cfg_max_threads; i++){
-    pthread_join(tctx[i].thread, NULL);
+  for(i=0; i < 2; i++){
+    if(cfg_sock[i]){
+      unlink(cfg_sock[i]);
+    }
   }
+}
 
-  rbb.in = rbb.out = rbb.count = 0;
-  memset(&rbb, 0, sizeof(struct bounded_buf));
+//URING: drop shard sh to select and accept
+static void uring_fallback(struct shard * sh, const char * why){
+  int i;
 
-  pthread_mutex_destroy(&rbb.mutex);
-  pthread_cond_destroy(&rbb.empty);
-  pthread_cond_destroy(&rbb.full);
+  log_msg(LOG_WARN, "[URING] %s, shard accepts with select\n", why);
+  uring_close(&sh->ring); //cancels an accept that is still armed
+  for(i=0; i < NPORTS; i++){
+    sh->armed[i] = -1;
+  }
+  sh->wake_armed = 0;
+  sh->io = IO_CLASSIC;
+}
 
-  free(tctx);
-  return 0;
+//SHARD: close sockets a reload took off our ports, and clear our wake up
+static void shard_reap(struct shard * sh){
+  eventfd_t n;
+  int i;
+
+  while((eventfd_read(sh->wake, &n) < 0) && (errno == EINTR));
+  for(i=0; i < NPORTS; i++){
+    if(__atomic_load_n(&sh->stale[i], __ATOMIC_ACQUIRE) >= 0){
+      close(__atomic_exchange_n(&sh->stale[i], -1, __ATOMIC_ACQ_REL));
+    }
+  }
 }
 
-static int open_ports(){
-  struct sockaddr_in sa;
+//SHARD: put fd on port i of sh, for its acceptor. The old socket stops
+//listening now, and the acceptor closes it
+static void shard_swap(struct shard * sh, const int i, const int fd){
+  while(__atomic_load_n(&sh->stale[i], __ATOMIC_ACQUIRE) >= 0){
+    usleep(1000); //last swap isn't reaped yet
+  }
 
-  memset(&sa, 0, sizeof(struct sockaddr_in));
-  sa.sin_family       = AF_INET;
-  sa.sin_addr.s_addr  = htonl(INADDR_ANY);
+  const int old = __atomic_exchange_n(&sh->sfd[i], fd, __ATOMIC_ACQ_REL);
+  if(old >= 0){
+    shutdown(old, SHUT_RDWR);
+    __atomic_store_n(&sh->stale[i], old, __ATOMIC_RELEASE);
+  }
+  eventfd_write(sh->wake, 1);
+}
 
+//URING: accept on our ports, with a multishot accept on each. One SQE
+//stays armed, and each new connection comes as a CQE. A poll on wake
+//tells us a reload moved a port
+static int uring_accept(struct shard * sh, int * port){
+  struct uring * r = &sh->ring;
+  struct io_uring_cqe * cqe;
   int i;
-  for(i=0; i < 2; i++){
-    sa.sin_port = htons(cfg_port[i]);
 
-    sfd[i] = socket(AF_INET, SOCK_STREAM, 0);
-    if(sfd[i] == -1){
-      perror("socket");
+  if((r->fd < 0) && (uring_open(r, 8) < 0)){
+    uring_fallback(sh, "setup failed");
+    return -1;
+  }
+
+  while(1){
+    shard_reap(sh);
+    for(i=0; i < NPORTS; i++){
+      const int fd = __atomic_load_n(&sh->sfd[i], __ATOMIC_ACQUIRE);
+      if((fd < 0) || (sh->armed[i] == fd)){
+        continue;
+      }
+      struct io_uring_sqe * sqe = uring_sqe(r);
+      sqe->opcode    = IORING_OP_ACCEPT;
+      sqe->fd        = fd;
+      sqe->ioprio    = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = ((__u64) fd << 32) | i;
+      uring_push(r);
+      sh->armed[i] = fd;
+    }
+    if(!sh->wake_armed){
+      struct io_uring_sqe * sqe = uring_sqe(r);
+      sqe->opcode        = IORING_OP_POLL_ADD;
+      sqe->fd            = sh->wake;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data     = ((__u64) sh->wake << 32) | NPORTS;
+      uring_push(r);
+      sh->wake_armed = 1;
+    }
+
+    if(uring_wait(r, &cqe) < 0){
+      perror("io_uring_enter");
       return -1;
     }
+    i = cqe->user_data & 0xffffffff;
+    const int fd = cqe->user_data >> 32;
+    const int sd = cqe->res;
+    const int more = cqe->flags & IORING_CQE_F_MORE;
+    uring_seen(r);
+
+    if(i == NPORTS){  //woken, look at sfd[] again
+      sh->wake_armed = 0;
+      continue;
+    }
+    if(!more && (sh->armed[i] == fd)){  //accept is done, arm it again
+      sh->armed[i] = -1;
+    }
 
-    const int opt = 1;
-    setsockopt(sfd[i], SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+    if(sd >= 0){
+      if(i == 1){ //ACKs go out one by one, see peer_connect
+        const int opt = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+      }
+      log_msg(LOG_DEBUG, "[ACCEPTING] Socket descriptor %d\n", sd);
+      *port = i;
+      return sd;
+    }
 
-    if(bind(sfd[i], (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == -1){
-      perror("bind");
-      return -1;
+    if(fd != __atomic_load_n(&sh->sfd[i], __ATOMIC_ACQUIRE)){
+      continue; //accept on a socket a reload took off the port
     }
 
-    if (listen(sfd[i], 5) < 0 ) {
-      perror("listen");
+    //EINVAL on a socket that still listens, is a kernel before 5.19
+    int listening = 0;
+    socklen_t optlen = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen);
+    if((sd == -EINVAL) && listening){
+      uring_fallback(sh, "no multishot accept");
       return -1;
     }
 
-
-    if(cfg_debug){
-      printf("Using port %i on skt %d\n", cfg_port[i], sfd[i]);
+    if(sd == -EINTR){
+      continue;
     }
+    if((sd != -EINVAL) && (sd != -EBADF) && (sd != -ECANCELED)){  //when ports were closed
+      errno = -sd;
+      perror("accept");
+    }
+    return -1;
   }
-
-  return 0;
 }
 
-static void close_ports(){
+static int select_ports(struct shard * sh, int * port){
   int i;
 
-  for(i=0; i < 2; i++){
-    shutdown(sfd[i], SHUT_RDWR);
-    close(sfd[i]);
+  if(sh->io == IO_URING){
+    const int sd = uring_accept(sh, port);
+    if(sh->io == IO_URING){ //else it fell back, and we select
+      return sd;
+    }
   }
-}
-
-static int select_ports(){
-  int i;
-  const int nfds = ((sfd[0] > sfd[1]) ? sfd[0] : sfd[1]) + 1;
 
   struct timespec timeout;
   timeout.tv_sec = 5;
   timeout.tv_nsec = 0;
 
   while(1){
+    int sfd[NPORTS], nfds = sh->wake + 1;
 
+    //a reload can move our ports, select on what we have now
+    shard_reap(sh);
     fd_set rdfds;
     FD_ZERO(&rdfds);
-    FD_SET(sfd[0],  &rdfds);
-    FD_SET(sfd[1],  &rdfds);
+    FD_SET(sh->wake, &rdfds);
+    for(i=0; i < NPORTS; i++){
+      sfd[i] = __atomic_load_n(&sh->sfd[i], __ATOMIC_ACQUIRE);
+      if(sfd[i] >= 0){
+        FD_SET(sfd[i], &rdfds);
+        if(nfds <= sfd[i]){
+          nfds = sfd[i] + 1;
+        }
+      }
+    }
 
     const int rv = pselect(nfds, &rdfds, NULL, NULL, &timeout, NULL);
     if((rv < 0) && (errno != EINTR)){
-      perror("select");
+      if(errno != EBADF){ //EBADF, when ports were closed
+        perror("select");
+      }
       break;
 
     }else if(rv > 0){
 
-      for(i=0; i < 2; i++){
-        if(FD_ISSET(sfd[i], &rdfds)){
+      for(i=0; i < NPORTS; i++){
+        if((sfd[i] >= 0) && FD_ISSET(sfd[i], &rdfds)){
 
           const int sd = accept(sfd[i], NULL, NULL);
           if(sd == -1){
-            perror("accept");
+            if(sfd[i] != __atomic_load_n(&sh->sfd[i], __ATOMIC_ACQUIRE)){
+              continue; //a reload took it off the port
+            }
+            if((errno != EINVAL) && (errno != EBADF)){  //when ports were closed
+              perror("accept");
+            }
             return -1;
           }
 
-          if(cfg_debug){
-            printf("[ACCEPTING] Socket descriptor %d\n", sd);
+          if(i == 1){ //ACKs go out one by one, see peer_connect
+            const int opt = 1;
+            setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
           }
+
+          log_msg(LOG_DEBUG, "[ACCEPTING] Socket descriptor %d\n", sd);
+          *port = i;
           return sd; //return index of socket
         }
       }
@@ -1245,16 +5782,29 @@ static int pidfile_test(){
   return 1;  //process is running
 }
 
-static int startup(){
+//SIGNAL: the signals sig_thread reads from sigfd
+static void sig_set(sigset_t * set){
+  sigemptyset(set);
+  sigaddset(set, SIGHUP);
+  sigaddset(set, SIGQUIT);
+}
+
+static int MAIN_ONLY startup(){
+  sigset_t set;
 
   umask(0177);
 
-  signal(SIGHUP,  sig_handler);
-  signal(SIGQUIT, sig_handler);
+  //blocked before any thread starts, so all of them leave these to sig_thread
+  sig_set(&set);
+  if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0){
+    perror("pthread_sigmask");
+    return -1;
+  }
   signal(SIGTERM, SIG_IGN);
   signal(SIGINT,  SIG_IGN);
   signal(SIGALRM, SIG_IGN);
   signal(SIGSTOP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN); //client gone, replies fail with EPIPE
 
   if(cfg_daemon){
 
@@ -1265,7 +5815,7 @@ static int startup(){
 
     int i;
     for (i = 0; i < getdtablesize(); i++){
-      if ((sfd[0] != i) && (sfd[1] != i)){
+      if (!is_port_fd(i)){
         close(i);
       }
     }
@@ -1299,68 +5849,362 @@ static int startup(){
   return 0;
 }
 
-static int config_reload(){
+//CONFIG: is string setting a different from b, NULL if not set
+static int config_changed(const char * a, const char * b){
+  return (a == NULL) ? (b != NULL) : ((b == NULL) || (strcmp(a, b) != 0));
+}
 
-  if( (config_file("bbserv.conf") < 0) ||
-      (open_ports() < 0) ||
-      (thr_preallocate(cfg_max_threads) < 0) ||
-      (bulletin_open(cfg_bulletin_file, cfg_daemon) < 0)){
+//CONFIG: move TCP port i of all shards to cfg_port[i]. On failure the old
+//sockets stay, and so does old_port
+static int reload_port(const int i, const int old_port){
+  int j, * fds = (int *) malloc(nshards * sizeof(int));
+  if(fds == NULL){
+    perror("malloc");
+    cfg_port[i] = old_port;
     return -1;
-  }else{
-    return 0;
   }
-}
 
-static int before_exit(){
-  close_ports();
-  thr_deallocate();
-  bulletin_close();
-  psync_disconnect();
+  for(j=0; j < nshards; j++){
+    if((fds[j] = port_listen(cfg_port[i])) < 0){
+      log_msg(LOG_ERROR, "[RELOAD] can't open port %d, staying on %d\n", cfg_port[i], old_port);
+      while(--j >= 0){
+        close(fds[j]);
+      }
+      free(fds);
+      cfg_port[i] = old_port;
+      return -1;
+    }
+  }
 
-  if(cfg_peer)
-    free(cfg_peer);
+  for(j=0; j < nshards; j++){
+    shard_swap(&shards[j], i, fds[j]);
+  }
+  free(fds);
+  return 0;
+}
+
+//CONFIG: move Unix socket i (0 clients, 1 sync) of shard 0 to cfg_sock[i],
+//or close it if that is NULL. On failure the old socket stays
+static int reload_sock(const int i, char * old_path){
+  int fd = -1;
 
-  if(cfg_bulletin_file)
-    free(cfg_bulletin_file);
+  if(cfg_sock[i] && ((fd = unix_listen(cfg_sock[i])) < 0)){
+    log_msg(LOG_ERROR, "[RELOAD] can't open socket %s\n", cfg_sock[i]);
+    free(cfg_sock[i]);
+    cfg_sock[i] = old_path;
+    return -1;
+  }
 
+  shard_swap(&shards[0], 2 + i, fd);
+  if(old_path){
+    unlink(old_path);
+    free(old_path);
+  }
   return 0;
 }
 
-static void sig_handler(const int sign){
+//CONFIG: is list a[na] different from b[nb]
+static int config_list_changed(char ** a, const int na, char ** b, const int nb){
+  int i, changed = (na != nb);
 
-  before_exit();
+  for(i=0; (i < na) && (i < nb); i++){
+    changed |= config_changed(a[i], b[i]);
+  }
+  return changed;
+}
+
+//CONFIG: free what a reload parsed into c, and didn't take
+static void config_free(struct config * c){
+  int i;
+
+  for(i=0; i < c->nboards; i++){
+    free(c->board_file[i]);
+  }
+  for(i=0; i < c->nroutes; i++){
+    free(c->route[i]);
+  }
+  free(c->group);
+  free(c->trace_file);
+  free(c->sock[0]);
+  free(c->sock[1]);
+  free(c->peer);
+}
+
+//CONFIG: read bbserv.conf again, and apply what changed while we run.
+//Sessions, queued connections and 2PC writes go on; what bbserv.conf
+//doesn't change is not touched. It's parsed into a scratch config, with
+//no lock held, and nothing we run with changes until all of it parsed.
+//On errors we keep the config we have
+static int config_reload(){
+  struct config c;
+  const int ports[2] = {cfg_port[0], cfg_port[1]};
+  int i, changed = 0, rc = 0;
+
+  //ints it doesn't set stay. Sockets, faults and peers it doesn't set are off
+  config_get(&c);
+  memset(c.board_file, 0, sizeof(c.board_file));
+  c.nboards = 0;
+  memset(c.route, 0, sizeof(c.route));
+  c.nroutes = 0;
+  c.group = NULL;
+  c.trace_file = NULL;
+  c.sock[0] = c.sock[1] = NULL;
+  for(i=0; i < NINJECT; i++){
+    c.inject[i].delay = 0;
+    c.inject[i].fail = 0;
+  }
+  c.ninject = 0;
+  c.peer = NULL;
+  c.npeers = 0;
+
+  if(config_file("bbserv.conf", &c) < 0){
+    config_free(&c);
+    __atomic_fetch_add(&stat_reloads[1], 1, __ATOMIC_RELAXED);
+    log_msg(LOG_ERROR, "[RELOAD] bbserv.conf has errors, config not changed\n");
+    return -1;
+  }
+
+  for(i=0; i < NCFG_INTS; i++){
+    const struct cfg_int * ci = &cfg_ints[i];
+    int * val = config_int(&c, i);
+    if(*val == *ci->val){
+      continue;
+    }
+    if(ci->reload == RELOAD_RESTART){
+      log_msg(LOG_WARN, "[RELOAD] %s changes on restart, staying at %d\n", ci->name, *ci->val);
+      *val = *ci->val;
+      continue;
+    }
+    log_msg(LOG_INFO, "[RELOAD] %s %d -> %d\n", ci->name, *ci->val, *val);
+    changed |= ci->reload;
+  }
+
+  if((changed & RELOAD_POOL) && (c.max_threads < nshards)){  //each shard needs a worker
+    log_msg(LOG_WARN, "[RELOAD] THMAX is at least %d, one for each acceptor\n", nshards);
+    c.max_threads = nshards;
+  }
+
+  //boards are mapped, and their files point into our BBFILE strings, so
+  //we keep those. Boards stay on their groups
+  if(config_list_changed(c.board_file, c.nboards, cfg_board_file, cfg_nboards) && (c.nboards > 0)){
+    log_msg(LOG_WARN, "[RELOAD] BBFILE changes on restart, staying at %d boards\n", cfg_nboards);
+  }
+  if( config_list_changed(c.route, c.nroutes, cfg_route, cfg_nroutes) ||
+      config_changed(c.group, cfg_group) ){
+    log_msg(LOG_WARN, "[RELOAD] GROUP and ROUTE change on restart, staying at %d groups\n", ngroups);
+  }
+
+  //peers change between 2PC writes, which hold their board
+  boards_wrlock();
+  const int kept = config_peers_carry(c.peer, c.npeers, cfg_peer, cfg_npeers);
+  if((kept != cfg_npeers) || (kept != c.npeers)){
+    log_msg(LOG_INFO, "[RELOAD] PEERS %d -> %d, %d kept\n", cfg_npeers, c.npeers, kept);
+  }
+  if((c.npeers > 0) != (cfg_npeers > 0)){  //sync workers come or go
+    changed |= RELOAD_POOL;
+  }
+  struct peer * peer = cfg_peer;
+  pthread_mutex_lock(&peers_mutex);
+  cfg_peer = c.peer;
+  cfg_npeers = c.npeers;
+  pthread_mutex_unlock(&peers_mutex);
+  c.peer = peer;  //config_free frees the old ones
+
+  for(i=0; (changed & RELOAD_CACHE) && (i < nboards); i++){
+    if((boards[i].group == 0) && cache_resize(&boards[i].cache, c.cache_mem / nboards) < 0){
+      rc = -1;
+    }
+  }
+  boards_unlock();
+
+  //one store for each, so workers see the old value or the new one
+  for(i=0; i < NCFG_INTS; i++){
+    *cfg_ints[i].val = *config_int(&c, i);
+  }
+  for(i=0; i < NINJECT; i++){ //keep hits and fails
+    cfg_inject[i].delay = c.inject[i].delay;
+    cfg_inject[i].fail = c.inject[i].fail;
+  }
+  cfg_ninject = c.ninject;
+
+  if(config_changed(c.trace_file, cfg_trace_file)){ //else TRACE may be using it
+    char * trace_file = cfg_trace_file;
+    cfg_trace_file = c.trace_file;
+    c.trace_file = trace_file;
+  }
+
+  if((changed & RELOAD_POOL) && (thr_resize() < 0)){
+    rc = -1;
+  }
+
+  //a port we move stops listening, connections in its backlog are lost
+  for(i=0; i < 2; i++){
+    if((cfg_port[i] != ports[i]) && (reload_port(i, ports[i]) < 0)){
+      rc = -1;
+    }
+    if(config_changed(c.sock[i], cfg_sock[i])){
+      char * sock = cfg_sock[i];
+      cfg_sock[i] = c.sock[i];
+      c.sock[i] = NULL;
+      if(reload_sock(i, sock) < 0){
+        rc = -1;
+      }
+    }
+  }
 
-  switch(sign){
-    case SIGQUIT:
-      unlink(pid_fileame);
-      exit(EXIT_SUCCESS);
-    case SIGHUP:
-      if(config_reload() == -1){
-        unlink(pid_fileame);
-        exit(EXIT_FAILURE);
+  if(changed & RELOAD_BACKLOG){
+    int j;
+    for(i=0; i < nshards; i++){
+      for(j=0; j < NPORTS; j++){
+        if(shards[i].sfd[j] >= 0){
+          listen(shards[i].sfd[j], cfg_backlog);
+        }
       }
-      break;
-    default:
-      break;
+    }
+  }
+
+  if(changed & RELOAD_METRICS){
+    metrics_close();
+    if(metrics_open() < 0){
+      log_msg(LOG_ERROR, "[RELOAD] can't open metrics port %d\n", cfg_metrics_port);
+      rc = -1;
+    }
+  }
+  config_free(&c);
+
+  __atomic_fetch_add(&stat_reloads[(rc < 0) ? 1 : 0], 1, __ATOMIC_RELAXED);
+  log_msg((rc < 0) ? LOG_ERROR : LOG_INFO, "[RELOAD] bbserv.conf applied%s\n",
+    (rc < 0) ? ", with errors" : "");
+  return rc;
+}
+
+//SIGNAL: SIGHUP reloads the config, SIGQUIT shuts down our ports, so the
+//main thread leaves its accept loop and cleans up. Both come here as
+//reads, not as handlers, so reload is free to lock and allocate
+static void * sig_thread(void * arg){
+  struct signalfd_siginfo si;
+  int i, j;
+
+  while(read(sigfd, &si, sizeof(si)) == sizeof(si)){
+    if(si.ssi_signo == SIGHUP){
+      log_msg(LOG_INFO, "[RELOAD] SIGHUP, reading bbserv.conf\n");
+      config_reload();
+      continue;
+    }
+
+    for(i=0; i < nshards; i++){
+      for(j=0; j < NPORTS; j++){
+        if(shards[i].sfd[j] >= 0){
+          shutdown(shards[i].sfd[j], SHUT_RDWR);
+        }
+      }
+    }
+
+    //ROUTE: other groups keep their connections to us open, end those
+    //sessions after the request they run. Workers can then exit
+    for(i=0; i < MAX_SLOTS; i++){
+      struct context * ctx = tctx[i];
+      if(ctx && __atomic_load_n(&ctx->routed, __ATOMIC_ACQUIRE)){
+        shutdown(ctx->fd, SHUT_RD);
+      }
+    }
+    break;
+  }
+  return NULL;
+}
+
+static int MAIN_ONLY sig_open(){
+  sigset_t set;
+
+  sig_set(&set);
+  sigfd = signalfd(-1, &set, SFD_CLOEXEC);
+  if(sigfd == -1){
+    perror("signalfd");
+    return -1;
+  }
+
+  if(pthread_create(&sthread, NULL, sig_thread, NULL) != 0){
+    perror("pthread_create");
+    close(sigfd);
+    sigfd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void sig_close(){
+  if(sigfd < 0){
+    return;
+  }
+  pthread_kill(sthread, SIGQUIT); //if we got here another way, it still waits
+  pthread_join(sthread, NULL);
+  close(sigfd);
+  sigfd = -1;
+}
+
+static int MAIN_ONLY before_exit(){
+  int i;
+
+  sig_close();
+  metrics_close();
+  close_ports();
+  watch_close();  //before workers, the hub gives routed connections back to them
+  thr_deallocate();
+  boards_close();
+  groups_close();
+
+  free(cfg_peer);
+  cfg_peer = NULL;
+  cfg_npeers = 0;
+
+  for(i=0; i < cfg_nboards; i++){
+    free(cfg_board_file[i]);
+    cfg_board_file[i] = NULL;
   }
+  cfg_nboards = 0;
+
+  for(i=0; i < cfg_nroutes; i++){
+    free(cfg_route[i]);
+    cfg_route[i] = NULL;
+  }
+  cfg_nroutes = 0;
+  free(cfg_group);
+  cfg_group = NULL;
+
+  if(cfg_trace_file){
+    free(cfg_trace_file);
+    cfg_trace_file = NULL;
+  }
+
+  free(cfg_sock[0]);
+  free(cfg_sock[1]);
+  cfg_sock[0] = cfg_sock[1] = NULL;
+
+  log_close();
+
+  return 0;
 }
 
+#ifndef BBSERV_NO_MAIN  //bbstore.c has its own
 int main(const int argc, char * argv[]){
 
-  if( (config_file("bbserv.conf") == -1) ||
+  if( (config_load("bbserv.conf") == -1) ||
       (config_argv(argc, argv) == -1) ){
     return EXIT_FAILURE;
   }
 
   if( (open_ports() == -1)  ||  (startup() == -1) ||
-      (thr_preallocate() == -1) || (bulletin_open() == -1)){
+      (thr_preallocate() == -1) || (groups_open() == -1) ||
+      (boards_open() == -1) || (watch_open() == -1) || (metrics_open() == -1) ||
+      (log_open() == -1) || (shard_start() == -1) ||
+      (sig_open() == -1)){
     return EXIT_FAILURE;
   }
 
-  int sd;
-  while((sd = select_ports()) > 0){
+  int sd, port;
+  while((sd = select_ports(&shards[0], &port)) > 0){
 
-    if(bb_push(sd) < 0){
+    if(bb_push(&shards[0], sd, port & 1) < 0){
       close(sd);
       break;
     }
@@ -1370,3 +6214,4 @@ int main(const int argc, char * argv[]){
   unlink(pid_fileame);
   return 0;
 }
+#endif
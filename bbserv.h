@@ -1,23 +1,193 @@
 #include <pthread.h>
 #include <arpa/inet.h>  //for sockaddr_in
-
-//debug times for read/write
-#define DEBUG_TIME_RD 3
-#define DEBUG_TIME_WR 6
+#include <sys/un.h>     //for sockaddr_un
+#include <linux/io_uring.h>
 
 //max sizes for user, message and line
 #define MAX_USR_LEN 20
 #define MAX_MSG_LEN 200
 #define MAX_LINE_LEN 250
 
+//size of a rendered reply line, fits "2.0 MESSAGE n usr/msg\n"
+#define CACHE_LINE_LEN 256
+
+//max records in one READRANGE/MREAD reply
+#define MAX_RANGE_LEN 1000
+
+//max messages in one BEGIN/COMMIT batch
+#define MAX_BATCH_LEN 1000
+
+//max length of an indexed term, longer words are cut
+#define MAX_TERM_LEN 32
+
+//max output a watcher can fall behind, before we drop it
+#define MAX_WATCH_BUF (64*1024)
+
 //Max size of request bounded buffer
 #define MAX_RBB_LEN 100
+//Max BBFILE entries, boards one server keeps
+#define MAX_BOARDS 16
+//Max replica groups of a partitioned cluster, our GROUP and one per ROUTE
+#define MAX_GROUPS 16
+//points each group has on the hash ring
+#define RING_POINTS 64
+//Max ROUTEIDLE, connections we keep open to each group
+#define MAX_ROUTE_IDLE 64
+//Max THMAX, size of the worker context table
+#define MAX_WORKERS 1024
+#define MAX_SLOTS (2 * MAX_WORKERS)  //THMAX, and a sync worker for each shard
 #define MAX_CMD_ARGS 10
 
+//latency histogram buckets, bucket i counts up to 2^(i+10) ns, last is the rest
+#define STAT_HIST_LEN 24
+
+//commands we time
+#define ST_USER       0
+#define ST_READ       1
+#define ST_READRANGE  2
+#define ST_MREAD      3
+#define ST_SEARCH     4
+#define ST_LISTUSER   5
+#define ST_WRITE      6
+#define ST_REPLACE    7
+#define ST_BEGIN      8
+#define ST_COMMIT     9
+#define ST_ABORT      10
+#define ST_STATS      11
+#define ST_WATCH      12
+#define ST_SYNC_ON    13
+#define ST_SYNC_OFF   14
+#define ST_SYNC_ABORT 15
+#define ST_SYNC_WRITE 16
+#define ST_SYNC_REPLACE 17
+#define ST_TRACE      18
+#define ST_BOARD      19
+#define ST_ROUTE      20
+#define ST_INVALID    21
+#define NSTAT_CMDS    22
+
+//2PC phases, timed for each peer
+#define PHASE_CONNECT 0
+#define PHASE_PREPARE 1   //SYNC_ON
+#define PHASE_WRITE   2   //SYNC_WRITE, SYNC_REPLACE
+#define PHASE_FINISH  3   //SYNC_OFF, SYNC_ABORT
+#define NPHASES       4
+
+//spans kept by each thread for TRACE, a power of 2
+#define TRACE_RING_LEN 4096
+
+//steps of a 2PC write we trace
+#define TR_COMMIT       0   //all of bulletin_commit, on coordinator
+#define TR_LOCK_WAIT    1
+#define TR_CONNECT      2
+#define TR_PREPARE      3
+#define TR_WRITE        4
+#define TR_LOCAL_WRITE  5
+#define TR_FINISH       6
+#define TR_SYNC_ON      7   //lock wait, on peer
+#define TR_SYNC_WRITE   8
+#define TR_SYNC_REPLACE 9
+#define TR_SYNC_OFF     10
+#define TR_SYNC_ABORT   11
+#define TR_SYNC_LOCKED  12  //from SYNC_ON to SYNC_OFF/SYNC_ABORT
+#define NTRACE          13
+
+struct span {   //one timed step
+  unsigned int seq;     //odd while it is written
+  int name;
+  unsigned long id;     //correlation id, the same on all peers
+  long long start, dur; //in ns
+};
+
+struct trace_ring {   //written by one thread, read by TRACE
+  unsigned long head; //spans ever written
+  int tid;
+  struct span spans[TRACE_RING_LEN];
+};
+
+//log levels
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+//lines each thread can queue for the log writer, a power of 2
+#define LOG_RING_LEN 256
+#define LOG_LINE_LEN 240
+
+struct log_entry {
+  long long ts;   //wall clock, in ns
+  int level;
+  char line[LOG_LINE_LEN];
+};
+
+struct log_ring {     //lines of one thread, drained by log writer
+  unsigned long head, tail;
+  int tid;
+  int dead;           //thread is gone, free ring once drained
+  unsigned long dropped;  //ring full or over rate
+
+  double tokens;      //rate limit, in lines
+  long long refill;   //when we last added tokens
+
+  struct log_ring * next;
+  struct log_entry lines[LOG_RING_LEN];
+};
+
+//sites where INJECT can add delays and failures
+#define INJ_READ        0
+#define INJ_WRITE       1
+#define INJ_REPLACE     2
+#define INJ_SYNC_ON     3   //on peer
+#define INJ_SYNC_WRITE  4
+#define INJ_SYNC_OFF    5
+#define INJ_PEER_SEND   6   //on coordinator
+#define INJ_PEER_RECV   7
+#define NINJECT         8
+
+struct inject {   //what we do at a site
+  long long delay;    //in ns
+  unsigned int fail;  //chance of failure, in parts per million
+  unsigned long hits, fails;
+};
+
+struct stat_hist {  //latency histogram
+  unsigned long counts[STAT_HIST_LEN];
+  unsigned long count;
+  unsigned long sum_ns, max_ns;
+};
+
+struct thread_stats { //written by one thread, read by STATS
+  struct stat_hist cmds[NSTAT_CMDS];
+  unsigned long errors[NSTAT_CMDS];
+  struct stat_hist rdlock, wrlock;  //board lock waits
+};
+
 struct peer {
   struct sockaddr_in inaddr;  //IP, port
+  struct sockaddr_un unaddr;  //path, if sun_family is AF_UNIX
+  struct stat_hist phases[NPHASES]; //of all boards
+};
+
+struct peer_conn {  //our connection to a peer, in one 2PC write
   int fd;
-  int rv;
+  int nreplies;   //replies in current phase
+};
+
+struct group {    //replica group of a partitioned cluster
+  char * name;
+  struct peer * nodes;  //its servers, from ROUTE. None for our own group,
+  int nnodes;           //whose servers are PEERS
+
+  pthread_mutex_t mutex;
+  int idle[MAX_ROUTE_IDLE];       //open connections to its nodes, not in use
+  int idle_node[MAX_ROUTE_IDLE];  //and the node of each
+  int nidle;
+};
+
+struct ring_point { //consistent hashing: a board goes to the group of
+  unsigned int hash;  //the first point at or after its hash
+  int group;
 };
 
 struct cmd {
@@ -31,28 +201,261 @@ struct bulletin_item {
   char msg[MAX_MSG_LEN+1];
 };
 
+//how we accept and read connections
+#define IO_CLASSIC  0   //select, accept and recv
+#define IO_URING    1   //io_uring, if kernel has it
+
+//connection read buffer
+#define CONN_BUF_LEN 4096
+
+struct uring {  //io_uring, used by one thread
+  int fd;       //-1 if not open
+  void * ring;  //SQ and CQ ring, in one mapping
+  size_t ring_len;
+  struct io_uring_sqe * sqes;
+  size_t sqes_len;
+  unsigned * sq_head, * sq_tail, * sq_array;
+  unsigned sq_mask, sq_entries;
+  unsigned * cq_head, * cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe * cqes;
+  unsigned pending; //SQEs not submitted yet
+};
+
+//rate limits, a table of NRATE_SHARDS shards, RATE_SLOTS buckets each
+#define NRATE_SHARDS  16
+#define RATE_SLOTS    256
+#define RATE_READ     0
+#define RATE_WRITE    1
+
+struct rate_bucket {  //token bucket of one user or IP, as GCRA
+  unsigned long key;  //hash of user or IP, 0 if free
+  long long tat[2];   //when bucket is full again, in ns, for RATE_READ/RATE_WRITE
+};
+
+struct rate_shard {   //buckets of a part of the keys, under one lock
+  pthread_mutex_t mutex;
+  struct rate_bucket slots[RATE_SLOTS];
+};
+
+//states of a worker slot
+#define THR_FREE    0
+#define THR_RUNNING 1
+#define THR_EXITED  2   //retired when idle, not joined yet
+
 struct context { //thread context
   pthread_t thread;
+  int state;      //THR_*, under rbb.mutex of our shard
+  int shard;
+  int slot;       //our index in tctx, we exit if a reload takes THMAX below it
   int fd;
   int sync_on;
+  int routed;       //session of a server that routes its requests to us
+  struct bulletin_board * board;      //BOARD of the session
+  struct bulletin_board * sync_board; //locked by our SYNC_ON
   struct bulletin_item rec;
   char line[MAX_LINE_LEN + 1];
+
+  struct uring ring;          //for recv, if IO=uring
+  char in[CONN_BUF_LEN];      //what we read, but didn't parse yet
+  int in_pos, in_len;
+
+  char ** batch;    //messages queued after BEGIN, NULL if not in batch
+  int batch_len;
+
+  struct thread_stats stats;
+  struct trace_ring * trace;  //NULL if tracing is off
+
+  unsigned long trace_id;     //of the SYNC_ON we are in
+  long long sync_start;
+
+  int prio;             //fd came from the sync port, PRIO_RESUME if from the watch hub
+  int rd_timeout;       //ms a read can wait on fd, 0 is no limit
+  unsigned int addr;    //client IPv4, for rate limits
+  long long queued;     //ns fd waited in queue
 };
 
+#define PRIO_RESUME 2  //a routed connection parked between requests, greeted before
+
 struct bounded_buf {
   int in,out,count;
   int fds[MAX_RBB_LEN];
+  long long when[MAX_RBB_LEN];  //when fd was queued, in ns
+  char prio[MAX_RBB_LEN];       //sync port fds, queued at head
 
   pthread_mutex_t mutex;
   pthread_cond_t  empty, full;
+
+  //elastic worker pool, under mutex
+  pthread_t manager;
+  int managed;          //manager is running, THMIN < our slots at some point
+  pthread_cond_t grow;  //wakes manager, fds wait with no idle worker
+  int stop;
+  int nthreads;         //running workers
+  int idle;             //workers waiting in bb_pop
+  unsigned long grown, shrunk;
+  unsigned long steals;   //fds our workers took from other shards
+  int clients;            //workers serving client port fds
+  unsigned long shed;     //turned away, queue was at BACKLOG
+  unsigned long late;     //turned away, waited over QUEUEDEADLINE
+  struct stat_hist wait;  //time fds spent queued
+};
+
+//listening sockets of a shard: client and sync TCP ports, then client and
+//sync Unix sockets (shard 0 only). Odd ones are sync
+#define NPORTS 4
+
+struct shard {  //acceptor, with its own queue and workers
+  struct bounded_buf rbb;
+  int sfd[NPORTS];    //sockets for our ports, SO_REUSEPORT if many shards. -1 if not open
+  pthread_t acceptor; //shard 0 accepts from main thread
+  int cpu;            //we pin acceptor and workers here, -1 if we don't
+  int nslots;         //our worker slots, tctx[i] with i % nshards our index
+  int min;            //our share of THMIN
+
+  int io;             //IO_*, we drop to IO_CLASSIC if io_uring fails
+  struct uring ring;  //multishot accepts, if IO=uring
+  int armed[NPORTS];  //fd whose accept is in the ring, -1 if none
+  int wake_armed;     //poll on wake is in the ring
+
+  //a reload moves a port by putting a new socket in sfd[]. It shuts the
+  //old one down and leaves it in stale[], for the acceptor to close, so
+  //no fd number is reused under a select or accept
+  int stale[NPORTS];
+  int wake;           //eventfd, written when sfd[] changed
+};
+
+//what a reload does, when a setting changed
+#define RELOAD_NOW      0   //just use the new value
+#define RELOAD_RESTART  1   //can't change while running, keep the old one
+#define RELOAD_POOL     2   //resize worker pool
+#define RELOAD_BACKLOG  4   //listen() again on our sockets
+#define RELOAD_METRICS  8   //reopen metrics port
+#define RELOAD_CACHE   16   //resize reply cache
+#define RELOAD_PORT    32   //move a port to a new socket
+
+struct cfg_int {  //int setting, as a reload sees it
+  int * val;
+  size_t off;     //of it in struct config
+  const char * name;
+  int reload;     //RELOAD_*
+};
+
+struct config {   //what bbserv.conf sets. A reload parses into one, then applies it
+  int port[2];
+  int max_threads, min_threads, queue_wait, idle_time, acceptors, io, backlog;
+  int queue_deadline, read_timeout, write_timeout, sync_read_timeout, sync_write_timeout;
+  int user_rate[2], ip_rate[2];
+  int daemon, debug, cache_mem, metrics_port, trace, log_level, log_rate, route_idle;
+  unsigned int inject_seed;
+  struct inject inject[NINJECT];
+  int ninject;
+  char * board_file[MAX_BOARDS];
+  int nboards;
+  char * group;
+  char * route[MAX_GROUPS];
+  int nroutes;
+  char * sock[2];
+  char * trace_file;
+  struct peer * peer;
+  unsigned int npeers;
+};
+
+struct cache_entry {
+  int num;            //post number, 0 if entry is free
+  unsigned int ver;   //post version, when line was rendered
+  int next;           //next entry in hash chain, -1 on end
+  int ref;            //CLOCK reference bit
+  int len;            //length of line
+  char line[CACHE_LINE_LEN];
 };
 
-struct bulletin_board {
+struct reply_cache {  //rendered READ replies, by post number
+  pthread_mutex_t mutex;
+  int size;           //number of entries, 0 if cache is off
+  int used;           //entries in use
+  int hand;           //CLOCK hand
+  int * buckets;      //first entry of each hash chain
+  struct cache_entry * entries;
+
+  unsigned long hits, misses, evictions, invalidations;
+};
+
+struct undo_rec {
+  int index;                  //slot that was changed
+  int write;                  //1 if slot was written, 0 if replaced
+  struct bulletin_item item;  //old record, on replace
+};
+
+struct undo_log {   //changes of current transaction, for revert
+  int len, size;
+  struct undo_rec * recs;
+};
+
+struct posting {   //a term and the posts it is in
+  char * term;
+  int * nums;         //sorted post numbers
+  int len, size;
+  struct posting * next;  //next in hash chain
+};
+
+struct term_index { //inverted index, term to posts
+  int nbuckets;       //power of 2
+  int nterms;
+  struct posting ** buckets;
+};
+
+struct watcher {    //connection parked by WATCH, or by ROUTE between requests
+  int fd;
+  const struct bulletin_board * board;  //whose posts it gets, NULL if ROUTE
+  int pos;            //position in watch_hub.watchers
+  unsigned long since;  //first published post it gets
+  char * out;         //pending output
+  int len;
+};
+
+struct watch_post {
+  struct bulletin_board * board;
+  int num;
+};
+
+struct watch_hub {  //pushes new posts to watchers, from one thread
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int efd;            //eventfd, wakes the thread
+  int epfd;           //epoll on watcher sockets
+  int stop;
+
+  struct watch_post * queue;  //posts to publish
+  int qlen, qsize;
+  unsigned long published;  //posts ever queued
+
+  struct watcher ** added;  //registered, not yet seen by thread
+  int nadded, addsize;
+
+  struct watcher ** watchers; //owned by thread
+  int nwatchers, size;
+  int nparked;        //of them, routed connections
+};
+
+struct bulletin_board {  //one BBFILE, with its own lock and 2PC writes
+  char * name;            //for BOARD and SYNC_ON
+  const char * file;
+  int group;              //replica group that owns us, 0 is ours
   pthread_rwlock_t rwlock;
   int board_len;
   int board_size;
 
   int fd;                         //file descriptor
-  struct bulletin_item * items;   //mmaped to file
+  struct bulletin_item * items;   //mmaped to file, cold payload
+
+  //hot index, kept apart from items. Slot i of each array describes
+  //items[i], so the slot is also the offset of the cold record
+  int * nums;             //record numbers, 0 if slot is free
+  unsigned int * vers;    //record versions, bumped on every change
 
+  struct reply_cache cache;
+  struct undo_log undo;
+  struct term_index words;  //msg words to posts
+  struct term_index users;  //usr to posts
 };
@@ -0,0 +1,397 @@
+//Storage engine microbenchmark. Builds the bulletin_* functions of bbserv,
+//without main() and without the network, and times them on boards of
+//different sizes, with different reader/writer thread counts.
+
+#define BBSERV_NO_MAIN
+#include "bbserv.c"
+
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+//glibc entry points, so we can count allocations of the engine
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t n, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static unsigned long allocs = 0;
+
+void * malloc(size_t size){
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void * calloc(size_t n, size_t size){
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void * realloc(void * ptr, size_t size){
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+#define MAX_SIZES 16
+#define MAX_THREADS 64
+
+struct sample {   //counters at start of a run
+  long long ns;
+  unsigned long allocs;
+  long minflt, majflt;
+  long long misses;
+};
+
+struct worker {
+  pthread_t thread;
+  unsigned int seed;
+  int writer;
+  unsigned long ops;
+};
+
+static int bench_sizes[MAX_SIZES] = {10, 1000, 100000};
+static int bench_nsizes = 3;
+static int bench_readers = 1;
+static int bench_writers = 0;
+static int bench_secs = 2;
+static int bench_json = 0;
+
+static char bench_file[] = "/tmp/bbstore.XXXXXX";
+static struct bulletin_board * bench_board = &boards[0];
+static volatile int bench_running = 0;
+static volatile int bench_sink;   //keeps the compiler from dropping searches
+static int perf_fd = -1;  //cache misses of all our threads
+
+static const char * words[] = {"alpha", "beta", "gamma", "delta", "epsilon",
+  "zeta", "eta", "theta", "iota", "kappa", "lambda", "mu"};
+
+//PERF: count cache misses of this thread and threads it creates later
+static void perf_open(){
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(struct perf_event_attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(struct perf_event_attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if(perf_fd < 0){
+    fprintf(stderr, "perf_event_open: %s, cache misses are not counted\n", strerror(errno));
+  }
+}
+
+static long long perf_read(){
+  long long count = 0;
+  if((perf_fd < 0) || (read(perf_fd, &count, sizeof(count)) != sizeof(count))){
+    return -1;
+  }
+  return count;
+}
+
+static void sample_take(struct sample * s){
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  s->minflt = ru.ru_minflt;
+  s->majflt = ru.ru_majflt;
+  s->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+  s->misses = perf_read();
+  s->ns = now_ns();
+}
+
+//print results of a run, from sample s to now
+static void report(const char * name, const int size, const unsigned long ops, const struct sample * s){
+  struct sample e;
+  sample_take(&e);
+
+  const double secs = (e.ns - s->ns) / 1e9;
+  const double per_op = ops ? 1.0 / ops : 0.0;
+  const long long misses = ((s->misses < 0) || (e.misses < 0)) ? -1 : (e.misses - s->misses);
+
+  if(bench_json){
+    printf("{\"op\":\"%s\",\"board\":%d,\"readers\":%d,\"writers\":%d,\"ops\":%lu,"
+      "\"secs\":%.6f,\"ops_per_s\":%.1f,\"allocs_per_op\":%.3f,\"minflt\":%ld,\"majflt\":%ld,"
+      "\"cache_misses_per_op\":%.2f}\n",
+      name, size, bench_readers, bench_writers, ops, secs, ops / secs,
+      (e.allocs - s->allocs) * per_op, e.minflt - s->minflt, e.majflt - s->majflt,
+      (misses < 0) ? -1.0 : misses * per_op);
+  }else{
+    printf("%-12s %10d %10lu %12.0f %10.3f %8ld %8ld ", name, size, ops, ops / secs,
+      (e.allocs - s->allocs) * per_op, e.minflt - s->minflt, e.majflt - s->majflt);
+    if(misses < 0){
+      printf("%10s\n", "n/a");
+    }else{
+      printf("%10.2f\n", misses * per_op);
+    }
+  }
+}
+
+//fill board file with size records, like bulletin_write would
+static int board_fill(const int size){
+  struct bulletin_item item;
+  unsigned int seed = size;
+  int i, j;
+
+  const int fd = open(bench_file, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if(fd < 0){
+    perror("open");
+    return -1;
+  }
+
+  //slot 0 is never used, and leave room for 10 more
+  if(ftruncate(fd, (size + 11) * sizeof(struct bulletin_item)) < 0){
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+
+  for(i=1; i <= size; i++){
+    memset(&item, 0, sizeof(struct bulletin_item));
+    item.num = i;
+    snprintf(item.usr, MAX_USR_LEN, "user%d", rand_r(&seed) % 1000);
+
+    int len = 0;
+    for(j=0; j < 8; j++){
+      len += snprintf(&item.msg[len], MAX_MSG_LEN - len, "%s%d ",
+        words[rand_r(&seed) % 12], rand_r(&seed) % 100);
+    }
+
+    if(pwrite(fd, &item, sizeof(struct bulletin_item), i * sizeof(struct bulletin_item)) < 0){
+      perror("pwrite");
+      close(fd);
+      return -1;
+    }
+  }
+
+  close(fd);
+  return 0;
+}
+
+//READ without the socket: search and render, under read lock
+static void op_read(const int num, char * buf){
+  pthread_rwlock_rdlock(&bench_board->rwlock);
+  const int index = bulletin_search(bench_board, num);
+  if(index >= 0){
+    bulletin_render(bench_board, index, buf);
+  }
+  pthread_rwlock_unlock(&bench_board->rwlock);
+}
+
+//WRITE or REPLACE, as a transaction of its own
+static void op_write(const int num){
+  pthread_rwlock_wrlock(&bench_board->rwlock);
+  bulletin_begin(bench_board);
+  if(num == 0){
+    bulletin_write(bench_board, "bench", "bench alpha beta written");
+  }else{
+    bulletin_replace(bench_board, num, "bench", "bench gamma delta replaced");
+  }
+  bulletin_publish(bench_board);  //commit, as bulletin_commit does
+  pthread_rwlock_unlock(&bench_board->rwlock);
+}
+
+static void * worker_thread(void * arg){
+  struct worker * w = (struct worker *) arg;
+  char buf[CACHE_LINE_LEN];
+
+  while(bench_running){
+    const int num = 1 + rand_r(&w->seed) % bench_board->board_len;
+    if(w->writer){
+      //half new posts, half replaces
+      op_write((rand_r(&w->seed) & 1) ? num : 0);
+    }else{
+      op_read(num, buf);
+    }
+    w->ops++;
+  }
+  return NULL;
+}
+
+//run readers and writers for bench_secs
+static void run_mixed(const int size){
+  struct worker workers[MAX_THREADS];
+  struct sample s;
+  int i;
+
+  const int n = bench_readers + bench_writers;
+  memset(workers, 0, sizeof(workers));
+
+  sample_take(&s);
+  bench_running = 1;
+  for(i=0; i < n; i++){
+    workers[i].seed = i + 1;
+    workers[i].writer = (i >= bench_readers);
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+
+  sleep(bench_secs);
+  bench_running = 0;
+
+  unsigned long rd = 0, wr = 0;
+  for(i=0; i < n; i++){
+    pthread_join(workers[i].thread, NULL);
+    if(workers[i].writer){
+      wr += workers[i].ops;
+    }else{
+      rd += workers[i].ops;
+    }
+  }
+
+  report(bench_writers ? "mixed" : "read", size, rd + wr, &s);
+  if(bench_writers && bench_readers && !bench_json){
+    printf("%-12s %10s %10lu reads, %lu writes\n", "", "", rd, wr);
+  }
+}
+
+static int run_size(const int size){
+  struct sample s;
+  char buf[CACHE_LINE_LEN];
+  unsigned int seed = 1;
+  int i;
+
+  if(board_fill(size) < 0){
+    return -1;
+  }
+
+  //map, hot index and word/user indexes
+  sample_take(&s);
+  if(bulletin_open(bench_board, cfg_cache_mem) < 0){
+    return -1;
+  }
+  report("map", size, 1, &s);
+
+  //loops that are short on small boards, long enough to time
+  const int loops = 1000000;
+
+  sample_take(&s);
+  for(i=0; i < loops; i++){
+    bench_sink = bulletin_search(bench_board, 1 + rand_r(&seed) % size);
+  }
+  report("search", size, loops, &s);
+
+  //a number we don't have, scans the whole hot index
+  const int scans = (size > 100000) ? 100 : 10000;
+  sample_take(&s);
+  for(i=0; i < scans; i++){
+    bench_sink = bulletin_search(bench_board, size + 1000);
+  }
+  report("search_miss", size, scans, &s);
+
+  sample_take(&s);
+  for(i=0; i < loops; i++){
+    op_read(1 + rand_r(&seed) % size, buf);
+  }
+  report("read", size, loops, &s);
+
+  const int writes = 10000;
+  sample_take(&s);
+  for(i=0; i < writes; i++){
+    op_write(1 + rand_r(&seed) % size);
+  }
+  report("replace", size, writes, &s);
+
+  sample_take(&s);
+  for(i=0; i < writes; i++){
+    op_write(0);
+  }
+  report("write", size, writes, &s);
+
+  const int remaps = 1000;
+  sample_take(&s);
+  pthread_rwlock_wrlock(&bench_board->rwlock);
+  for(i=0; i < remaps; i++){
+    bulletin_remap(bench_board);
+  }
+  pthread_rwlock_unlock(&bench_board->rwlock);
+  report("remap", size, remaps, &s);
+
+  //write and undo it, like a SYNC_ABORT
+  sample_take(&s);
+  for(i=0; i < writes; i++){
+    pthread_rwlock_wrlock(&bench_board->rwlock);
+    bulletin_begin(bench_board);
+    bulletin_write(bench_board, "bench", "bench reverted");
+    bulletin_revert(bench_board);
+    pthread_rwlock_unlock(&bench_board->rwlock);
+  }
+  report("revert", size, writes, &s);
+
+  run_mixed(size);
+
+  bulletin_close(bench_board);
+  return 0;
+}
+
+static int config_sizes(char * str){
+  char * save_ptr;
+  char * tok = strtok_r(str, ",", &save_ptr);
+
+  bench_nsizes = 0;
+  while(tok && (bench_nsizes < MAX_SIZES)){
+    bench_sizes[bench_nsizes] = stoi(tok);
+    if(bench_sizes[bench_nsizes] <= 0){
+      return -1;
+    }
+    bench_nsizes++;
+    tok = strtok_r(NULL, ",", &save_ptr);
+  }
+  return (bench_nsizes > 0) ? 0 : -1;
+}
+
+int main(const int argc, char * argv[]){
+  int opt, i;
+
+  while((opt = getopt(argc, argv, "n:r:w:d:j")) > 0){
+    switch(opt){
+      case 'n':
+        if(config_sizes(optarg) < 0){
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'r': bench_readers = stoi(optarg);  break;
+      case 'w': bench_writers = stoi(optarg);  break;
+      case 'd': bench_secs = stoi(optarg);     break;
+      case 'j': bench_json = 1;                break;
+      default:
+        fprintf(stderr, "Usage: %s [-n size,size,...] [-r readers] [-w writers] [-d seconds] [-j]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if( (bench_readers < 0) || (bench_writers < 0) || (bench_secs <= 0) ||
+      ((bench_readers + bench_writers) == 0) ||
+      ((bench_readers + bench_writers) > MAX_THREADS) ){
+    fprintf(stderr, "Error: need 1 to %d reader/writer threads\n", MAX_THREADS);
+    return EXIT_FAILURE;
+  }
+
+  const int fd = mkstemp(bench_file);
+  if(fd < 0){
+    perror("mkstemp");
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  bench_board->file = bench_file;
+  perf_open();
+
+  if(!bench_json){
+    printf("%-12s %10s %10s %12s %10s %8s %8s %10s\n",
+      "op", "board", "ops", "ops/s", "allocs/op", "minflt", "majflt", "misses/op");
+  }
+
+  int rv = EXIT_SUCCESS;
+  for(i=0; i < bench_nsizes; i++){
+    if(run_size(bench_sizes[i]) < 0){
+      rv = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  unlink(bench_file);
+  return rv;
+}
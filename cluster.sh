@@ -0,0 +1,186 @@
+#!/bin/sh
+# Starts clusters of bbserv on loopback, from first to max nodes, drives
+# WRITE load through them with bbbench, and reports commit latency and
+# throughput for each peer count.
+#
+# Peer links can go through bbproxy, to add delay or drop connections.
+# Delays and drops are comma lists, entry i is for SYNC traffic going
+# into node i, e.g. -D 0,5,20 delays commits to node 1 by 5ms each way.
+# With -U peers sync over Unix sockets, and -u bbbench connects over one.
+
+usage(){
+  echo "Usage: $0 [-n max_nodes] [-f first_nodes] [-d seconds] [-c connections]" >&2
+  echo "          [-m read:write:replace] [-D delays_ms] [-X drops_percent] [-a] [-u] [-U]" >&2
+  echo "          [-o results.json]" >&2
+  echo "  -a  drive load through all nodes, not just the first one" >&2
+  echo "  -u  bbbench connects to BBSOCK, not to BBPORT" >&2
+  echo "  -U  peers sync over SYNCSOCK, not over SYNCPORT (no -D or -X)" >&2
+  exit 1
+}
+
+NODES=3
+FIRST=1
+DURATION=5
+CONNS=4
+MIX=0:100:0
+DELAYS=""
+DROPS=""
+ALL=0
+OUT=""
+UDS=0
+SYNCUDS=0
+
+while getopts "n:f:d:c:m:D:X:ao:uU" opt; do
+  case $opt in
+    n) NODES=$OPTARG ;;
+    f) FIRST=$OPTARG ;;
+    d) DURATION=$OPTARG ;;
+    c) CONNS=$OPTARG ;;
+    m) MIX=$OPTARG ;;
+    D) DELAYS=$OPTARG ;;
+    X) DROPS=$OPTARG ;;
+    a) ALL=1 ;;
+    o) OUT=$OPTARG ;;
+    u) UDS=1 ;;
+    U) SYNCUDS=1 ;;
+    *) usage ;;
+  esac
+done
+
+# bbproxy only speaks TCP
+if [ $SYNCUDS -eq 1 ] && { [ -n "$DELAYS" ] || [ -n "$DROPS" ]; }; then
+  usage
+fi
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+for prog in bbserv bbbench bbproxy; do
+  if [ ! -x "$BIN/$prog" ]; then
+    echo "Error: $BIN/$prog is missing, run make first" >&2
+    exit 1
+  fi
+done
+
+BBPORT=9500     # client port of node i is BBPORT+i
+SYNCPORT=10500  # sync port of node i is SYNCPORT+i
+PROXYPORT=11500 # proxy to sync port of node i is PROXYPORT+i
+
+WORK=$(mktemp -d /tmp/bbcluster.XXXXXX)
+PIDS=""
+
+# bbserv ignores SIGTERM, and its data is thrown away anyway
+cleanup(){
+  [ -n "$PIDS" ] && kill -9 $PIDS 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# entry $2 of comma list $1, 0 if there is none
+nth(){
+  v=$(echo "$1" | cut -s -d, -f$(($2 + 1)))
+  [ -z "$v" ] && [ "$2" -eq 0 ] && v=$(echo "$1" | cut -d, -f1)
+  echo "${v:-0}"
+}
+
+# field $2 of operation $1, from bbbench JSON in $3
+field(){
+  echo "$3" | sed -n "s/.*\"$1\":{[^}]*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+start_cluster(){
+  n=$1
+  i=0
+  while [ $i -lt "$n" ]; do
+    delay=$(nth "$DELAYS" $i)
+    drop=$(nth "$DROPS" $i)
+    if [ "$delay" != 0 ] || [ "$drop" != 0 ]; then
+      "$BIN/bbproxy" -l $((PROXYPORT + i)) -t localhost:$((SYNCPORT + i)) -d "$delay" -x "$drop" &
+      PIDS="$PIDS $!"
+    fi
+    i=$((i + 1))
+  done
+
+  i=0
+  while [ $i -lt "$n" ]; do
+    peers=""
+    j=0
+    while [ $j -lt "$n" ]; do
+      if [ $j -ne $i ]; then
+        if [ $SYNCUDS -eq 1 ]; then
+          peers="$peers $WORK/node$j/sync.sock"
+        elif [ "$(nth "$DELAYS" $j)" != 0 ] || [ "$(nth "$DROPS" $j)" != 0 ]; then
+          peers="$peers localhost:$((PROXYPORT + j))"
+        else
+          peers="$peers localhost:$((SYNCPORT + j))"
+        fi
+      fi
+      j=$((j + 1))
+    done
+
+    dir="$WORK/node$i"
+    mkdir -p "$dir"
+    {
+      echo "THMAX=$((CONNS + n + 2))"
+      echo "BBPORT=$((BBPORT + i))"
+      echo "SYNCPORT=$((SYNCPORT + i))"
+      [ $UDS -eq 1 ] && echo "BBSOCK=$dir/bb.sock"
+      [ $SYNCUDS -eq 1 ] && echo "SYNCSOCK=$dir/sync.sock"
+      echo "BBFILE=data.bb"
+      [ -n "$peers" ] && echo "PEERS=${peers# }"
+      echo "DAEMON=0"
+      echo "DEBUG=0"
+    } > "$dir/bbserv.conf"
+
+    (cd "$dir" && exec "$BIN/bbserv" -f) > "$dir/bbserv.log" 2>&1 &
+    PIDS="$PIDS $!"
+    i=$((i + 1))
+  done
+  sleep 1
+}
+
+stop_cluster(){
+  kill -9 $PIDS 2>/dev/null
+  wait 2>/dev/null
+  PIDS=""
+  rm -rf "$WORK"/node*
+}
+
+printf "%-6s %-6s %-5s %10s %9s %9s %9s %9s %8s\n" \
+  "nodes" "peers" "node" "writes/s" "p50(us)" "p99(us)" "p999(us)" "max(us)" "errors"
+
+n=$FIRST
+while [ "$n" -le "$NODES" ]; do
+  start_cluster "$n"
+
+  last=0
+  [ $ALL -eq 1 ] && last=$((n - 1))
+  i=0
+  benches=""
+  while [ $i -le $last ]; do
+    if [ $UDS -eq 1 ]; then
+      target="-u $WORK/node$i/bb.sock"
+    else
+      target="-p $((BBPORT + i))"
+    fi
+    "$BIN/bbbench" $target -c "$CONNS" -d "$DURATION" -m "$MIX" -j > "$WORK/bench$i.json" &
+    benches="$benches $!"
+    i=$((i + 1))
+  done
+  wait $benches
+
+  i=0
+  while [ $i -le $last ]; do
+    json=$(cat "$WORK/bench$i.json")
+    [ -n "$OUT" ] && echo "{\"nodes\":$n,\"node\":$i,\"uds\":$UDS,\"syncuds\":$SYNCUDS,\"delays\":\"$DELAYS\",\"drops\":\"$DROPS\",\"bench\":$json}" >> "$OUT"
+    printf "%-6s %-6s %-5s %10s %9s %9s %9s %9s %8s\n" "$n" $((n - 1)) "$i" \
+      "$(field write ops_per_s "$json")" "$(field write p50_us "$json")" \
+      "$(field write p99_us "$json")" "$(field write p999_us "$json")" \
+      "$(field write max_us "$json")" "$(field write errors "$json")"
+    i=$((i + 1))
+  done
+
+  stop_cluster
+  n=$((n + 1))
+done
+exit 0
@@ -0,0 +1,180 @@
+#!/bin/bash
+# Starts bbserv on loopback, in two groups: g0 with nodes 0, 1 and 2
+# (peers of each other), and g1 with node 3 alone. Boards a and b are on
+# g0, c and d on g1. Then plays client sessions against them and checks
+# the replies: SEARCH after REPLACE and after a reverted REPLACE,
+# LISTUSER after a REPLACE by another user, THROTTLED replies, BOARD,
+# and requests ROUTEd to the other group.
+#
+# Sessions send all their requests at once, then QUIT, and read the
+# replies until the server hangs up. Needs bash, for /dev/tcp.
+# Exits 1 if a check failed.
+
+BBPORT=9600     # client port of node i is BBPORT+i
+SYNCPORT=10600  # sync port of node i is SYNCPORT+i
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+if [ ! -x "$BIN/bbserv" ]; then
+  echo "Error: $BIN/bbserv is missing, run make first" >&2
+  exit 1
+fi
+
+WORK=$(mktemp -d /tmp/bbsession.XXXXXX)
+PIDS=""
+FAILS=0
+
+# bbserv ignores SIGTERM, and its data is thrown away anyway
+cleanup(){
+  [ -n "$PIDS" ] && kill -9 $PIDS 2>/dev/null
+  sleep 0.2
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# config of node $1, with extra lines $2...
+node_conf(){
+  i=$1
+  shift
+  {
+    echo "BBPORT=$((BBPORT + i))"
+    echo "SYNCPORT=$((SYNCPORT + i))"
+    for b in a b c d; do
+      echo "BBFILE=$b:$b.bb"
+    done
+    echo "DAEMON=0"
+    echo "DEBUG=0"
+    if [ "$i" -lt 3 ]; then
+      peers=""
+      for j in 0 1 2; do
+        [ "$j" -ne "$i" ] && peers="$peers localhost:$((SYNCPORT + j))"
+      done
+      echo "PEERS=${peers# }"
+      echo "GROUP=g0"
+      echo "ROUTE=g1 localhost:$((SYNCPORT + 3))"
+    else
+      echo "GROUP=g1"
+      echo "ROUTE=g0 localhost:$SYNCPORT localhost:$((SYNCPORT + 1)) localhost:$((SYNCPORT + 2))"
+    fi
+    for line in "$@"; do
+      echo "$line"
+    done
+  } > "$WORK/node$i/bbserv.conf"
+}
+
+# session on node $1, runs requests $2...
+ask(){
+  port=$((BBPORT + $1))
+  shift
+  exec 3<>/dev/tcp/127.0.0.1/$port || return 1
+  printf '%s\n' "$@" QUIT >&3
+  timeout 10 cat <&3
+  exec 3<&-
+}
+
+# message number from a "3.0 WROTE n" reply in $1
+wrote(){
+  echo "$1" | sed -n 's/^3\.0 WROTE \([0-9]*\).*/\1/p' | head -1
+}
+
+# check named $1: reply $2 has a line matching $3, or with -n before
+# the name, has none
+check(){
+  want=1
+  if [ "$1" = "-n" ]; then
+    want=0
+    shift
+  fi
+  if echo "$2" | grep -Eq "$3"; then
+    got=1
+  else
+    got=0
+  fi
+  if [ $got -eq $want ]; then
+    echo "ok    $1"
+  else
+    echo "FAIL  $1"
+    echo "$2" | sed 's/^/      /'
+    FAILS=$((FAILS + 1))
+  fi
+}
+
+for i in 0 1 2 3; do
+  mkdir -p "$WORK/node$i"
+  if [ "$i" -eq 0 ]; then
+    node_conf $i "USERRATE=20:20"
+  else
+    node_conf $i
+  fi
+  (cd "$WORK/node$i" && exec "$BIN/bbserv" -f) > "$WORK/node$i/bbserv.log" 2>&1 &
+  PIDS="$PIDS $!"
+  disown $!  #so bash doesn't report it killed
+done
+sleep 1
+
+# SEARCH follows a REPLACE, on the coordinator and on a peer
+out=$(ask 1 "USER alice" "WRITE apple banana")
+n=$(wrote "$out")
+check "WRITE" "$out" "^3\.0 WROTE [0-9]+"
+check "SEARCH new message" "$(ask 1 "USER alice" "SEARCH apple")" "^2\.0 MESSAGE $n "
+ask 1 "USER alice" "REPLACE $n/cherry banana" > /dev/null
+check -n "SEARCH old word after REPLACE" "$(ask 1 "USER alice" "SEARCH apple")" "^2\.0 MESSAGE $n "
+check "SEARCH new word after REPLACE" "$(ask 1 "USER alice" "SEARCH cherry")" "^2\.0 MESSAGE $n "
+check "SEARCH new word after REPLACE, on a peer" "$(ask 0 "USER alice" "SEARCH cherry")" "^2\.0 MESSAGE $n "
+
+# node 2 refuses SYNC writes, so node 1 reverts the REPLACE it got from node 0
+node_conf 2 "INJECT=sync_write:0:100"
+kill -HUP $(cat "$WORK/node2/bbserv.pid")
+sleep 1
+check "REPLACE refused by a peer" "$(ask 0 "USER alice" "REPLACE $n/durian banana")" "^3\.2 ERROR WRITE"
+check -n "SEARCH reverted word" "$(ask 1 "USER alice" "SEARCH durian")" "^2\.0 MESSAGE $n "
+check "SEARCH word back after revert" "$(ask 1 "USER alice" "SEARCH cherry")" "^2\.0 MESSAGE $n "
+node_conf 2
+kill -HUP $(cat "$WORK/node2/bbserv.pid")
+sleep 1
+
+# LISTUSER follows the author of a REPLACE
+out=$(ask 1 "USER alice" "WRITE written by alice")
+n=$(wrote "$out")
+check "LISTUSER author" "$(ask 1 "USER alice" "LISTUSER alice")" "^2\.0 MESSAGE $n alice/"
+ask 1 "USER bob" "REPLACE $n/taken by bob" > /dev/null
+check -n "LISTUSER old author after REPLACE" "$(ask 1 "USER alice" "LISTUSER alice")" "^2\.0 MESSAGE $n "
+check "LISTUSER new author after REPLACE" "$(ask 0 "USER alice" "LISTUSER bob")" "^2\.0 MESSAGE $n bob/"
+
+# 50 READs at once are over USERRATE=20 on node 0, not on node 1
+reads=()
+for k in $(seq 50); do
+  reads+=("READ $n")
+done
+check "THROTTLED over USERRATE" "$(ask 0 "USER greedy" "${reads[@]}")" "^2\.2 ERROR THROTTLED retry in [0-9]+ ms"
+check -n "no THROTTLED without USERRATE" "$(ask 1 "USER greedy" "${reads[@]}")" "THROTTLED"
+
+# BOARD moves the session, and messages stay on their board
+check "BOARD starts on first" "$(ask 0 "USER carol" "BOARD")" "^1\.0 BOARD a$"
+out=$(ask 0 "USER carol" "BOARD b" "WRITE only on b")
+n=$(wrote "$out")
+check "BOARD b" "$out" "^1\.0 BOARD b$"
+check "READ on its board" "$(ask 1 "USER carol" "BOARD b" "READ $n")" "^2\.0 MESSAGE $n carol/only on b"
+check -n "READ on another board" "$(ask 1 "USER carol" "BOARD a" "READ $n")" "only on b"
+check "BOARD unknown" "$(ask 0 "USER carol" "BOARD nosuch")" "^2\.2 ERROR BOARD"
+check "BOARD in a batch" "$(ask 0 "USER carol" "BEGIN" "BOARD b")" "^2\.2 ERROR BOARD"
+
+# boards of g1 are ROUTEd from g0, and the other way
+out=$(ask 0 "USER dave" "BOARD c" "WRITE routed from g0")
+n=$(wrote "$out")
+check "routed WRITE" "$out" "^3\.0 WROTE [0-9]+"
+check "routed WRITE on its group" "$(ask 3 "USER dave" "BOARD c" "READ $n")" "^2\.0 MESSAGE $n dave/routed from g0"
+check "routed READ" "$(ask 1 "USER dave" "BOARD c" "READ $n")" "^2\.0 MESSAGE $n dave/routed from g0"
+out=$(ask 3 "USER dave" "BOARD a" "BEGIN" "WRITE one" "WRITE two" "COMMIT")
+check "routed batch" "$out" "^3\.0 WROTE [0-9]+-[0-9]+"
+n=$(echo "$out" | sed -n 's/^3\.0 WROTE [0-9]*-\([0-9]*\)/\1/p')
+check "routed batch on its group" "$(ask 2 "USER dave" "BOARD a" "READ $n")" "^2\.0 MESSAGE $n dave/two"
+check "routed WATCH" "$(ask 0 "USER dave" "BOARD d" "WATCH")" "^2\.2 ERROR WATCH board d is on group g1"
+check "routed in STATS" "$(ask 0 "STATS")" "^5\.0 STAT routed [1-9]"
+
+if [ $FAILS -gt 0 ]; then
+  echo "$FAILS checks failed"
+  exit 1
+fi
+echo "all checks passed"
+exit 0